@@ -8,21 +8,29 @@
 #include <QVariant>
 #include <QStringList>
 #include <QDir>
+#include <QMutexLocker>
 
 #include "RecognitionEngine.h"
+#include "TemplateDatabase.h"
+#include "PointTransform.h"
 
 
 AppState::AppState( RecognitionEngine* _recEngine):
-        recEngine(_recEngine)
+        recEngine(_recEngine), frameMailbox(RecognitionEngine::imgWidth, RecognitionEngine::imgHeight)
 {
-    for(int i = 0; i < 4; i++)
-        imageBoundary.append(QPointF());
 }
 
 
 void AppState::loadTemplateImageFeatures(QString& dbDirName)
 {
+    //the camera thread copies frames into the engine while templates are loaded, and a
+    //running recognition is waited for by reset()
+    QMutexLocker locker(&recEngineMutex);
     this->recEngine->reset();
+
+    //keep the built FLANN index next to the templates, it is reused while they don't change
+    this->recEngine->indexCacheFile = QDir(dbDirName).filePath("flann.index").toStdString();
+
     QDir dir(dbDirName, "*.xml");
     QFileInfoList fileList = dir.entryInfoList();
     std::vector<std::string> dbFileNames;
@@ -31,6 +39,14 @@ void AppState::loadTemplateImageFeatures(QString& dbDirName)
         std::string _name = fileInfo.canonicalFilePath().toStdString();
         dbFileNames.push_back(_name);
     }
+
+    //a packed template database, if present, replaces the xml files of the templates it holds;
+    //templates enrolled after it was packed are still read from their xml files
+    QFileInfo packedDb(QDir(dbDirName), TemplateDatabase::defaultFileName);
+    if(packedDb.exists() &&
+       this->recEngine->loadTemplateDatabase(packedDb.canonicalFilePath().toStdString(), dbFileNames))
+        return;
+
     this->recEngine->buildDatabase(dbFileNames);
 
 }
@@ -62,30 +78,39 @@ bool IsOutlineConvex(const std::vector<CvPoint2D32f> &O)
     return(XCh<=2 && YCh<=2);
 }
 
-bool AppState::updateDrawing()
+bool AppState::appendBoundary(int templateIndex, const float h[])
 {
 
-    std::vector<CvPoint2D32f> rectPoints;
-    int _h = recEngine->templateFeatures[recEngine->matchedTemplate].height;
-    int _w = recEngine->templateFeatures[recEngine->matchedTemplate].width;
-    std::vector<CvPoint2D32f> _srcPoints;
-    _srcPoints.push_back(cvPoint2D32f(0,0));
-    _srcPoints.push_back(cvPoint2D32f(0,_h));
-    _srcPoints.push_back(cvPoint2D32f(_w,_h));
-    _srcPoints.push_back(cvPoint2D32f(_w,0));
-    for(int i = 0; i < 4; i++)
-    {
-        CvPoint2D32f dst;
-        recEngine->transform(recEngine->homography, _srcPoints[i], dst);
-        rectPoints.push_back(dst);
-    }
+    int _h = recEngine->templateFeatures[templateIndex].height;
+    int _w = recEngine->templateFeatures[templateIndex].width;
+    CvPoint2D32f _srcPoints[4] = {cvPoint2D32f(0,0), cvPoint2D32f(0,_h), cvPoint2D32f(_w,_h), cvPoint2D32f(_w,0)};
+    std::vector<CvPoint2D32f> rectPoints(4);
+    PointTransform::transformRounded(h, _srcPoints, &rectPoints[0], 4);
     //check if convex polygon
     if(!IsOutlineConvex(rectPoints)) {
         return false;
     }
+    QPolygonF boundary;
     for(unsigned int i = 0; i < rectPoints.size(); i++)
+        boundary << QPointF(imgRatio * rectPoints[i].x, imgRatio * rectPoints[i].y);
+    imageBoundaries.append(boundary);
+    return true;
+}
+
+bool AppState::updateDrawing()
+{
+    imageBoundaries.clear();
+    for(int k = 0; k < RecognitionEngine::maxTargets; k++)
     {
-        imageBoundary[i].setX(imgRatio * rectPoints[i].x);
-        imageBoundary[i].setY(imgRatio * rectPoints[i].y);
+        const TrackedTarget& target = recEngine->targets[k];
+        if(target.active)
+            appendBoundary(target.templateIndex, target.homography);
     }
+    return !imageBoundaries.isEmpty();
+}
+
+bool AppState::updateRecognitionDrawing()
+{
+    imageBoundaries.clear();
+    return appendBoundary(recEngine->matchedTemplate, recEngine->homography);
 }
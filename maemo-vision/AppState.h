@@ -4,9 +4,12 @@
 #include <string>
 #include <QList>
 #include <QPointF>
+#include <QPolygonF>
 #include <QMutex>
 #include <QObject>
 
+#include "FrameMailbox.h"
+
 class RecognitionEngine;
 
 class AppState{
@@ -15,17 +18,24 @@ public:
     AppState(RecognitionEngine* _recEngine);
 
      void loadTemplateImageFeatures(QString& dbDirName);
+     //outlines of the tracked targets, or of the last recognized template for snapshots
      bool updateDrawing();
+     bool updateRecognitionDrawing();
 
      RecognitionEngine* recEngine;
      QMutex recEngineMutex;
 
-     QList<QPointF> imageBoundary;
+     //viewfinder frames at the engine resolution from the camera thread, which never waits for the vision code
+     FrameMailbox frameMailbox;
+
+     QList<QPolygonF> imageBoundaries;
 
 private:
 
      const static int imgRatio = 2; //processed images are half size in each direction
 
+     bool appendBoundary(int templateIndex, const float h[]);
+
 
 };
 
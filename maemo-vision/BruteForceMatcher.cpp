@@ -0,0 +1,208 @@
+#include "BruteForceMatcher.h"
+
+#include <cfloat>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define BRUTE_FORCE_AVX
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BRUTE_FORCE_SSE
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include "arm_neon.h"
+#define BRUTE_FORCE_NEON
+#endif
+
+void BruteForceMatcher::reset(int* indices, float* dists, int queryCount)
+{
+    for(int i = 0; i < 2 * queryCount; i++)
+    {
+        indices[i] = -1;
+        dists[i] = FLT_MAX;
+    }
+}
+
+float BruteForceMatcher::distance(const float* a, const float* b, int length)
+{
+    int i = 0;
+    float sum = 0;
+
+#if defined(BRUTE_FORCE_AVX)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    for(; i + 16 <= length; i += 16)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(d0, d0));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(d1, d1));
+    }
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 acc = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(BRUTE_FORCE_SSE)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for(; i + 8 <= length; i += 8)
+    {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    __m128 acc = _mm_add_ps(acc0, acc1);
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+#elif defined(BRUTE_FORCE_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+    for(; i + 8 <= length; i += 8)
+    {
+        float32x4_t d0 = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+        float32x4_t d1 = vsubq_f32(vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+        acc0 = vmlaq_f32(acc0, d0, d0);
+        acc1 = vmlaq_f32(acc1, d1, d1);
+    }
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    float32x2_t half = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#endif
+
+    //tail, and the whole descriptor without SIMD
+    for(; i < length; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+void BruteForceMatcher::update(const float* queries, int queryCount,
+                               const float* database, int databaseRows, int length,
+                               int firstRow, int* indices, float* dists)
+{
+    for(int q = 0; q < queryCount; q++)
+    {
+        const float* query = queries + q * length;
+        float best = dists[2*q];
+        float second = dists[2*q+1];
+        int bestRow = indices[2*q];
+        int secondRow = indices[2*q+1];
+
+        const float* row = database;
+        for(int r = 0; r < databaseRows; r++, row += length)
+        {
+            float d = distance(query, row, length);
+            if(d < second)
+            {
+                if(d < best)
+                {
+                    second = best;
+                    secondRow = bestRow;
+                    best = d;
+                    bestRow = firstRow + r;
+                }
+                else
+                {
+                    second = d;
+                    secondRow = firstRow + r;
+                }
+            }
+        }
+
+        dists[2*q] = best;
+        dists[2*q+1] = second;
+        indices[2*q] = bestRow;
+        indices[2*q+1] = secondRow;
+    }
+}
+
+int BruteForceMatcher::hammingDistance(const unsigned char* a, const unsigned char* b, int bytes)
+{
+    int i = 0;
+    int count = 0;
+
+#if defined(BRUTE_FORCE_NEON)
+    //per byte bit counts, widened pairwise so the sums never overflow
+    uint32x4_t acc = vdupq_n_u32(0);
+    for(; i + 16 <= bytes; i += 16)
+    {
+        uint8x16_t bits = vcntq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        acc = vpadalq_u16(acc, vpaddlq_u8(bits));
+    }
+    uint64x2_t sum = vpaddlq_u32(acc);
+    count = (int)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+#else
+    //compiles to the popcnt instruction where the target has it
+    for(; i + 8 <= bytes; i += 8)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        count += __builtin_popcountll(x ^ y);
+    }
+#endif
+
+    for(; i < bytes; i++)
+        count += __builtin_popcount(a[i] ^ b[i]);
+    return count;
+}
+
+void BruteForceMatcher::updateHamming(const unsigned char* queries, int queryCount,
+                                      const unsigned char* database, int databaseRows, int bytes,
+                                      int firstRow, int* indices, float* dists)
+{
+    for(int q = 0; q < queryCount; q++)
+    {
+        const unsigned char* query = queries + q * bytes;
+        float best = dists[2*q];
+        float second = dists[2*q+1];
+        int bestRow = indices[2*q];
+        int secondRow = indices[2*q+1];
+
+        const unsigned char* row = database;
+        for(int r = 0; r < databaseRows; r++, row += bytes)
+        {
+            int h = hammingDistance(query, row, bytes);
+            float d = (float)(h * h);
+            if(d < second)
+            {
+                if(d < best)
+                {
+                    second = best;
+                    secondRow = bestRow;
+                    best = d;
+                    bestRow = firstRow + r;
+                }
+                else
+                {
+                    second = d;
+                    secondRow = firstRow + r;
+                }
+            }
+        }
+
+        dists[2*q] = best;
+        dists[2*q+1] = second;
+        indices[2*q] = bestRow;
+        indices[2*q+1] = secondRow;
+    }
+}
+
+const char* BruteForceMatcher::kernelName()
+{
+#if defined(BRUTE_FORCE_AVX)
+    return "avx";
+#elif defined(BRUTE_FORCE_SSE)
+    return "sse";
+#elif defined(BRUTE_FORCE_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,43 @@
+#ifndef BRUTE_FORCE_MATCHER_H
+#define BRUTE_FORCE_MATCHER_H
+
+/* Exhaustive two nearest neighbour search over float descriptors,
+ * using AVX or SSE on x86 and NEON on ARM, with a scalar fallback,
+ * and over binary descriptors by Hamming distance with popcount.
+ * For small databases a full scan is faster and more accurate than
+ * an approximate KD-tree search.
+ *
+ * Results are kept as two (row, squared L2 distance) pairs per query,
+ * sorted by distance, in the same layout as the knnSearch() output of
+ * cv::flann::Index. A database stored in several blocks is searched
+ * by calling update() once per block with the row number of its first
+ * descriptor.
+ */
+class BruteForceMatcher {
+
+public:
+    // Set all results to "no neighbour" (row -1, infinite distance)
+    static void reset(int* indices, float* dists, int queryCount);
+
+    // Merge the two nearest rows of the database block into the results
+    static void update(const float* queries, int queryCount,
+                       const float* database, int databaseRows, int length,
+                       int firstRow, int* indices, float* dists);
+
+    // Squared L2 distance between two descriptors
+    static float distance(const float* a, const float* b, int length);
+
+    // Same for binary descriptors of the given number of bytes. The results
+    // hold squared Hamming distances, so one ratio test fits both kinds.
+    static void updateHamming(const unsigned char* queries, int queryCount,
+                              const unsigned char* database, int databaseRows, int bytes,
+                              int firstRow, int* indices, float* dists);
+
+    // Number of differing bits
+    static int hammingDistance(const unsigned char* a, const unsigned char* b, int bytes);
+
+    // Name of the compiled kernel, for reports
+    static const char* kernelName();
+};
+
+#endif
@@ -4,6 +4,7 @@
 
 #include <vector>
 #include <iostream>
+#include <cstring>
 #include <QMessageBox>
 
 #include "SoundPlayer.h"
@@ -12,6 +13,8 @@
 
 #include "AppState.h"
 #include "OverlayWidget.h"
+#include "FrameConvert.h"
+#include "FCamFrameSource.h"
 #include "RecognitionEngine.h"
 
 #include "arm_neon.h"
@@ -25,6 +28,11 @@ void CameraThread::run() {
         return;
     }
 
+    if (source) {
+        runFrameSource();
+        return;
+    }
+
     printf("Camera thread running...\n");
     
 
@@ -348,38 +356,17 @@ void CameraThread::run() {
         //bool isLocked = frame.image().lock();
         //if(isLocked)
         //{
-        if(appState->recEngine != NULL)
+        if(appState != NULL && frame.image().valid())
         {
-            appState->recEngineMutex.lock();
-            if(appState->recEngine->templateFeatures.size() > 0) //if have templates
-            {
-                // copy intensity channel
-                try{
-                    for (int y = 0; y < 480; ++y) {
-                        unsigned char *row = frame.image()(0, y);
-                        for (int x = 0; x < 640; ++x) {
-                            int idx = (x << 1) + 1;
-                            ((uchar*)(appState->recEngine->large_iplGray->imageData + appState->recEngine->large_iplGray->widthStep*y))[x] = row[idx];
-                        }
-                    }
-                    cvResize( appState->recEngine->large_iplGray, appState->recEngine->iplGray, CV_INTER_CUBIC);
-                }
-                catch( cv::Exception& e )
-                {
-                    const char* err_msg = e.what();
-                    printf("CV Exception in ProcessFrame: %s \n", err_msg );
-                    return;
-                }
-                appState->recEngineMutex.unlock();
-                //  frame.image().unlock();
-                emit viewfinderFrame();
-                if( takeViewFinderSnapshot ) {
-                    emit newSnapshotFrame(frame);
-                    takeViewFinderSnapshot = false;
-                }
+            SourceFrame sourceFrame;
+            FCamFrameSource::describe(frame, sourceFrame);
+            ingestFrame(sourceFrame);
+            //  frame.image().unlock();
+
+            if( takeViewFinderSnapshot ) {
+                emit newSnapshotFrame(frame);
+                takeViewFinderSnapshot = false;
             }
-            else
-                appState->recEngineMutex.unlock();
             // }
         }
     } //end while keep going
@@ -387,6 +374,52 @@ void CameraThread::run() {
     sensor.stop();
 }
 
+void CameraThread::runFrameSource() {
+    printf("Reading viewfinder frames from the %s source...\n", source->name());
+    if (!source->start()) {
+        printf("Frame source failed to start, exiting!\n");
+        return;
+    }
+
+    // no photos, focus or exposure control here, the frames go to the
+    // viewfinder and the vision code as the sensor's would
+    SourceFrame frame;
+    while (keepGoing && source->nextFrame(frame)) {
+        // sources keep their size, the first frame tells whether the vision code can use them
+        if (frame.index == 0 && appState != NULL &&
+            (frame.width != 2 * RecognitionEngine::imgWidth || frame.height != 2 * RecognitionEngine::imgHeight)) {
+            printf("Viewfinder frames are %dx%d, expected %dx%d\n", frame.width, frame.height,
+                   2 * RecognitionEngine::imgWidth, 2 * RecognitionEngine::imgHeight);
+            break;
+        }
+        FCam::Image framebuffer = overlay->framebuffer();
+        if (frame.width == (int)framebuffer.width() && frame.height == (int)framebuffer.height()) {
+            for (int y = 0; y < frame.height; y++)
+                memcpy(framebuffer(0, y), frame.uyvy + frame.step * y, 2 * frame.width);
+        }
+        if (appState != NULL)
+            ingestFrame(frame);
+    }
+    source->stop();
+    printf("Frame source finished\n");
+}
+
+void CameraThread::ingestFrame(const SourceFrame &frame) {
+    // intensity at half resolution into the mailbox, without waiting for the vision code;
+    // the snapshot view takes the full resolution one from the frame itself
+    // runFrameSource() checked the size of the source, the sensor's is fixed
+    MailboxFrame& mailboxFrame = appState->frameMailbox.backFrame();
+    FrameConvert::uyvyToHalfLuma(frame.uyvy, frame.step, mailboxFrame.luma);
+    mailboxFrame.timestamp = frame.timestamp;
+    mailboxFrame.exposure = frame.exposure;
+    mailboxFrame.gain = frame.gain;
+    mailboxFrame.shotId = frame.shotId;
+
+    // a dropped frame still has its notification queued, one is enough
+    if (appState->frameMailbox.publish())
+        emit viewfinderFrame();
+}
+
 /** Auto expose, making the yth percentile hit a brightness of x */
 void CameraThread::meter(FCam::Shot *s, FCam::Frame f, float x, float y) {
     if (!f || !s || !f.histogram().valid()) return;   
@@ -14,15 +14,18 @@ Q_DECLARE_METATYPE(FCam::Event);
 
 class OverlayWidget;
 class AppState;
+class FrameSource;
+struct SourceFrame;
 
 /** This thread uses FCam to control the camera. It uses its public
  * parameters member to guide its behavior, and emits signals when a
- * new viewfinder or photograph comes in. */
+ * new viewfinder or photograph comes in. Given a FrameSource, it takes
+ * its viewfinder frames from there instead and leaves the sensor alone. */
 class CameraThread : public QThread {
     Q_OBJECT;
 
   public:
-    CameraThread(QObject *parent = NULL) : QThread(parent), autoFocus(&lens), overlay(NULL), appState(NULL){
+    CameraThread(QObject *parent = NULL) : QThread(parent), autoFocus(&lens), overlay(NULL), appState(NULL), source(NULL){
         keepGoing = true;
         hdrViewfinder.resize(2);
         sensor.attach(&lens);
@@ -38,6 +41,12 @@ class CameraThread : public QThread {
         appState = _appState;
     }
 
+    // Where should viewfinder frames come from, if not from the sensor?
+    // Must be set before the thread starts.
+    void setFrameSource(FrameSource* _source) {
+        source = _source;
+    }
+
     // The requested state of the camera. Fiddle with this object to
     // change the behavior of the camera 
     CameraParameters parameters;
@@ -131,6 +140,12 @@ public slots:
 
     // Our own auto exposure algorithm 
     void meter(FCam::Shot *s, FCam::Frame f, float x, float y);
+
+    // The loop used instead of the sensor's when a frame source is set
+    void runFrameSource();
+
+    // Hand a viewfinder frame to the vision code
+    void ingestFrame(const SourceFrame &frame);
     
     // A lock that prevents the camera thread from exiting before
     // showing an error message. See exitGracefully() and panic()
@@ -140,6 +155,9 @@ public slots:
     // as a memory destination for viewfinding, and the recognition engine
     OverlayWidget* overlay;
     AppState* appState;
+
+    // Viewfinder frames from a recording or a generator, NULL for the sensor
+    FrameSource* source;
 };
 
 
@@ -0,0 +1,18 @@
+#include "FCamFrameSource.h"
+
+void FCamFrameSource::describe(const FCam::Frame& fcamFrame, SourceFrame& frame)
+{
+    FCam::Image image = fcamFrame.image();
+    frame.uyvy = image(0, 0);
+    frame.width = image.width();
+    frame.height = image.height();
+    frame.step = image.bytesPerRow();
+    FCam::Time start = fcamFrame.exposureStartTime();
+    frame.timestamp = (int64_t)start.s() * 1000000 + start.us();
+    frame.exposure = fcamFrame.exposure();
+    frame.gain = fcamFrame.gain();
+    frame.histogram = NULL;
+    frame.histogramBuckets = 0;
+    frame.shotId = fcamFrame.shot().id;
+    frame.index = 0;
+}
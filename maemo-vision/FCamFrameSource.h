@@ -0,0 +1,21 @@
+#ifndef FCAM_FRAME_SOURCE_H
+#define FCAM_FRAME_SOURCE_H
+
+#include "FrameSource.h"
+
+#include <FCam/N900.h>
+
+/* Viewfinder frames of the N900 sensor. CameraThread drives the sensor
+ * itself, for photos and its own exposure and focus control, so there is
+ * no sensor FrameSource; its frames are described as SourceFrames to go
+ * through the same ingest code as those of the other sources.
+ */
+class FCamFrameSource {
+
+public:
+    // A viewfinder frame of the sensor as a SourceFrame, which points into
+    // it and is valid while the frame is. The histogram is left out.
+    static void describe(const FCam::Frame& fcamFrame, SourceFrame& frame);
+};
+
+#endif
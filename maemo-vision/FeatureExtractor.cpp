@@ -0,0 +1,432 @@
+#include "FeatureExtractor.h"
+#include "WorkerPool.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+FeatureExtractor* FeatureExtractor::create(int descriptorType)
+{
+    switch(descriptorType)
+    {
+    case DESCRIPTOR_SURF:
+        return new SurfExtractor();
+    case DESCRIPTOR_BRIEF:
+        return new BriefExtractor();
+    }
+    printf("Unknown descriptor type %d \n", descriptorType);
+    return NULL;
+}
+
+int FeatureExtractor::matrixType(int descriptorType)
+{
+    return isBinary(descriptorType) ? CV_8U : CV_32F;
+}
+
+const char* FeatureExtractor::typeName(int descriptorType)
+{
+    switch(descriptorType)
+    {
+    case DESCRIPTOR_SURF:
+        return "surf";
+    case DESCRIPTOR_BRIEF:
+        return "brief";
+    }
+    return "unknown";
+}
+
+SurfExtractor::SurfExtractor()
+{
+    trainingParams = cvSURFParams(300, 0); //1000 for iPhone
+    trainingParams.nOctaves = 4; //4 default
+    trainingParams.nOctaveLayers = 2; //2 default
+
+    recognitionParams = cvSURFParams(600, 0); //900 for iPhone
+    recognitionParams.nOctaves = 1; //2 for iPhone
+    recognitionParams.nOctaveLayers = 2; //2 default
+
+    threadCount = 1;
+    pool = NULL;
+    jobImage = NULL;
+    jobMask = NULL;
+    jobParams = NULL;
+    jobDescriptorLength = 0;
+    jobFailed = 0;
+}
+
+SurfExtractor::~SurfExtractor()
+{
+    delete pool;
+    for(unsigned int i = 0; i < taskStorage.size(); i++)
+        cvReleaseMemStorage(&taskStorage[i]);
+}
+
+void SurfExtractor::setThreads(int threads)
+{
+    threads = std::max(1, threads);
+    if(threads == threadCount)
+        return;
+    delete pool;
+    pool = threads > 1 ? new WorkerPool(threads - 1) : NULL;
+    threadCount = threads;
+
+    while((int)taskStorage.size() < threadCount)
+        taskStorage.push_back(cvCreateMemStorage(0));
+}
+
+void SurfExtractor::setDetectorThreshold(double threshold)
+{
+    recognitionParams.hessianThreshold = std::max(50.0, std::min(5000.0, threshold));
+}
+
+void SurfExtractor::extract(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                            CvMemStorage* storage, bool training)
+{
+    const CvSURFParams& params = training ? trainingParams : recognitionParams;
+    if(pool != NULL && extractParallel(image, mask, keypoints, descriptors, storage, params))
+        return;
+    cvExtractSURF( image, mask, keypoints, descriptors, storage, params, 0 );
+}
+
+void SurfExtractor::detectBand(void* extractor, int band)
+{
+    SurfExtractor* self = (SurfExtractor*)extractor;
+    const Band& b = self->bands[band];
+    std::vector<CvSURFPoint>& kept = self->bandKeypoints[band];
+    CvMemStorage* storage = self->taskStorage[band];
+    kept.clear();
+    cvClearMemStorage(storage);
+
+    //headers over the band, the image is not copied
+    CvMat bandImage, bandMask;
+    cvGetSubRect(self->jobImage, &bandImage, b.detectRect);
+    CvMat* mask = self->jobMask ? cvGetSubRect(self->jobMask, &bandMask, b.detectRect) : NULL;
+
+    CvSeq* found = NULL;
+    try{
+        //keypoints only, descriptors are computed on the whole image
+        cvExtractSURF( &bandImage, mask, &found, NULL, storage, *self->jobParams, 0 );
+    }
+    catch( cv::Exception& e )
+    {
+        printf("Exception in surf band %d: %s \n", band, e.what());
+        self->jobFailed = 1;
+        return;
+    }
+
+    for(int i = 0; found != NULL && i < found->total; i++)
+    {
+        CvSURFPoint point = *(CvSURFPoint*)cvGetSeqElem(found, i);
+        point.pt.x += b.detectRect.x;
+        point.pt.y += b.detectRect.y;
+        if(point.pt.y >= b.firstRow && point.pt.y < b.lastRow)
+            kept.push_back(point);
+    }
+}
+
+void SurfExtractor::describeSlice(void* extractor, int slice)
+{
+    SurfExtractor* self = (SurfExtractor*)extractor;
+    int total = self->keypointBuffer.size();
+    int first = total * slice / self->threadCount;
+    int count = total * (slice + 1) / self->threadCount - first;
+    if(count == 0)
+        return;
+    CvMemStorage* storage = self->taskStorage[slice];
+    cvClearMemStorage(storage);
+
+    CvSeq* keypoints = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSURFPoint), storage);
+    cvSeqPushMulti(keypoints, &self->keypointBuffer[first], count);
+    CvSeq* descriptors = NULL;
+    try{
+        cvExtractSURF( self->jobImage, NULL, &keypoints, &descriptors, storage, *self->jobParams, 1 );
+    }
+    catch( cv::Exception& e )
+    {
+        printf("Exception in surf descriptors %d: %s \n", slice, e.what());
+        self->jobFailed = 1;
+        return;
+    }
+    if(descriptors == NULL || descriptors->total != count || keypoints->total != count)
+    {
+        self->jobFailed = 1;
+        return;
+    }
+    //orientations are assigned with the descriptors
+    cvCvtSeqToArray(keypoints, &self->keypointBuffer[first]);
+    cvCvtSeqToArray(descriptors, &self->descriptorBuffer[(size_t)first * self->jobDescriptorLength]);
+}
+
+bool SurfExtractor::extractParallel(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                                    CvMemStorage* storage, const CvSURFParams& params)
+{
+    //Hessian responses are sampled every step pixels in the coarsest octave, so bands
+    //start on multiples of it to sample the same positions as the whole image does.
+    //The largest filter reaches half its size around a sample, the non-maximum
+    //suppression and interpolation one step further.
+    int step = 1 << (params.nOctaves - 1);
+    int largestFilter = (9 + 6 * (params.nOctaveLayers + 1)) << (params.nOctaves - 1);
+    int border = largestFilter / 2 + 2 * step;
+
+    int bandHeight = image->height / threadCount / step * step;
+    if(bandHeight < step)
+        return false;
+
+    bands.resize(threadCount);
+    bandKeypoints.resize(threadCount);
+    for(int i = 0; i < threadCount; i++)
+    {
+        Band& b = bands[i];
+        b.firstRow = i * bandHeight;
+        b.lastRow = i == threadCount - 1 ? image->height : (i + 1) * bandHeight;
+        int top = std::max(0, b.firstRow - border) / step * step;
+        int bottom = std::min(image->height, b.lastRow + border);
+        b.detectRect = cvRect(0, top, image->width, bottom - top);
+    }
+
+    jobImage = image;
+    jobMask = mask;
+    jobParams = &params;
+    jobDescriptorLength = params.extended ? 128 : 64;
+    jobFailed = 0;
+
+    pool->run(detectBand, this, threadCount);
+    if(jobFailed)
+        return false;
+
+    keypointBuffer.clear();
+    for(int i = 0; i < threadCount; i++)
+        keypointBuffer.insert(keypointBuffer.end(), bandKeypoints[i].begin(), bandKeypoints[i].end());
+    descriptorBuffer.resize(keypointBuffer.size() * jobDescriptorLength);
+
+    pool->run(describeSlice, this, threadCount);
+    if(jobFailed)
+        return false;
+
+    *keypoints = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSURFPoint), storage);
+    *descriptors = cvCreateSeq(0, sizeof(CvSeq), jobDescriptorLength * sizeof(float), storage);
+    if(!keypointBuffer.empty())
+    {
+        cvSeqPushMulti(*keypoints, &keypointBuffer[0], keypointBuffer.size());
+        cvSeqPushMulti(*descriptors, &descriptorBuffer[0], keypointBuffer.size());
+    }
+    return true;
+}
+
+BriefExtractor::BriefExtractor()
+{
+    fastThreshold = 20;
+    maxTrainingKeypoints = 500;
+    maxRecognitionKeypoints = 300;
+    trainingLevels = 4;
+    levelScale = 0.71f;
+
+    smoothed = NULL;
+
+    //The test pattern must be identical wherever templates and frames are described,
+    //so it comes from a fixed integer generator: every coordinate is the sum of four
+    //uniform values in [-4, 4], roughly a Gaussian around the keypoint as in BRIEF.
+    uint32_t state = 0x2545F491;
+    signed char base[testCount][4];
+    for(int i = 0; i < testCount; i++)
+    {
+        for(int p = 0; p < 2; p++)
+        {
+            int x, y;
+            do
+            {
+                int v[2] = {0, 0};
+                for(int c = 0; c < 2; c++)
+                {
+                    for(int k = 0; k < 4; k++)
+                    {
+                        state = state * 1664525u + 1013904223u;
+                        v[c] += (int)((state >> 16) % 9) - 4;
+                    }
+                }
+                x = v[0];
+                y = v[1];
+            } while(x*x + y*y > patternRadius*patternRadius);
+            base[i][2*p] = (signed char)x;
+            base[i][2*p+1] = (signed char)y;
+        }
+    }
+
+    for(int b = 0; b < orientationBins; b++)
+    {
+        double angle = b * 2 * CV_PI / orientationBins;
+        double c = cos(angle), s = sin(angle);
+        for(int i = 0; i < testCount; i++)
+        {
+            for(int p = 0; p < 2; p++)
+            {
+                double x = base[i][2*p], y = base[i][2*p+1];
+                pattern[b][i][2*p] = (signed char)cvRound(x*c - y*s);
+                pattern[b][i][2*p+1] = (signed char)cvRound(x*s + y*c);
+            }
+        }
+    }
+
+    for(int dy = 0; dy <= orientationRadius; dy++)
+        orientationSpan[dy] = cvFloor(sqrt((double)(orientationRadius*orientationRadius - dy*dy)));
+}
+
+void BriefExtractor::setDetectorThreshold(double threshold)
+{
+    fastThreshold = std::max(5, std::min(100, cvRound(threshold)));
+}
+
+BriefExtractor::~BriefExtractor()
+{
+    if(smoothed)
+        cvReleaseImage(&smoothed);
+}
+
+//angle of the intensity centroid of the window around (x, y), in radians
+float BriefExtractor::orientation(const IplImage* level, int x, int y) const
+{
+    const uchar* center = (const uchar*)level->imageData + y * level->widthStep + x;
+    int step = level->widthStep;
+    int m10 = 0, m01 = 0;
+
+    for(int dx = -orientationRadius; dx <= orientationRadius; dx++)
+        m10 += dx * center[dx];
+
+    for(int dy = 1; dy <= orientationRadius; dy++)
+    {
+        const uchar* above = center - dy * step;
+        const uchar* below = center + dy * step;
+        int span = orientationSpan[dy];
+        for(int dx = -span; dx <= span; dx++)
+        {
+            int a = above[dx], b = below[dx];
+            m10 += dx * (a + b);
+            m01 += dy * (b - a);
+        }
+    }
+    return atan2f((float)m01, (float)m10);
+}
+
+static bool strongerCorner(const cv::KeyPoint& a, const cv::KeyPoint& b)
+{
+    return a.response > b.response;
+}
+
+//describe up to maxKeypoints of the strongest corners of one scale; scale maps the level back to the image
+void BriefExtractor::describeLevel(const IplImage* level, const IplImage* mask, float scale, int maxKeypoints)
+{
+    if(smoothed == NULL || smoothed->width != level->width || smoothed->height != level->height)
+    {
+        if(smoothed)
+            cvReleaseImage(&smoothed);
+        smoothed = cvCreateImage(cvGetSize(level), IPL_DEPTH_8U, 1);
+    }
+    //the binary tests compare single pixels, smoothing makes them robust to noise
+    cvSmooth(level, smoothed, CV_GAUSSIAN, 5, 5);
+
+    corners.clear();
+    cv::FAST(cv::Mat(level), corners, fastThreshold, true);
+
+    //drop corners too close to the border for the tests, or outside the mask
+    unsigned int kept = 0;
+    for(unsigned int i = 0; i < corners.size(); i++)
+    {
+        int x = cvRound(corners[i].pt.x), y = cvRound(corners[i].pt.y);
+        if(x < border || y < border || x >= level->width - border || y >= level->height - border)
+            continue;
+        if(mask)
+        {
+            int mx = std::min(cvRound(x / scale), mask->width - 1);
+            int my = std::min(cvRound(y / scale), mask->height - 1);
+            if(((const uchar*)(mask->imageData + my * mask->widthStep))[mx] == 0)
+                continue;
+        }
+        corners[kept++] = corners[i];
+    }
+    corners.resize(kept);
+
+    //keep the strongest responses
+    if((int)corners.size() > maxKeypoints)
+    {
+        std::nth_element(corners.begin(), corners.begin() + maxKeypoints, corners.end(), strongerCorner);
+        corners.resize(maxKeypoints);
+    }
+
+    int step = smoothed->widthStep;
+    for(unsigned int i = 0; i < corners.size(); i++)
+    {
+        int x = cvRound(corners[i].pt.x), y = cvRound(corners[i].pt.y);
+        float angle = orientation(smoothed, x, y);
+
+        int bin = cvRound(angle * orientationBins / (2 * CV_PI));
+        if(bin < 0)
+            bin += orientationBins;
+        if(bin >= orientationBins)
+            bin -= orientationBins;
+
+        const uchar* center = (const uchar*)smoothed->imageData + y * step + x;
+        size_t offset = descriptorBuffer.size();
+        descriptorBuffer.resize(offset + descriptorBytes);
+        uchar* descriptor = &descriptorBuffer[offset];
+        for(int j = 0; j < descriptorBytes; j++)
+        {
+            uchar bits = 0;
+            for(int k = 0; k < 8; k++)
+            {
+                const signed char* t = pattern[bin][j*8 + k];
+                if(center[t[1] * step + t[0]] < center[t[3] * step + t[2]])
+                    bits |= (uchar)(1 << k);
+            }
+            descriptor[j] = bits;
+        }
+
+        CvSURFPoint point;
+        point.pt = cvPoint2D32f(x / scale, y / scale);
+        point.laplacian = 0;
+        point.size = cvRound(2 * orientationRadius / scale);
+        point.dir = angle < 0 ? angle * (float)(180 / CV_PI) + 360 : angle * (float)(180 / CV_PI);
+        point.hessian = corners[i].response;
+        keypointBuffer.push_back(point);
+    }
+}
+
+void BriefExtractor::extract(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                             CvMemStorage* storage, bool training)
+{
+    keypointBuffer.clear();
+    descriptorBuffer.clear();
+
+    if(!training)
+    {
+        describeLevel(image, mask, 1.0f, maxRecognitionKeypoints);
+    }
+    else
+    {
+        describeLevel(image, mask, 1.0f, maxTrainingKeypoints);
+
+        //smaller copies of the template, so it is recognized further away than enrolled
+        float scale = 1.0f;
+        for(int l = 1; l < trainingLevels; l++)
+        {
+            scale *= levelScale;
+            CvSize size = cvSize(cvRound(image->width * scale), cvRound(image->height * scale));
+            if(size.width <= 2 * border || size.height <= 2 * border)
+                break;
+            IplImage* level = cvCreateImage(size, IPL_DEPTH_8U, 1);
+            cvResize(image, level, CV_INTER_AREA);
+            describeLevel(level, mask, (float)size.width / image->width, maxTrainingKeypoints);
+            cvReleaseImage(&level);
+        }
+    }
+
+    //one push each keeps a frame's descriptors in a single storage block
+    *keypoints = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvSURFPoint), storage);
+    *descriptors = cvCreateSeq(0, sizeof(CvSeq), descriptorBytes, storage);
+    if(!keypointBuffer.empty())
+    {
+        cvSeqPushMulti(*keypoints, &keypointBuffer[0], keypointBuffer.size());
+        cvSeqPushMulti(*descriptors, &descriptorBuffer[0], keypointBuffer.size());
+    }
+}
@@ -0,0 +1,172 @@
+#ifndef FEATURE_EXTRACTOR_H
+#define FEATURE_EXTRACTOR_H
+
+#include <opencv/cv.h>
+
+#include <vector>
+
+class WorkerPool;
+
+//Descriptor formats. The type is stored with every template, and a template
+//set is always matched with the extractor it was built with.
+enum DescriptorType
+{
+    DESCRIPTOR_SURF = 0,  //64 or 128 floats, compared by L2 distance
+    DESCRIPTOR_BRIEF = 1  //256 binary tests, compared by Hamming distance
+};
+
+/* Keypoint detection and description for templates and frames.
+ *
+ * Whatever the detector, keypoints are returned as CvSURFPoint (position,
+ * size, orientation in degrees, detector response) and descriptors as one
+ * fixed size element per keypoint, so matching, homography estimation
+ * and tracking are shared by all extractors.
+ */
+class FeatureExtractor {
+
+public:
+    virtual ~FeatureExtractor() {}
+
+    virtual int descriptorType() const = 0;
+    virtual const char* name() const = 0;
+
+    // Detect and describe keypoints in the 8 bit gray image, only where the
+    // optional mask is non zero. Templates are extracted with training set,
+    // camera frames without. Both sequences are allocated in storage.
+    virtual void extract(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                         CvMemStorage* storage, bool training) = 0;
+
+    // Number of cores extract() may use, ignored by single threaded extractors
+    virtual void setThreads(int threads) {}
+
+    // Detector threshold for camera frames, a higher one finds fewer keypoints.
+    // Values outside the range the detector supports are clamped.
+    virtual double detectorThreshold() const = 0;
+    virtual void setDetectorThreshold(double threshold) = 0;
+
+    // A new extractor of the given type, NULL for unknown types
+    static FeatureExtractor* create(int descriptorType);
+
+    // Matrix element type of the descriptors: CV_32F, or CV_8U for binary descriptors
+    static int matrixType(int descriptorType);
+    static bool isBinary(int descriptorType) {return descriptorType == DESCRIPTOR_BRIEF;}
+    static const char* typeName(int descriptorType);
+};
+
+/* cvExtractSURF, optionally spread over several cores. Keypoints are then
+ * detected in horizontal bands of the image, one per core, each grown by
+ * the border the largest Hessian filter needs so that responses match a
+ * whole image run. A keypoint found in the overlap of two bands is kept
+ * only by the band whose own rows contain it. Descriptors are computed
+ * afterwards for equal slices of the keypoints, on the whole image, since
+ * their windows reach much further than the detector's.
+ */
+class SurfExtractor : public FeatureExtractor {
+
+public:
+    SurfExtractor();
+    ~SurfExtractor();
+
+    int descriptorType() const {return DESCRIPTOR_SURF;}
+    const char* name() const {return "surf";}
+
+    void extract(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                 CvMemStorage* storage, bool training);
+
+    void setThreads(int threads);
+    int threads() const {return threadCount;}
+
+    //Hessian threshold of recognitionParams, between 50 and 5000
+    double detectorThreshold() const {return recognitionParams.hessianThreshold;}
+    void setDetectorThreshold(double threshold);
+
+    CvSURFParams trainingParams;
+    CvSURFParams recognitionParams;
+
+private:
+    int threadCount;
+    WorkerPool* pool; //threadCount - 1 workers, the caller takes a share too
+
+    //current parallel extraction
+    struct Band
+    {
+        CvRect detectRect; //rows searched, in image coordinates
+        int firstRow;      //rows whose keypoints the band keeps
+        int lastRow;
+    };
+    const IplImage* jobImage;
+    const IplImage* jobMask;
+    const CvSURFParams* jobParams;
+    int jobDescriptorLength;
+    volatile int jobFailed;
+    std::vector<Band> bands;
+    std::vector< std::vector<CvSURFPoint> > bandKeypoints;
+    std::vector<CvMemStorage*> taskStorage;
+    std::vector<CvSURFPoint> keypointBuffer;
+    std::vector<float> descriptorBuffer;
+
+    bool extractParallel(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                         CvMemStorage* storage, const CvSURFParams& params);
+    static void detectBand(void* extractor, int band);
+    static void describeSlice(void* extractor, int slice);
+
+    SurfExtractor(const SurfExtractor&);
+    SurfExtractor& operator=(const SurfExtractor&);
+};
+
+/* FAST corners described by 256 intensity comparisons on a smoothed patch
+ * (BRIEF), with the test pattern rotated to the intensity centroid
+ * orientation of the corner as in ORB. Templates are described at several
+ * scales so they can be recognized smaller than enrolled; frames are
+ * described at their own scale only.
+ */
+class BriefExtractor : public FeatureExtractor {
+
+public:
+    BriefExtractor();
+    ~BriefExtractor();
+
+    int descriptorType() const {return DESCRIPTOR_BRIEF;}
+    const char* name() const {return "brief";}
+
+    void extract(const IplImage* image, const IplImage* mask, CvSeq** keypoints, CvSeq** descriptors,
+                 CvMemStorage* storage, bool training);
+
+    //FAST threshold, between 5 and 100
+    double detectorThreshold() const {return fastThreshold;}
+    void setDetectorThreshold(double threshold);
+
+    const static int descriptorBytes = 32;
+
+    int fastThreshold;
+    int maxTrainingKeypoints;    //per scale
+    int maxRecognitionKeypoints;
+    int trainingLevels;
+    float levelScale;            //size of a training level relative to the previous one
+
+private:
+    const static int testCount = descriptorBytes * 8;
+    const static int orientationBins = 30;
+    const static int patternRadius = 12;     //all tests lie within this radius, in any rotation
+    const static int orientationRadius = 15; //radius of the intensity centroid window
+    const static int border = orientationRadius + 1;
+
+    //x1, y1, x2, y2 of every test, one copy per orientation bin
+    signed char pattern[orientationBins][testCount][4];
+    //half widths of the rows of the orientation window
+    int orientationSpan[orientationRadius + 1];
+
+    //buffers reused between frames
+    IplImage* smoothed;
+    std::vector<cv::KeyPoint> corners;
+    std::vector<CvSURFPoint> keypointBuffer;
+    std::vector<uchar> descriptorBuffer;
+
+    void describeLevel(const IplImage* level, const IplImage* mask, float scale, int maxKeypoints);
+    float orientation(const IplImage* level, int x, int y) const;
+
+    BriefExtractor(const BriefExtractor&);
+    BriefExtractor& operator=(const BriefExtractor&);
+};
+
+#endif
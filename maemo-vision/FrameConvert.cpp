@@ -0,0 +1,139 @@
+#include "FrameConvert.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define FRAME_CONVERT_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRAME_CONVERT_SSE
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include "arm_neon.h"
+#define FRAME_CONVERT_NEON
+#endif
+
+void FrameConvert::uyvyToLuma(const unsigned char* src, int srcStep,
+                              unsigned char* dst, int dstStep, int width, int height)
+{
+    for(int y = 0; y < height; y++, src += srcStep, dst += dstStep)
+    {
+        int x = 0;
+
+#if defined(FRAME_CONVERT_AVX2)
+        for(; x + 32 <= width; x += 32)
+        {
+            //keep the high byte of each 16 bit pair, pack works per 128 bit lane
+            __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(src + 2*x)), 8);
+            __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(src + 2*x + 32)), 8);
+            __m256i luma = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i*)(dst + x), luma);
+        }
+#elif defined(FRAME_CONVERT_SSE)
+        for(; x + 16 <= width; x += 16)
+        {
+            __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(src + 2*x)), 8);
+            __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(src + 2*x + 16)), 8);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+        }
+#elif defined(FRAME_CONVERT_NEON)
+        for(; x + 16 <= width; x += 16)
+        {
+            //de-interleave: val[0] holds the chroma bytes, val[1] the luma
+            uint8x16x2_t p = vld2q_u8(src + 2*x);
+            vst1q_u8(dst + x, p.val[1]);
+        }
+#endif
+
+        for(; x < width; x++)
+            dst[x] = src[2*x + 1];
+    }
+}
+
+void FrameConvert::uyvyToLuma(const unsigned char* src, int srcStep, IplImage* dst)
+{
+    uyvyToLuma(src, srcStep, (unsigned char*)dst->imageData, dst->widthStep, dst->width, dst->height);
+}
+
+void FrameConvert::uyvyToHalfLuma(const unsigned char* src, int srcStep,
+                                  unsigned char* dst, int dstStep, int width, int height)
+{
+    for(int y = 0; y < height; y++, src += 2*srcStep, dst += dstStep)
+    {
+        const unsigned char* row0 = src;
+        const unsigned char* row1 = src + srcStep;
+        int x = 0;
+
+        //each output pixel reads 4 bytes, U Y0 V Y1, of two rows
+#if defined(FRAME_CONVERT_AVX2)
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i two = _mm256_set1_epi32(2);
+        const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        for(; x + 32 <= width; x += 32)
+        {
+            __m256i sums[4];
+            for(int k = 0; k < 4; k++)
+            {
+                //luma of both rows as 16 bit, then pairs summed into 32 bit
+                __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(row0 + 4*x + 32*k)), 8);
+                __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(row1 + 4*x + 32*k)), 8);
+                __m256i s = _mm256_madd_epi16(_mm256_add_epi16(a, b), ones);
+                sums[k] = _mm256_srli_epi32(_mm256_add_epi32(s, two), 2);
+            }
+            //packs work per 128 bit lane, gather the 4 pixel groups back in order
+            __m256i p = _mm256_packus_epi16(_mm256_packs_epi32(sums[0], sums[1]),
+                                            _mm256_packs_epi32(sums[2], sums[3]));
+            _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permutevar8x32_epi32(p, order));
+        }
+#elif defined(FRAME_CONVERT_SSE)
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i two = _mm_set1_epi32(2);
+        for(; x + 16 <= width; x += 16)
+        {
+            __m128i sums[4];
+            for(int k = 0; k < 4; k++)
+            {
+                __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(row0 + 4*x + 16*k)), 8);
+                __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(row1 + 4*x + 16*k)), 8);
+                __m128i s = _mm_madd_epi16(_mm_add_epi16(a, b), ones);
+                sums[k] = _mm_srli_epi32(_mm_add_epi32(s, two), 2);
+            }
+            __m128i p = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]),
+                                         _mm_packs_epi32(sums[2], sums[3]));
+            _mm_storeu_si128((__m128i*)(dst + x), p);
+        }
+#elif defined(FRAME_CONVERT_NEON)
+        for(; x + 16 <= width; x += 16)
+        {
+            //val[1] and val[3] hold the two luma bytes of each output pixel
+            uint8x16x4_t a = vld4q_u8(row0 + 4*x);
+            uint8x16x4_t b = vld4q_u8(row1 + 4*x);
+            uint16x8_t low = vaddq_u16(vaddl_u8(vget_low_u8(a.val[1]), vget_low_u8(a.val[3])),
+                                       vaddl_u8(vget_low_u8(b.val[1]), vget_low_u8(b.val[3])));
+            uint16x8_t high = vaddq_u16(vaddl_u8(vget_high_u8(a.val[1]), vget_high_u8(a.val[3])),
+                                        vaddl_u8(vget_high_u8(b.val[1]), vget_high_u8(b.val[3])));
+            //rounding narrowing shift: (sum + 2) >> 2
+            vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(low, 2), vrshrn_n_u16(high, 2)));
+        }
+#endif
+
+        for(; x < width; x++)
+            dst[x] = (row0[4*x + 1] + row0[4*x + 3] + row1[4*x + 1] + row1[4*x + 3] + 2) >> 2;
+    }
+}
+
+void FrameConvert::uyvyToHalfLuma(const unsigned char* src, int srcStep, IplImage* dst)
+{
+    uyvyToHalfLuma(src, srcStep, (unsigned char*)dst->imageData, dst->widthStep, dst->width, dst->height);
+}
+
+const char* FrameConvert::kernelName()
+{
+#if defined(FRAME_CONVERT_AVX2)
+    return "avx2";
+#elif defined(FRAME_CONVERT_SSE)
+    return "sse2";
+#elif defined(FRAME_CONVERT_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
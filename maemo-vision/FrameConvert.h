@@ -0,0 +1,33 @@
+#ifndef FRAME_CONVERT_H
+#define FRAME_CONVERT_H
+
+#include <opencv/cv.h>
+
+/* Pixel format conversions of viewfinder frames. The N900 viewfinder
+ * delivers UYVY (Y422), two bytes per pixel with the luma in the odd
+ * bytes. The kernels use AVX2 or SSE2 on x86 and NEON on ARM, with a
+ * scalar fallback, and handle any width.
+ */
+class FrameConvert {
+
+public:
+    // dst[x] = src[2x + 1] for each row, steps are in bytes
+    static void uyvyToLuma(const unsigned char* src, int srcStep,
+                           unsigned char* dst, int dstStep, int width, int height);
+
+    // Same into an 8 bit single channel image, which gives the size
+    static void uyvyToLuma(const unsigned char* src, int srcStep, IplImage* dst);
+
+    // Luma at half the width and height in one pass, each output pixel the
+    // rounded mean of a 2x2 block. width and height are those of dst.
+    static void uyvyToHalfLuma(const unsigned char* src, int srcStep,
+                               unsigned char* dst, int dstStep, int width, int height);
+
+    // Same into an 8 bit single channel image, which gives the size
+    static void uyvyToHalfLuma(const unsigned char* src, int srcStep, IplImage* dst);
+
+    // Name of the compiled kernel, for reports
+    static const char* kernelName();
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include "FrameMailbox.h"
+
+FrameMailbox::FrameMailbox(int width, int height) : middle(1), dropped(0)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        slots[i].luma = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+        slots[i].timestamp = 0;
+        slots[i].exposure = 0;
+        slots[i].gain = 0;
+        slots[i].shotId = -1;
+        slots[i].sequence = 0;
+    }
+    back = 0;
+    front = 2;
+    published = 0;
+}
+
+FrameMailbox::~FrameMailbox()
+{
+    for(int i = 0; i < 3; i++)
+        cvReleaseImage(&slots[i].luma);
+}
+
+bool FrameMailbox::publish()
+{
+    slots[back].sequence = published;
+    published = published + 1;
+
+    //ordered, so the consumer sees the filled slot once it sees the index
+    int _previous = middle.fetchAndStoreOrdered(back | freshBit);
+    back = _previous & ~freshBit;
+    if(_previous & freshBit)
+    {
+        dropped.fetchAndAddRelaxed(1);
+        return false;
+    }
+    return true;
+}
+
+MailboxFrame* FrameMailbox::takeLatest()
+{
+    int _middle = middle;
+    if(!(_middle & freshBit))
+        return NULL;
+
+    //the producer may have published again since, the swap still gets the newest
+    int _previous = middle.fetchAndStoreOrdered(front);
+    front = _previous & ~freshBit;
+    return &slots[front];
+}
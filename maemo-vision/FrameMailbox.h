@@ -0,0 +1,58 @@
+#ifndef FRAME_MAILBOX_H
+#define FRAME_MAILBOX_H
+
+#include <opencv/cv.h>
+#include <QAtomicInt>
+
+#include <stdint.h>
+
+//A viewfinder frame handed from the camera thread to the vision code
+struct MailboxFrame
+{
+    IplImage* luma;         //intensity, at the size given to the mailbox
+    int64_t timestamp;      //exposure start in microseconds
+    int exposure;           //microseconds
+    float gain;
+    int shotId;
+    unsigned int sequence;  //frames published before this one
+};
+
+/* Latest-frame-wins handoff between one producer and one consumer thread,
+ * triple buffered so neither side ever waits on the other.
+ *
+ * The producer fills backFrame() and publishes it, which swaps it with the
+ * middle slot. The consumer swaps the middle slot with its own when a newer
+ * frame is there, so it always gets the newest one; a frame overwritten
+ * before the consumer took it is counted as dropped.
+ */
+class FrameMailbox {
+
+public:
+    FrameMailbox(int width, int height);
+    ~FrameMailbox();
+
+    // Producer: the slot to fill, and hand it over. Returns false when an
+    // untaken frame was dropped for it, so the consumer is already due to
+    // look and needs no new notification.
+    MailboxFrame& backFrame() {return slots[back];}
+    bool publish();
+
+    // Consumer: the newest frame, or NULL if nothing was published since the
+    // last call. It stays valid until the next call.
+    MailboxFrame* takeLatest();
+
+    int droppedFrames() const {return dropped;}
+    unsigned int publishedFrames() const {return published;}
+
+private:
+    const static int freshBit = 4;
+
+    MailboxFrame slots[3];
+    int back;            //owned by the producer
+    int front;           //owned by the consumer
+    QAtomicInt middle;   //slot index, with freshBit while it holds an untaken frame
+    QAtomicInt dropped;
+    volatile unsigned int published;
+};
+
+#endif
@@ -0,0 +1,484 @@
+#include "FrameSource.h"
+
+#include <opencv/highgui.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+//same bucket count as the FCam viewfinder histogram
+static const int histogramBuckets = 64;
+
+static double currentTimeMs()
+{
+    return (double)cvGetTickCount() / (cvGetTickFrequency() * 1000.0);
+}
+
+//Sleep until the frame is due, a late frame is delivered at once
+static void waitForFrame(double startMs, int index, double fps)
+{
+    double wait = startMs + index * 1000.0 / fps - currentTimeMs();
+    if(wait > 0)
+        usleep((useconds_t)(wait * 1000));
+}
+
+//Luma histogram of every second pixel of every second row
+static void lumaHistogram(const unsigned char* uyvy, int step, int width, int height, std::vector<int>& histogram)
+{
+    histogram.assign(histogramBuckets, 0);
+    for(int y = 0; y < height; y += 2)
+    {
+        const unsigned char* row = uyvy + step*y;
+        for(int x = 0; x < width; x += 2)
+            histogram[row[2*x + 1] * histogramBuckets >> 8]++;
+    }
+}
+
+//Frame metadata of the sources without a sensor: stream time, a full frame exposure
+static void describeFrame(SourceFrame& frame, const std::vector<unsigned char>& uyvy, int width, int height,
+                          double fps, const std::vector<int>& histogram, int index)
+{
+    frame.uyvy = &uyvy[0];
+    frame.width = width;
+    frame.height = height;
+    frame.step = 2 * width;
+    frame.timestamp = (int64_t)(index * 1000000.0 / fps);
+    frame.exposure = (int)(1000000.0 / fps);
+    frame.gain = 1.0f;
+    frame.histogram = &histogram[0];
+    frame.histogramBuckets = (int)histogram.size();
+    frame.shotId = 0;
+    frame.index = index;
+}
+
+FrameSource* FrameSource::create(const std::string& description)
+{
+    size_t colon = description.find(':');
+    if(colon == std::string::npos)
+    {
+        printf("Unknown frame source %s \n", description.c_str());
+        return NULL;
+    }
+    std::string kind = description.substr(0, colon);
+
+    //the path, then comma separated options
+    std::vector<std::string> items;
+    size_t start = colon + 1;
+    while(true)
+    {
+        size_t comma = description.find(',', start);
+        items.push_back(description.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+        if(comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    if(items[0].empty())
+    {
+        printf("Missing path in frame source %s \n", description.c_str());
+        return NULL;
+    }
+
+    bool realTime = true;
+    bool loop = false;
+    int width = 640, height = 480;
+    double fps = 30;
+    int frameCount = 0;
+    std::string trajectoryPath;
+    for(unsigned int i = 1; i < items.size(); i++)
+    {
+        const std::string& option = items[i];
+        if(option == "fast")
+            realTime = false;
+        else if(option == "loop")
+            loop = true;
+        else if(option.compare(0, 5, "size=") == 0 && sscanf(option.c_str() + 5, "%dx%d", &width, &height) == 2)
+            ;
+        else if(option.compare(0, 4, "fps=") == 0 && (fps = atof(option.c_str() + 4)) > 0)
+            ;
+        else if(option.compare(0, 7, "frames=") == 0)
+            frameCount = atoi(option.c_str() + 7);
+        else if(option.compare(0, 11, "trajectory=") == 0)
+            trajectoryPath = option.substr(11);
+        else
+        {
+            printf("Unknown frame source option %s \n", option.c_str());
+            return NULL;
+        }
+    }
+
+    if(kind == "file")
+        return new FileFrameSource(items[0], realTime, loop, width, height, fps);
+    if(kind == "synthetic")
+        return new SyntheticFrameSource(items[0], trajectoryPath, frameCount, realTime, width, height, fps);
+    printf("Unknown frame source %s \n", kind.c_str());
+    return NULL;
+}
+
+FileFrameSource::FileFrameSource(const std::string& path, bool realTime, bool loop,
+                                 int rawWidth, int rawHeight, double rawFps) :
+        path(path), realTime(realTime), loop(loop)
+{
+    file = NULL;
+    y4m = false;
+    dataStart = 0;
+    chromaWidth = 0;
+    chromaHeight = 0;
+    width = rawWidth;
+    height = rawHeight;
+    fps = rawFps;
+    index = 0;
+    startMs = 0;
+}
+
+FileFrameSource::~FileFrameSource()
+{
+    stop();
+}
+
+void FileFrameSource::stop()
+{
+    if(file)
+    {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+bool FileFrameSource::start()
+{
+    stop();
+    file = fopen(path.c_str(), "rb");
+    if(!file)
+    {
+        printf("Can't open %s \n", path.c_str());
+        return false;
+    }
+    if(!readHeader())
+    {
+        stop();
+        return false;
+    }
+    if(width <= 0 || height <= 0 || width % 2 != 0 || fps <= 0)
+    {
+        printf("Unusable frame size %dx%d at %.2f fps in %s \n", width, height, fps, path.c_str());
+        stop();
+        return false;
+    }
+
+    uyvy.resize(2 * width * height);
+    planes.resize(width * height + 2 * chromaWidth * chromaHeight);
+    index = 0;
+    startMs = currentTimeMs();
+    return true;
+}
+
+bool FileFrameSource::readHeader()
+{
+    char header[512];
+    if(!fgets(header, sizeof(header), file) || strncmp(header, "YUV4MPEG2", 9) != 0)
+    {
+        //raw UYVY frames, of the size given
+        y4m = false;
+        chromaWidth = chromaHeight = 0;
+        dataStart = 0;
+        return fseek(file, 0, SEEK_SET) == 0;
+    }
+
+    //parameters are separated by spaces, the colour space defaults to 4:2:0
+    y4m = true;
+    width = height = 0;
+    std::string colorSpace = "420";
+    char* token = strtok(header + 9, " \n");
+    while(token)
+    {
+        int numerator = 0, denominator = 0;
+        if(token[0] == 'W')
+            width = atoi(token + 1);
+        else if(token[0] == 'H')
+            height = atoi(token + 1);
+        else if(token[0] == 'C')
+            colorSpace = token + 1;
+        else if(token[0] == 'F' && sscanf(token + 1, "%d:%d", &numerator, &denominator) == 2 && denominator > 0)
+            fps = (double)numerator / denominator;
+        token = strtok(NULL, " \n");
+    }
+
+    if(colorSpace.compare(0, 4, "mono") == 0)
+        chromaWidth = chromaHeight = 0;
+    else if(colorSpace.compare(0, 3, "444") == 0)
+    {
+        chromaWidth = width;
+        chromaHeight = height;
+    }
+    else if(colorSpace.compare(0, 3, "422") == 0)
+    {
+        chromaWidth = (width + 1) / 2;
+        chromaHeight = height;
+    }
+    else if(colorSpace.compare(0, 3, "420") == 0)
+    {
+        chromaWidth = (width + 1) / 2;
+        chromaHeight = (height + 1) / 2;
+    }
+    else
+    {
+        printf("Unsupported y4m colour space C%s \n", colorSpace.c_str());
+        return false;
+    }
+    dataStart = ftell(file);
+    return true;
+}
+
+bool FileFrameSource::readFrame()
+{
+    if(y4m)
+        return readY4MFrame();
+    return fread(&uyvy[0], 1, uyvy.size(), file) == uyvy.size();
+}
+
+bool FileFrameSource::readY4MFrame()
+{
+    //every frame starts with a "FRAME" line that may carry parameters
+    char marker[256];
+    if(!fgets(marker, sizeof(marker), file))
+        return false;
+    if(strncmp(marker, "FRAME", 5) != 0)
+    {
+        printf("Corrupt y4m frame header at frame %d \n", index);
+        return false;
+    }
+    if(fread(&planes[0], 1, planes.size(), file) != planes.size())
+        return false;
+
+    //interleave as U Y0 V Y1, mono streams get neutral chroma, 4:4:4 keeps every second sample
+    const unsigned char* lumaPlane = &planes[0];
+    const unsigned char* uPlane = lumaPlane + width * height;
+    const unsigned char* vPlane = uPlane + chromaWidth * chromaHeight;
+    int chromaStride = chromaWidth == width ? 2 : 1;
+    for(int y = 0; y < height; y++)
+    {
+        const unsigned char* lumaRow = lumaPlane + width * y;
+        int chromaRow = chromaHeight == height ? y : y / 2;
+        unsigned char* dst = &uyvy[2 * width * y];
+        for(int x = 0; x < width / 2; x++)
+        {
+            dst[4*x] = chromaWidth ? uPlane[chromaWidth * chromaRow + chromaStride * x] : 128;
+            dst[4*x + 1] = lumaRow[2*x];
+            dst[4*x + 2] = chromaWidth ? vPlane[chromaWidth * chromaRow + chromaStride * x] : 128;
+            dst[4*x + 3] = lumaRow[2*x + 1];
+        }
+    }
+    return true;
+}
+
+bool FileFrameSource::nextFrame(SourceFrame& frame)
+{
+    if(!file)
+        return false;
+    if(realTime)
+        waitForFrame(startMs, index, fps);
+
+    if(!readFrame())
+    {
+        if(!loop || index == 0 || fseek(file, dataStart, SEEK_SET) != 0 || !readFrame())
+            return false;
+    }
+
+    lumaHistogram(&uyvy[0], 2 * width, width, height, histogram);
+    describeFrame(frame, uyvy, width, height, fps, histogram, index);
+    index++;
+    return true;
+}
+
+//c = a * b for row major 3x3 matrices
+static void multiply(const float a[9], const float b[9], float c[9])
+{
+    float r[9];
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            r[3*i + j] = a[3*i] * b[j] + a[3*i + 1] * b[3 + j] + a[3*i + 2] * b[6 + j];
+    memcpy(c, r, sizeof(r));
+}
+
+SyntheticFrameSource::SyntheticFrameSource(const std::string& templatePath, const std::string& trajectoryPath,
+                                           int frameCount, bool realTime, int width, int height, double fps) :
+        templatePath(templatePath), trajectoryPath(trajectoryPath), frameCount(frameCount),
+        realTime(realTime), width(width), height(height), fps(fps)
+{
+    templateImage = NULL;
+    background = NULL;
+    luma = NULL;
+    for(int i = 0; i < 9; i++)
+        currentHomography[i] = (i % 4 == 0) ? 1 : 0;
+    index = 0;
+    startMs = 0;
+}
+
+SyntheticFrameSource::~SyntheticFrameSource()
+{
+    stop();
+}
+
+void SyntheticFrameSource::stop()
+{
+    if(templateImage)
+        cvReleaseImage(&templateImage);
+    if(background)
+        cvReleaseImage(&background);
+    if(luma)
+        cvReleaseImage(&luma);
+}
+
+bool SyntheticFrameSource::start()
+{
+    stop();
+    if(width <= 0 || height <= 0 || width % 2 != 0 || fps <= 0)
+    {
+        printf("Unusable frame size %dx%d at %.2f fps \n", width, height, fps);
+        return false;
+    }
+    templateImage = cvLoadImage(templatePath.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
+    if(!templateImage)
+    {
+        printf("Can't load template image %s \n", templatePath.c_str());
+        return false;
+    }
+    keyframes.clear();
+    if(!trajectoryPath.empty() && !loadTrajectory())
+    {
+        stop();
+        return false;
+    }
+
+    //smooth noise, so the background has some texture but few strong corners
+    background = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+    CvRNG rng = cvRNG(0x5eed);
+    cvRandArr(&rng, background, CV_RAND_UNI, cvScalarAll(64), cvScalarAll(192));
+    cvSmooth(background, background, CV_GAUSSIAN, 9, 9);
+    luma = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U, 1);
+
+    //neutral chroma, only the luma bytes change from frame to frame
+    uyvy.assign(2 * width * height, 128);
+    index = 0;
+    startMs = currentTimeMs();
+    return true;
+}
+
+bool SyntheticFrameSource::loadTrajectory()
+{
+    FILE* file = fopen(trajectoryPath.c_str(), "r");
+    if(!file)
+    {
+        printf("Can't open %s \n", trajectoryPath.c_str());
+        return false;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), file))
+    {
+        char* comment = strchr(line, '#');
+        if(comment)
+            *comment = 0;
+        Keyframe k;
+        k.tilt = 0;
+        int fields = sscanf(line, "%d %f %f %f %f %f", &k.frame, &k.dx, &k.dy, &k.scale, &k.angle, &k.tilt);
+        if(fields >= 5)
+            keyframes.push_back(k);
+        else if(fields > 0)
+            printf("Skipping trajectory line: %s", line);
+    }
+    fclose(file);
+
+    if(keyframes.empty())
+    {
+        printf("No keyframes in %s \n", trajectoryPath.c_str());
+        return false;
+    }
+    std::sort(keyframes.begin(), keyframes.end());
+    return true;
+}
+
+SyntheticFrameSource::Keyframe SyntheticFrameSource::pose(int frameIndex) const
+{
+    Keyframe k;
+    k.frame = frameIndex;
+    if(keyframes.empty())
+    {
+        //periods of a few seconds, all different so the poses don't repeat soon
+        const float twoPi = 6.2831853f;
+        float t = (float)frameIndex;
+        k.dx = 0.15f * width * sinf(twoPi * t / 150);
+        k.dy = 0.1f * height * sinf(twoPi * t / 110);
+        k.scale = 1 + 0.25f * sinf(twoPi * t / 200);
+        k.angle = 20 * sinf(twoPi * t / 240);
+        k.tilt = 0.3f * sinf(twoPi * t / 170);
+        return k;
+    }
+
+    if(frameIndex <= keyframes.front().frame)
+        return keyframes.front();
+    if(frameIndex >= keyframes.back().frame)
+        return keyframes.back();
+    unsigned int next = 1;
+    while(keyframes[next].frame < frameIndex)
+        next++;
+    const Keyframe& a = keyframes[next - 1];
+    const Keyframe& b = keyframes[next];
+    float s = (float)(frameIndex - a.frame) / (b.frame - a.frame);
+    k.dx = a.dx + s * (b.dx - a.dx);
+    k.dy = a.dy + s * (b.dy - a.dy);
+    k.scale = a.scale + s * (b.scale - a.scale);
+    k.angle = a.angle + s * (b.angle - a.angle);
+    k.tilt = a.tilt + s * (b.tilt - a.tilt);
+    return k;
+}
+
+void SyntheticFrameSource::render(const Keyframe& pose)
+{
+    float tw = templateImage->width, th = templateImage->height;
+    float scale = pose.scale * 0.5f * height / th;
+    float c = cosf(pose.angle * (float)CV_PI / 180), s = sinf(pose.angle * (float)CV_PI / 180);
+
+    //template centered on the origin, tilted so its right edge recedes,
+    //scaled, rotated and moved to the frame center plus the offset
+    float center[9] = {1, 0, -tw / 2,  0, 1, -th / 2,  0, 0, 1};
+    float tilt[9] = {1, 0, 0,  0, 1, 0,  pose.tilt / tw, 0, 1};
+    float rotateScale[9] = {c * scale, -s * scale, 0,  s * scale, c * scale, 0,  0, 0, 1};
+    float move[9] = {1, 0, width / 2 + pose.dx,  0, 1, height / 2 + pose.dy,  0, 0, 1};
+    multiply(tilt, center, currentHomography);
+    multiply(rotateScale, currentHomography, currentHomography);
+    multiply(move, currentHomography, currentHomography);
+
+    //without CV_WARP_FILL_OUTLIERS the pixels outside the template keep the background
+    cvCopy(background, luma);
+    CvMat h = cvMat(3, 3, CV_32FC1, currentHomography);
+    cvWarpPerspective(templateImage, luma, &h, CV_INTER_LINEAR);
+
+    for(int y = 0; y < height; y++)
+    {
+        const unsigned char* src = (const unsigned char*)(luma->imageData + luma->widthStep * y);
+        unsigned char* dst = &uyvy[2 * width * y];
+        for(int x = 0; x < width; x++)
+            dst[2*x + 1] = src[x];
+    }
+}
+
+bool SyntheticFrameSource::nextFrame(SourceFrame& frame)
+{
+    if(!templateImage || (frameCount > 0 && index >= frameCount))
+        return false;
+    if(realTime)
+        waitForFrame(startMs, index, fps);
+
+    render(pose(index));
+    lumaHistogram(&uyvy[0], 2 * width, width, height, histogram);
+    describeFrame(frame, uyvy, width, height, fps, histogram, index);
+    index++;
+    return true;
+}
+
+void SyntheticFrameSource::homography(float h[9]) const
+{
+    memcpy(h, currentHomography, sizeof(currentHomography));
+}
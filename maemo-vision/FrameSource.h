@@ -0,0 +1,162 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <opencv/cv.h>
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//A viewfinder frame delivered by a FrameSource
+struct SourceFrame
+{
+    const unsigned char* uyvy;  //pixels, valid until the next call to nextFrame()
+    int width;
+    int height;
+    int step;                   //bytes per row
+    int64_t timestamp;          //exposure start in microseconds
+    int exposure;               //microseconds
+    float gain;
+    const int* histogram;       //luma histogram, NULL if the source has none
+    int histogramBuckets;
+    int shotId;                 //id of the FCam shot, 0 for the other sources
+    int index;                  //frames delivered before this one
+};
+
+/* Where viewfinder frames come from: the camera, a recording or a
+ * generator. All of them deliver UYVY (Y422) like the N900 viewfinder,
+ * so the ingest, vision and overlay code runs unchanged on any of them,
+ * including on a desktop without the FCam driver.
+ */
+class FrameSource {
+
+public:
+    virtual ~FrameSource() {}
+
+    virtual const char* name() const = 0;
+
+    // Prepare the first frame, false with a message if the source can't be used
+    virtual bool start() = 0;
+
+    // Wait for the next frame. Returns false at the end of the stream or on
+    // a read error.
+    virtual bool nextFrame(SourceFrame& frame) = 0;
+
+    virtual void stop() {}
+
+    // A source from a description, NULL with a message for invalid ones:
+    //   file:<path>[,fast][,loop][,size=<w>x<h>][,fps=<n>]
+    //   synthetic:<template image>[,trajectory=<file>][,frames=<n>][,fast][,size=<w>x<h>][,fps=<n>]
+    // Sources deliver frames at their frame rate unless fast is given.
+    static FrameSource* create(const std::string& description);
+};
+
+/* A recorded sequence, either a YUV4MPEG2 (.y4m) stream in 4:2:0, 4:2:2,
+ * 4:4:4 or mono, whose frame size and rate are read from the header, or
+ * raw UYVY frames back to back in any other file. Frames are delivered at
+ * the recorded frame rate, or as fast as they can be read, and optionally
+ * from the start again at the end of the file.
+ */
+class FileFrameSource : public FrameSource {
+
+public:
+    FileFrameSource(const std::string& path, bool realTime, bool loop,
+                    int rawWidth = 640, int rawHeight = 480, double rawFps = 30);
+    ~FileFrameSource();
+
+    const char* name() const {return "file";}
+
+    bool start();
+    bool nextFrame(SourceFrame& frame);
+    void stop();
+
+    // Size of the frames, known once start() succeeded
+    int frameWidth() const {return width;}
+    int frameHeight() const {return height;}
+
+private:
+    bool readHeader();
+    bool readFrame();
+    bool readY4MFrame();
+
+    std::string path;
+    bool realTime;
+    bool loop;
+
+    FILE* file;
+    bool y4m;
+    long dataStart;             //file offset of the first frame
+    int chromaWidth;            //0 for mono y4m and raw files
+    int chromaHeight;
+
+    int width;
+    int height;
+    double fps;
+    std::vector<unsigned char> uyvy;
+    std::vector<unsigned char> planes;  //y4m frame as read
+    std::vector<int> histogram;
+
+    int index;
+    double startMs;
+};
+
+/* A template image moving in front of a textured background. The
+ * template is centered and scaled to half the frame height, then moved
+ * along a trajectory: its offset from the center, its scale, its in-plane
+ * rotation and a perspective tilt. The trajectory is either a built-in
+ * slow sweep of all five, or keyframes read from a text file, one per
+ * line as
+ *   <frame> <dx> <dy> <scale> <angle in degrees> [<tilt>]
+ * interpolated linearly and held after the last one; '#' starts a comment.
+ */
+class SyntheticFrameSource : public FrameSource {
+
+public:
+    SyntheticFrameSource(const std::string& templatePath, const std::string& trajectoryPath,
+                         int frameCount, bool realTime, int width = 640, int height = 480, double fps = 30);
+    ~SyntheticFrameSource();
+
+    const char* name() const {return "synthetic";}
+
+    bool start();
+    bool nextFrame(SourceFrame& frame);
+    void stop();
+
+    // Homography from the template to the last frame delivered, row major
+    void homography(float h[9]) const;
+
+private:
+    struct Keyframe
+    {
+        int frame;
+        float dx, dy, scale, angle, tilt;
+
+        bool operator<(const Keyframe& other) const {return frame < other.frame;}
+    };
+
+    bool loadTrajectory();
+    Keyframe pose(int frameIndex) const;
+    void render(const Keyframe& pose);
+
+    std::string templatePath;
+    std::string trajectoryPath;
+    int frameCount;             //0 runs until stopped
+    bool realTime;
+    int width;
+    int height;
+    double fps;
+
+    IplImage* templateImage;
+    IplImage* background;
+    IplImage* luma;
+    std::vector<Keyframe> keyframes;
+    float currentHomography[9];
+    std::vector<unsigned char> uyvy;
+    std::vector<int> histogram;
+
+    int index;
+    double startMs;
+};
+
+#endif
@@ -0,0 +1,308 @@
+#include "HomographyEstimator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+HomographyEstimator::HomographyEstimator()
+{
+    confidence = 0.995;
+    maxIterations = 2000;
+    seed = 0x12345678;
+    inlierCount = 0;
+    iterationCount = 0;
+}
+
+int HomographyEstimator::random(int n)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return (int)((seed >> 8) % (uint32_t)n);
+}
+
+//Solve the n x n system a x = b in place by Gaussian elimination with partial pivoting,
+//the solution is left in b
+static bool solveLinear(double* a, double* b, int n)
+{
+    for(int c = 0; c < n; c++)
+    {
+        int pivot = c;
+        for(int r = c + 1; r < n; r++)
+            if(fabs(a[r*n + c]) > fabs(a[pivot*n + c]))
+                pivot = r;
+        if(fabs(a[pivot*n + c]) < 1e-12)
+            return false;
+        if(pivot != c)
+        {
+            for(int k = 0; k < n; k++)
+                std::swap(a[c*n + k], a[pivot*n + k]);
+            std::swap(b[c], b[pivot]);
+        }
+        for(int r = c + 1; r < n; r++)
+        {
+            double f = a[r*n + c] / a[c*n + c];
+            if(f == 0)
+                continue;
+            for(int k = c; k < n; k++)
+                a[r*n + k] -= f * a[c*n + k];
+            b[r] -= f * b[c];
+        }
+    }
+    for(int r = n - 1; r >= 0; r--)
+    {
+        double s = b[r];
+        for(int k = r + 1; k < n; k++)
+            s -= a[r*n + k] * b[k];
+        b[r] = s / a[r*n + r];
+    }
+    return true;
+}
+
+//twice the signed area of the triangle abc
+static double signedArea(const CvPoint2D32f& a, const CvPoint2D32f& b, const CvPoint2D32f& c)
+{
+    return (double)(b.x - a.x) * (c.y - a.y) - (double)(b.y - a.y) * (c.x - a.x);
+}
+
+bool HomographyEstimator::degenerateSample(const CvPoint2D32f* src, const CvPoint2D32f* dst, const int* sample) const
+{
+    //every triangle of the sample must have some area and keep its orientation:
+    //a homography of a plane in front of the camera does not mirror it
+    static const int triangles[4][3] = {{0, 1, 2}, {0, 1, 3}, {0, 2, 3}, {1, 2, 3}};
+    for(int t = 0; t < 4; t++)
+    {
+        int i = sample[triangles[t][0]], j = sample[triangles[t][1]], k = sample[triangles[t][2]];
+        double a = signedArea(src[i], src[j], src[k]);
+        double b = signedArea(dst[i], dst[j], dst[k]);
+        if(fabs(a) < 1.0 || fabs(b) < 1.0 || (a > 0) != (b > 0))
+            return true;
+    }
+    return false;
+}
+
+bool HomographyEstimator::solveMinimal(const CvPoint2D32f* src, const CvPoint2D32f* dst, const int* sample, double h[9]) const
+{
+    //h[8] = 1, two equations per correspondence
+    double a[8*8], b[8];
+    for(int p = 0; p < sampleSize; p++)
+    {
+        double x = src[sample[p]].x, y = src[sample[p]].y;
+        double u = dst[sample[p]].x, v = dst[sample[p]].y;
+        double* r0 = &a[(2*p)*8];
+        double* r1 = &a[(2*p + 1)*8];
+        r0[0] = x; r0[1] = y; r0[2] = 1; r0[3] = 0; r0[4] = 0; r0[5] = 0; r0[6] = -u*x; r0[7] = -u*y;
+        r1[0] = 0; r1[1] = 0; r1[2] = 0; r1[3] = x; r1[4] = y; r1[5] = 1; r1[6] = -v*x; r1[7] = -v*y;
+        b[2*p] = u;
+        b[2*p + 1] = v;
+    }
+    if(!solveLinear(a, b, 8))
+        return false;
+    for(int i = 0; i < 8; i++)
+        h[i] = b[i];
+    h[8] = 1;
+    return true;
+}
+
+int HomographyEstimator::countInliers(const double h[9], const CvPoint2D32f* src, const CvPoint2D32f* dst, int count,
+                                      double threshold2, uchar* mask) const
+{
+    int inliers = 0;
+    for(int i = 0; i < count; i++)
+    {
+        double x = src[i].x, y = src[i].y;
+        double w = h[6]*x + h[7]*y + h[8];
+        bool inlier = false;
+        if(fabs(w) > 1e-12)
+        {
+            double dx = (h[0]*x + h[1]*y + h[2]) / w - dst[i].x;
+            double dy = (h[3]*x + h[4]*y + h[5]) / w - dst[i].y;
+            inlier = dx*dx + dy*dy < threshold2;
+        }
+        mask[i] = inlier;
+        inliers += inlier;
+    }
+    return inliers;
+}
+
+//Least squares over the masked pairs, on coordinates centered and scaled to an average
+//distance of sqrt(2) from the origin so the normal equations are well conditioned
+bool HomographyEstimator::refine(const CvPoint2D32f* src, const CvPoint2D32f* dst, int count, const uchar* mask, double h[9]) const
+{
+    double sx = 0, sy = 0, dx = 0, dy = 0;
+    int n = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(!mask[i])
+            continue;
+        sx += src[i].x; sy += src[i].y;
+        dx += dst[i].x; dy += dst[i].y;
+        n++;
+    }
+    if(n < sampleSize)
+        return false;
+    sx /= n; sy /= n; dx /= n; dy /= n;
+
+    double sd = 0, dd = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(!mask[i])
+            continue;
+        sd += sqrt((src[i].x - sx)*(src[i].x - sx) + (src[i].y - sy)*(src[i].y - sy));
+        dd += sqrt((dst[i].x - dx)*(dst[i].x - dx) + (dst[i].y - dy)*(dst[i].y - dy));
+    }
+    if(sd < 1e-9 || dd < 1e-9)
+        return false;
+    double ss = sqrt(2.0) * n / sd;
+    double ds = sqrt(2.0) * n / dd;
+
+    double ata[8*8], atb[8];
+    memset(ata, 0, sizeof(ata));
+    memset(atb, 0, sizeof(atb));
+    for(int i = 0; i < count; i++)
+    {
+        if(!mask[i])
+            continue;
+        double x = (src[i].x - sx) * ss, y = (src[i].y - sy) * ss;
+        double u = (dst[i].x - dx) * ds, v = (dst[i].y - dy) * ds;
+        double r0[8] = {x, y, 1, 0, 0, 0, -u*x, -u*y};
+        double r1[8] = {0, 0, 0, x, y, 1, -v*x, -v*y};
+        for(int j = 0; j < 8; j++)
+        {
+            for(int k = j; k < 8; k++)
+                ata[j*8 + k] += r0[j]*r0[k] + r1[j]*r1[k];
+            atb[j] += r0[j]*u + r1[j]*v;
+        }
+    }
+    for(int j = 0; j < 8; j++)
+        for(int k = 0; k < j; k++)
+            ata[j*8 + k] = ata[k*8 + j];
+    if(!solveLinear(ata, atb, 8))
+        return false;
+
+    //undo the normalization: H = Td^-1 * Hn * Ts
+    double hn[9] = {atb[0], atb[1], atb[2], atb[3], atb[4], atb[5], atb[6], atb[7], 1};
+    double ts[9] = {ss, 0, -ss*sx, 0, ss, -ss*sy, 0, 0, 1};
+    double tdInv[9] = {1/ds, 0, dx, 0, 1/ds, dy, 0, 0, 1};
+    double m[9], r[9];
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            m[i*3 + j] = hn[i*3]*ts[j] + hn[i*3 + 1]*ts[3 + j] + hn[i*3 + 2]*ts[6 + j];
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 3; j++)
+            r[i*3 + j] = tdInv[i*3]*m[j] + tdInv[i*3 + 1]*m[3 + j] + tdInv[i*3 + 2]*m[6 + j];
+    if(fabs(r[8]) < 1e-12)
+        return false;
+    for(int i = 0; i < 9; i++)
+        h[i] = r[i] / r[8];
+    return true;
+}
+
+bool HomographyEstimator::estimate(const CvPoint2D32f* src, const CvPoint2D32f* dst, int count, float threshold,
+                                   float homography[9], uchar* mask)
+{
+    inlierCount = 0;
+    iterationCount = 0;
+    if(count < sampleSize)
+        return false;
+
+    if((int)bestMask.size() < count)
+    {
+        bestMask.resize(count);
+        candidateMask.resize(count);
+    }
+    double threshold2 = (double)threshold * threshold;
+    double best[9];
+    int bestInliers = 0;
+
+    //PROSAC schedule: Tn is the expected number of samples RANSAC would draw from the
+    //n best pairs, TnPrime the iteration at which the subset grows to n + 1
+    int n = sampleSize;
+    double Tn = maxIterations;
+    for(int i = 0; i < sampleSize; i++)
+        Tn *= (double)(sampleSize - i) / (count - i);
+    int TnPrime = 1;
+    int limit = maxIterations;
+
+    int sample[sampleSize];
+    double h[9];
+    for(int t = 1; t <= limit; t++)
+    {
+        if(t == TnPrime && n < count)
+        {
+            double Tn1 = Tn * (n + 1) / (n + 1 - sampleSize);
+            n++;
+            TnPrime += (int)ceil(Tn1 - Tn);
+            Tn = Tn1;
+        }
+
+        //once the schedule is behind, any sample of the n best; before, the n-th pair
+        //with three of the better ones
+        int drawn = 0;
+        if(TnPrime < t)
+        {
+            while(drawn < sampleSize)
+            {
+                int s = random(n);
+                if(std::find(sample, sample + drawn, s) == sample + drawn)
+                    sample[drawn++] = s;
+            }
+        }
+        else
+        {
+            sample[drawn++] = n - 1;
+            while(drawn < sampleSize)
+            {
+                int s = random(n - 1);
+                if(std::find(sample, sample + drawn, s) == sample + drawn)
+                    sample[drawn++] = s;
+            }
+        }
+        iterationCount = t;
+
+        if(degenerateSample(src, dst, sample) || !solveMinimal(src, dst, sample, h))
+            continue;
+
+        int inliers = countInliers(h, src, dst, count, threshold2, &candidateMask[0]);
+        if(inliers <= bestInliers)
+            continue;
+        bestInliers = inliers;
+        memcpy(best, h, sizeof(best));
+        std::swap(candidateMask, bestMask);
+
+        //samples needed for the confidence at the best inlier ratio so far
+        if(bestInliers == count)
+            break;
+        double w = (double)bestInliers / count;
+        double noInlierSample = 1 - w*w*w*w;
+        if(noInlierSample > 0)
+        {
+            double needed = log(1 - confidence) / log(noInlierSample);
+            if(needed < limit)
+                limit = std::max(t, (int)ceil(needed));
+        }
+    }
+    if(bestInliers < sampleSize)
+        return false;
+
+    //refine on the inliers while that gains inliers
+    for(int round = 0; round < 2; round++)
+    {
+        if(!refine(src, dst, count, &bestMask[0], h))
+            break;
+        int inliers = countInliers(h, src, dst, count, threshold2, &candidateMask[0]);
+        if(inliers < bestInliers)
+            break;
+        bool grown = inliers > bestInliers;
+        bestInliers = inliers;
+        memcpy(best, h, sizeof(best));
+        std::swap(candidateMask, bestMask);
+        if(!grown)
+            break;
+    }
+
+    inlierCount = bestInliers;
+    for(int i = 0; i < 9; i++)
+        homography[i] = (float)best[i];
+    if(mask)
+        memcpy(mask, &bestMask[0], count);
+    return true;
+}
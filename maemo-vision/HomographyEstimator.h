@@ -0,0 +1,62 @@
+#ifndef HOMOGRAPHY_ESTIMATOR_H
+#define HOMOGRAPHY_ESTIMATOR_H
+
+#include <opencv/cv.h>
+
+#include <stdint.h>
+#include <vector>
+
+/* Robust homography estimation with PROSAC (Chum and Matas, "Matching
+ * with PROSAC - Progressive Sample Consensus").
+ *
+ * Correspondences are expected best first, e.g. by ratio test distance.
+ * Minimal samples are drawn from a subset of the best ones that grows
+ * on the PROSAC schedule, so good models are found after a few samples
+ * when the best matches are reliable; without a useful order it behaves
+ * like RANSAC. The iteration count adapts to the best inlier ratio found
+ * so far and stops at the requested confidence. Samples with three
+ * nearly collinear points, or whose orientation flips between the two
+ * planes, are rejected before solving. The winning model is refined by
+ * least squares over its inliers.
+ *
+ * Buffers are kept between calls, so estimation does not allocate once
+ * they have grown to the largest point count seen.
+ */
+class HomographyEstimator {
+
+public:
+    HomographyEstimator();
+
+    // Homography taking src to dst, row major with h[8] = 1. A pair is an
+    // inlier if its reprojection error is below threshold pixels. mask,
+    // if given, receives 1 for inliers and 0 for outliers. Returns false
+    // when no model has 4 or more inliers.
+    bool estimate(const CvPoint2D32f* src, const CvPoint2D32f* dst, int count, float threshold,
+                  float homography[9], uchar* mask = 0);
+
+    double confidence;  //probability of having drawn an all inlier sample before stopping
+    int maxIterations;
+
+    // Inliers of the last estimate and the samples it drew
+    int inliers() const {return inlierCount;}
+    int iterations() const {return iterationCount;}
+
+private:
+    const static int sampleSize = 4;
+
+    uint32_t seed;
+    int inlierCount;
+    int iterationCount;
+
+    std::vector<uchar> candidateMask;
+    std::vector<uchar> bestMask;
+
+    int random(int n);
+    bool degenerateSample(const CvPoint2D32f* src, const CvPoint2D32f* dst, const int* sample) const;
+    bool solveMinimal(const CvPoint2D32f* src, const CvPoint2D32f* dst, const int* sample, double h[9]) const;
+    bool refine(const CvPoint2D32f* src, const CvPoint2D32f* dst, int count, const uchar* mask, double h[9]) const;
+    int countInliers(const double h[9], const CvPoint2D32f* src, const CvPoint2D32f* dst, int count,
+                     double threshold2, uchar* mask) const;
+};
+
+#endif
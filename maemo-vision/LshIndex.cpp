@@ -0,0 +1,263 @@
+#include "LshIndex.h"
+#include "BruteForceMatcher.h"
+
+#include <cfloat>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+static const char lshIndexMagic[8] = {'M', 'V', 'L', 'S', 'H', 'I', 'D', 'X'};
+
+struct LshIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tables;
+    uint32_t keyBits;
+    uint32_t rows;
+    uint32_t descriptorBytes;
+    uint32_t reserved;
+};
+
+LshIndex::LshIndex(int tableCount, int keyBits)
+{
+    tables = tableCount;
+    bits = keyBits;
+    visitStamp = 0;
+    lastCandidates = 0;
+}
+
+int LshIndex::keyBitsFor(int rows)
+{
+    int b = 0;
+    while(b < 31 && (1 << (b + 1)) <= rows)
+        b++;
+    //about 4 rows per bucket, within what a table offset array can afford
+    return std::max(8, std::min(24, b - 2));
+}
+
+//Sampled bits of every table, distinct within a table. The generator is fixed so
+//indexes built on different machines agree; saved indexes store the positions anyway.
+void LshIndex::choosePositions(int descriptorBits)
+{
+    positions.resize(tables * bits);
+    uint32_t state = 0x9E3779B9;
+    std::vector<uint16_t> pool(descriptorBits);
+    for(int t = 0; t < tables; t++)
+    {
+        for(int i = 0; i < descriptorBits; i++)
+            pool[i] = (uint16_t)i;
+        for(int j = 0; j < bits; j++)
+        {
+            state = state * 1664525u + 1013904223u;
+            int pick = j + (int)((state >> 8) % (uint32_t)(descriptorBits - j));
+            std::swap(pool[j], pool[pick]);
+            positions[t * bits + j] = pool[j];
+        }
+    }
+}
+
+uint32_t LshIndex::key(const uchar* descriptor, int table) const
+{
+    const uint16_t* p = &positions[table * bits];
+    uint32_t k = 0;
+    for(int j = 0; j < bits; j++)
+        k |= (uint32_t)((descriptor[p[j] >> 3] >> (p[j] & 7)) & 1) << j;
+    return k;
+}
+
+void LshIndex::build(const cv::Mat& descriptors)
+{
+    data = descriptors;
+    int rows = data.rows;
+    bits = std::max(1, std::min(bits, std::min(24, (int)data.cols * 8)));
+    choosePositions(data.cols * 8);
+
+    size_t buckets = (size_t)1 << bits;
+    bucketStart.assign(tables * (buckets + 1), 0);
+    bucketRows.resize((size_t)tables * rows);
+
+    std::vector<uint32_t> keys(rows);
+    for(int t = 0; t < tables; t++)
+    {
+        uint32_t* start = &bucketStart[t * (buckets + 1)];
+        uint32_t* sorted = rows ? &bucketRows[(size_t)t * rows] : NULL;
+
+        //counting sort of the rows by key
+        for(int r = 0; r < rows; r++)
+        {
+            keys[r] = key(data.ptr(r), t);
+            start[keys[r] + 1]++;
+        }
+        for(size_t b = 0; b < buckets; b++)
+            start[b + 1] += start[b];
+        for(int r = 0; r < rows; r++)
+            sorted[start[keys[r]]++] = r;
+        //the fill advanced every offset to the end of its bucket, shift them back
+        for(size_t b = buckets; b > 0; b--)
+            start[b] = start[b - 1];
+        start[0] = 0;
+    }
+
+    visited.assign(rows, 0);
+    visitStamp = 0;
+}
+
+void LshIndex::probe(const uchar* query, int table, uint32_t k, int& best, int& second, int& bestRow, int& secondRow)
+{
+    size_t buckets = (size_t)1 << bits;
+    const uint32_t* start = &bucketStart[table * (buckets + 1)];
+    const uint32_t* sorted = &bucketRows[(size_t)table * data.rows];
+    int bytes = data.cols;
+
+    for(uint32_t i = start[k]; i < start[k + 1]; i++)
+    {
+        uint32_t r = sorted[i];
+        if(visited[r] == visitStamp)
+            continue;
+        visited[r] = visitStamp;
+        lastCandidates++;
+
+        int d = BruteForceMatcher::hammingDistance(query, data.ptr(r), bytes);
+        if(d < second)
+        {
+            if(d < best)
+            {
+                second = best;
+                secondRow = bestRow;
+                best = d;
+                bestRow = r;
+            }
+            else
+            {
+                second = d;
+                secondRow = r;
+            }
+        }
+    }
+}
+
+void LshIndex::knnSearch(const cv::Mat& queries, int* indices, float* dists, int probeLevel)
+{
+    lastCandidates = 0;
+    for(int q = 0; q < queries.rows; q++)
+    {
+        const uchar* query = queries.ptr(q);
+        int best = INT_MAX, second = INT_MAX;
+        int bestRow = -1, secondRow = -1;
+
+        //a new stamp per query; on wrap around the marks are cleared once
+        if(++visitStamp == 0)
+        {
+            std::fill(visited.begin(), visited.end(), 0);
+            visitStamp = 1;
+        }
+
+        for(int t = 0; t < tables; t++)
+        {
+            uint32_t k = key(query, t);
+            probe(query, t, k, best, second, bestRow, secondRow);
+            if(probeLevel < 1)
+                continue;
+            for(int a = 0; a < bits; a++)
+            {
+                uint32_t ka = k ^ (1u << a);
+                probe(query, t, ka, best, second, bestRow, secondRow);
+                if(probeLevel < 2)
+                    continue;
+                for(int b = a + 1; b < bits; b++)
+                    probe(query, t, ka ^ (1u << b), best, second, bestRow, secondRow);
+            }
+        }
+
+        indices[2*q] = bestRow;
+        indices[2*q+1] = secondRow;
+        dists[2*q] = bestRow < 0 ? FLT_MAX : (float)best * best;
+        dists[2*q+1] = secondRow < 0 ? FLT_MAX : (float)second * second;
+    }
+}
+
+bool LshIndex::save(const std::string& fileName) const
+{
+    LshIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, lshIndexMagic, sizeof(header.magic));
+    header.version = fileVersion;
+    header.tables = tables;
+    header.keyBits = bits;
+    header.rows = data.rows;
+    header.descriptorBytes = data.cols;
+
+    FILE* file = fopen(fileName.c_str(), "wb");
+    if(!file)
+    {
+        printf("Can't write %s \n", fileName.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(&positions[0], sizeof(uint16_t), positions.size(), file) == positions.size();
+    ok = ok && fwrite(&bucketStart[0], sizeof(uint32_t), bucketStart.size(), file) == bucketStart.size();
+    if(ok && !bucketRows.empty())
+        ok = fwrite(&bucketRows[0], sizeof(uint32_t), bucketRows.size(), file) == bucketRows.size();
+    if(fclose(file) != 0)
+        ok = false;
+    if(!ok)
+        printf("Error writing %s \n", fileName.c_str());
+    return ok;
+}
+
+LshIndex* LshIndex::load(const std::string& fileName, const cv::Mat& descriptors)
+{
+    FILE* file = fopen(fileName.c_str(), "rb");
+    if(!file)
+        return NULL;
+
+    LshIndexHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 ||
+       memcmp(header.magic, lshIndexMagic, sizeof(header.magic)) != 0 ||
+       header.version != fileVersion ||
+       header.rows != (uint32_t)descriptors.rows ||
+       header.descriptorBytes != (uint32_t)descriptors.cols ||
+       header.tables < 1 || header.tables > 64 ||
+       header.keyBits < 1 || header.keyBits > 24 || header.keyBits > header.descriptorBytes * 8)
+    {
+        printf("Incompatible lsh index: %s \n", fileName.c_str());
+        fclose(file);
+        return NULL;
+    }
+
+    LshIndex* index = new LshIndex(header.tables, header.keyBits);
+    index->data = descriptors;
+    size_t buckets = (size_t)1 << header.keyBits;
+    index->positions.resize(header.tables * header.keyBits);
+    index->bucketStart.resize(header.tables * (buckets + 1));
+    index->bucketRows.resize((size_t)header.tables * header.rows);
+
+    bool ok = fread(&index->positions[0], sizeof(uint16_t), index->positions.size(), file) == index->positions.size();
+    ok = ok && fread(&index->bucketStart[0], sizeof(uint32_t), index->bucketStart.size(), file) == index->bucketStart.size();
+    if(ok && !index->bucketRows.empty())
+        ok = fread(&index->bucketRows[0], sizeof(uint32_t), index->bucketRows.size(), file) == index->bucketRows.size();
+    fclose(file);
+
+    //reject anything that would index out of range
+    for(size_t i = 0; ok && i < index->positions.size(); i++)
+        ok = index->positions[i] < header.descriptorBytes * 8;
+    for(uint32_t t = 0; ok && t < header.tables; t++)
+    {
+        const uint32_t* start = &index->bucketStart[t * (buckets + 1)];
+        ok = start[0] == 0 && start[buckets] == header.rows;
+        for(size_t b = 0; ok && b < buckets; b++)
+            ok = start[b] <= start[b + 1];
+    }
+    for(size_t i = 0; ok && i < index->bucketRows.size(); i++)
+        ok = index->bucketRows[i] < header.rows;
+    if(!ok)
+    {
+        printf("Corrupt lsh index: %s \n", fileName.c_str());
+        delete index;
+        return NULL;
+    }
+
+    index->visited.assign(header.rows, 0);
+    return index;
+}
@@ -0,0 +1,68 @@
+#ifndef LSH_INDEX_H
+#define LSH_INDEX_H
+
+#include <opencv/cv.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Multi-probe locality sensitive hashing over binary descriptors, the
+ * approximate index for databases too large to scan by Hamming distance.
+ *
+ * Every table hashes a descriptor to the keyBits bits it samples at fixed
+ * positions; rows with equal keys share a bucket. A query looks at its own
+ * bucket in every table and, with multi-probe, at the buckets whose keys
+ * differ in one (probe level 1) or two (level 2) bits, then ranks the
+ * candidates by Hamming distance. Buckets are stored as one sorted row
+ * list per table with an offset per key, built by counting sort.
+ *
+ * Results have the layout of BruteForceMatcher: two (row, squared Hamming
+ * distance) pairs per query, row -1 where fewer candidates were found.
+ */
+class LshIndex {
+
+public:
+    LshIndex(int tableCount, int keyBits);
+
+    // Hash all rows of a CV_8U descriptor matrix. The matrix is searched in
+    // place and must stay valid while the index is used.
+    void build(const cv::Mat& descriptors);
+
+    void knnSearch(const cv::Mat& queries, int* indices, float* dists, int probeLevel);
+
+    // Store the tables; load() restores them for the same descriptor matrix
+    bool save(const std::string& fileName) const;
+    static LshIndex* load(const std::string& fileName, const cv::Mat& descriptors);
+
+    int tableCount() const {return tables;}
+    int keyBits() const {return bits;}
+    // Hamming distances computed by the last knnSearch()
+    long candidates() const {return lastCandidates;}
+
+    // A key size suited to the number of rows, for an average bucket of a few rows
+    static int keyBitsFor(int rows);
+
+private:
+    const static uint32_t fileVersion = 1;
+
+    int tables;
+    int bits;
+    cv::Mat data;
+
+    //per table: sampled bit positions, bucket offsets (2^bits + 1) and rows sorted by bucket
+    std::vector<uint16_t> positions;
+    std::vector<uint32_t> bucketStart;
+    std::vector<uint32_t> bucketRows;
+
+    //per row: last query that considered it, so every candidate is measured once
+    std::vector<uint32_t> visited;
+    uint32_t visitStamp;
+    long lastCandidates;
+
+    void choosePositions(int descriptorBits);
+    uint32_t key(const uchar* descriptor, int table) const;
+    void probe(const uchar* query, int table, uint32_t key, int& best, int& second, int& bestRow, int& secondRow);
+};
+
+#endif
@@ -241,6 +241,13 @@ void OverlayWidget::drawStats(QPainter &paint)
 
     paint.drawText(20, 40, framesPerSecond + " fps");
 
+    //viewfinder frames the vision code was too slow to take
+    if (appState) {
+        const FrameMailbox& mailbox = appState->frameMailbox;
+        paint.drawText(20, 60, QString("%1 frames, %2 dropped")
+                       .arg(mailbox.publishedFrames()).arg(mailbox.droppedFrames()));
+    }
+
     if (!(frames % 100)) {
         time.start();
         frames = 0;
@@ -260,10 +267,9 @@ void OverlayWidget::paintEvent(QPaintEvent * event) {
     {
         QPen penFrame(Qt::yellow, 10, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
         painter.setPen(penFrame);
-        for (int j = 0; j < 3; ++j) {
-            painter.drawLine(appState->imageBoundary[j], appState->imageBoundary[j+1]);
+        for (int k = 0; k < appState->imageBoundaries.size(); ++k) {
+            painter.drawPolygon(appState->imageBoundaries[k]);
         }
-        painter.drawLine(appState->imageBoundary[3], appState->imageBoundary[0]);
     }
 
     drawStats(painter);
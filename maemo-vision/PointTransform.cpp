@@ -0,0 +1,112 @@
+#include "PointTransform.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define POINT_TRANSFORM_SSE
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include "arm_neon.h"
+#define POINT_TRANSFORM_NEON
+#endif
+
+template<bool rounded>
+static void transformPoints(const float h[9], const CvPoint2D32f* src, CvPoint2D32f* dst, int count)
+{
+    int i = 0;
+
+#if defined(POINT_TRANSFORM_SSE)
+    const __m128 h0 = _mm_set1_ps(h[0]), h1 = _mm_set1_ps(h[1]), h2 = _mm_set1_ps(h[2]);
+    const __m128 h3 = _mm_set1_ps(h[3]), h4 = _mm_set1_ps(h[4]), h5 = _mm_set1_ps(h[5]);
+    const __m128 h6 = _mm_set1_ps(h[6]), h7 = _mm_set1_ps(h[7]), h8 = _mm_set1_ps(h[8]);
+    const __m128 two = _mm_set1_ps(2.0f);
+    for(; i + 4 <= count; i += 4)
+    {
+        //x0 y0 x1 y1 | x2 y2 x3 y3 -> x0 x1 x2 x3 | y0 y1 y2 y3
+        __m128 a = _mm_loadu_ps(&src[i].x);
+        __m128 b = _mm_loadu_ps(&src[i + 2].x);
+        __m128 x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+        __m128 w = _mm_add_ps(_mm_add_ps(_mm_mul_ps(h6, x), _mm_mul_ps(h7, y)), h8);
+        //12 bit estimate, one Newton-Raphson step: r = r * (2 - w * r)
+        __m128 r = _mm_rcp_ps(w);
+        r = _mm_mul_ps(r, _mm_sub_ps(two, _mm_mul_ps(w, r)));
+
+        __m128 X = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(h0, x), _mm_mul_ps(h1, y)), h2), r);
+        __m128 Y = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(h3, x), _mm_mul_ps(h4, y)), h5), r);
+        if(rounded)
+        {
+            //to nearest, ties to even like cvRound
+            X = _mm_cvtepi32_ps(_mm_cvtps_epi32(X));
+            Y = _mm_cvtepi32_ps(_mm_cvtps_epi32(Y));
+        }
+        _mm_storeu_ps(&dst[i].x, _mm_unpacklo_ps(X, Y));
+        _mm_storeu_ps(&dst[i + 2].x, _mm_unpackhi_ps(X, Y));
+    }
+#elif defined(POINT_TRANSFORM_NEON)
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    for(; i + 4 <= count; i += 4)
+    {
+        float32x4x2_t p = vld2q_f32(&src[i].x);
+        float32x4_t x = p.val[0], y = p.val[1];
+
+        float32x4_t w = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(h[8]), x, h[6]), y, h[7]);
+        //8 bit estimate, two Newton-Raphson steps
+        float32x4_t r = vrecpeq_f32(w);
+        r = vmulq_f32(r, vrecpsq_f32(w, r));
+        r = vmulq_f32(r, vrecpsq_f32(w, r));
+
+        float32x4_t X = vmulq_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(h[2]), x, h[0]), y, h[1]), r);
+        float32x4_t Y = vmulq_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(h[5]), x, h[3]), y, h[4]), r);
+        if(rounded)
+        {
+            //to nearest, ties away from zero: add 0.5 with the sign of the value and truncate
+            uint32x4_t signX = vandq_u32(vreinterpretq_u32_f32(X), vdupq_n_u32(0x80000000));
+            uint32x4_t signY = vandq_u32(vreinterpretq_u32_f32(Y), vdupq_n_u32(0x80000000));
+            float32x4_t hx = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(half), signX));
+            float32x4_t hy = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(half), signY));
+            X = vcvtq_f32_s32(vcvtq_s32_f32(vaddq_f32(X, hx)));
+            Y = vcvtq_f32_s32(vcvtq_s32_f32(vaddq_f32(Y, hy)));
+        }
+        float32x4x2_t q;
+        q.val[0] = X;
+        q.val[1] = Y;
+        vst2q_f32(&dst[i].x, q);
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        float x = src[i].x, y = src[i].y;
+        float Z = 1./(h[6]*x + h[7]*y + h[8]);
+        float X = (h[0]*x + h[1]*y + h[2])*Z;
+        float Y = (h[3]*x + h[4]*y + h[5])*Z;
+        if(rounded)
+        {
+            X = cvRound(X);
+            Y = cvRound(Y);
+        }
+        dst[i].x = X;
+        dst[i].y = Y;
+    }
+}
+
+void PointTransform::transform(const float h[9], const CvPoint2D32f* src, CvPoint2D32f* dst, int count)
+{
+    transformPoints<false>(h, src, dst, count);
+}
+
+void PointTransform::transformRounded(const float h[9], const CvPoint2D32f* src, CvPoint2D32f* dst, int count)
+{
+    transformPoints<true>(h, src, dst, count);
+}
+
+const char* PointTransform::kernelName()
+{
+#if defined(POINT_TRANSFORM_SSE)
+    return "sse2";
+#elif defined(POINT_TRANSFORM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
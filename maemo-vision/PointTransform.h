@@ -0,0 +1,27 @@
+#ifndef POINT_TRANSFORM_H
+#define POINT_TRANSFORM_H
+
+#include <opencv/cv.h>
+
+/* Homography mapping of point arrays, four points at a time with SSE2
+ * on x86 and NEON on ARM, with a scalar fallback. The perspective
+ * division uses the reciprocal estimate of the instruction set refined
+ * by Newton-Raphson steps, which is accurate to about a float's
+ * precision and much cheaper than four divisions.
+ *
+ * h is a row major 3x3 homography. src and dst may be the same array.
+ */
+class PointTransform {
+
+public:
+    // dst[i] = h * src[i], sub-pixel
+    static void transform(const float h[9], const CvPoint2D32f* src, CvPoint2D32f* dst, int count);
+
+    // Same, rounded to whole pixels as RecognitionEngine::transform() does
+    static void transformRounded(const float h[9], const CvPoint2D32f* src, CvPoint2D32f* dst, int count);
+
+    // Name of the compiled kernel, for reports
+    static const char* kernelName();
+};
+
+#endif
@@ -1,24 +1,66 @@
 #include "RecognitionEngine.h"
+#include "TemplateDatabase.h"
+#include "BruteForceMatcher.h"
+#include "LshIndex.h"
+#include "VocabularyTree.h"
+#include "PointTransform.h"
 
 #include <iostream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <set>
+#include <unistd.h>
+#include <pthread.h>
 
 using namespace std;
 
-RecognitionEngine::RecognitionEngine()
+//wall clock in milliseconds, used for the stage timings in frameStats
+static double currentTimeMs()
 {
+    return (double)cvGetTickCount() / (cvGetTickFrequency() * 1000.0);
+}
 
-    trainingParams = cvSURFParams(300, 0); //1000 for iPhone
-    trainingParams.nOctaves = 4; //4 default
-    trainingParams.nOctaveLayers = 2; //2 default
+RecognitionEngine::RecognitionEngine()
+{
 
-    recognitionParams = cvSURFParams(600, 0); //900 for iPhone
-    recognitionParams.nOctaves = 1; //2 for iPhone
-    recognitionParams.nOctaveLayers = 2; //2 default
+    featureExtractor = new SurfExtractor();
+    extractorThreads = 1;
+    adaptiveThreshold = true;
+    minFrameKeypoints = 100;
+    maxFrameKeypoints = 300;
+    budgetFrames = 0;
+    budgetFramesUnder = 0;
+    budgetFramesOver = 0;
+    lastFrameKeypoints = 0;
+    totalFrameKeypoints = 0;
 
     win_size = 7;
 
     flann_index = NULL;
     m_object = NULL;
+    indexFingerprint = 0;
+    recent_index = NULL;
+    m_recent = NULL;
+    indexedTemplates = 0;
+    mergeRatio = 0.1;
+
+    matcherMode = MATCHER_AUTO;
+    bruteForceMaxDescriptors = 5000;
+
+    lsh_index = NULL;
+    lshTables = 6;
+    lshKeyBits = 0;
+    lshProbeLevel = 1;
+
+    vocabularyTree = NULL;
+    vocabularyBranching = 10;
+    vocabularyDepth = 4;
+    vocabularyTrainingRows = 100000;
+    vocabularyMinTemplates = 50;
+    shortlistSize = 5;
+    pendingMerge = NULL;
+    templateDb = new TemplateDatabase();
 
     //For Tracking
     maxNumberOfTrackedPoints = 40;
@@ -30,6 +72,7 @@ RecognitionEngine::RecognitionEngine()
     pyramid = cvCreateImage( cvGetSize(iplGray), IPL_DEPTH_8U, 1 );
     prev_pyramid = cvCreateImage( cvGetSize(iplGray), IPL_DEPTH_8U, 1 );
     surfMask = cvCreateImage(cvSize(imgWidth, imgHeight), IPL_DEPTH_8U, 1);
+    recognitionMask = cvCreateImage(cvSize(imgWidth, imgHeight), IPL_DEPTH_8U, 1);
 
     large_iplGray = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
 
@@ -38,48 +81,128 @@ RecognitionEngine::RecognitionEngine()
 
     flags = 0;
 
-    points[0] = (CvPoint2D32f*)cvAlloc(maxNumberOfTrackedPoints*sizeof(points[0][0]));
-    points[1] = (CvPoint2D32f*)cvAlloc(maxNumberOfTrackedPoints*sizeof(points[0][0]));
+    //large blocks keep a frame's SURF descriptors in one contiguous block, see queryDescriptorMatrix()
+    cvReleaseMemStorage(&imageFeatures.featuresStorage);
+    imageFeatures.featuresStorage = cvCreateMemStorage(queryStorageBlockSize);
+    allocationCounter = NULL;
 
-
-    status = (char*) cvAlloc(maxNumberOfTrackedPoints*sizeof(char));
+    for(int k = 0; k < maxTargets; k++)
+    {
+        TrackedTarget& target = targets[k];
+        target.active = false;
+        target.templateIndex = -1;
+        target.points[0] = (CvPoint2D32f*)cvAlloc(maxNumberOfTrackedPoints*sizeof(target.points[0][0]));
+        target.points[1] = (CvPoint2D32f*)cvAlloc(maxNumberOfTrackedPoints*sizeof(target.points[0][0]));
+        target.templatePoints.resize(maxNumberOfTrackedPoints);
+        target.numberOfTrackedPoints = 0;
+        target.status = (char*) cvAlloc(maxNumberOfTrackedPoints*sizeof(char));
+        target.lost.resize(maxNumberOfTrackedPoints);
+        target.clearLost();
+    }
+    recognitionInterval = 10;
+    framesSinceRecognition = 0;
+    reacquisitionMargin = 0.25f;
+    maxReacquisitionAttempts = 5;
+    reacquisitionFailures = 0;
+    roiImage = NULL;
+    roiMask = NULL;
 
     minNumberOfMatchesThr = 20;
-    numberOfTrackedPoints = 0;
+    verificationCandidates = 3;
+    minInliers = 10;
+    minInlierRatio = 0.25f;
+    ransacThreshold = 1.0f;
+    trackingRansacThreshold = 2.0f;
 
     maxLostPointsRatio = 0.2;
+    maxFrameLostPointsRatio = 0.5;
+    replenishPoints = true;
+    trackingInliers.resize(maxNumberOfTrackedPoints);
+    replenishCorners.resize(maxNumberOfTrackedPoints);
+    replenishTemplatePoints.resize(maxNumberOfTrackedPoints);
+    motionPrediction = true;
+    pyramidLevels = 3;
+    maxIterations = 20;
+    predictedPyramidLevels = 2;
+    predictedMaxIterations = 10;
+    predictedPoints.resize(maxNumberOfTrackedPoints);
+    prevPyramidLevels = 0;
+    lkLevels = pyramidLevels;
+    lkIterations = maxIterations;
+    maxTrackingErrorRatio = 3.0f;
+    maxForwardBackwardError = 1.0f;
+    trackErrors.resize(maxNumberOfTrackedPoints);
+    sortedTrackErrors.reserve(maxNumberOfTrackedPoints);
+    checkedIndices.resize(maxNumberOfTrackedPoints);
+    checkedPoints.resize(maxNumberOfTrackedPoints);
+    backTrackedPoints.resize(maxNumberOfTrackedPoints);
+    backStatus.resize(maxNumberOfTrackedPoints);
     imagePointsForTracking.resize(maxNumberOfTrackedPoints);
-    templatePointsForTracking.resize(maxNumberOfTrackedPoints);
+
+    asyncRecognition = false;
+    maxPropagationPoints = 60;
+    minPropagationPoints = 8;
+    pendingRecognition = NULL;
+    recognitionGray = cvCreateImage(cvGetSize(iplGray), IPL_DEPTH_8U, 1);
+    propagationPoints[0] = (CvPoint2D32f*)cvAlloc(maxPropagationPoints*sizeof(propagationPoints[0][0]));
+    propagationPoints[1] = (CvPoint2D32f*)cvAlloc(maxPropagationPoints*sizeof(propagationPoints[0][0]));
+    propagationStart.resize(maxPropagationPoints);
+    propagationStatus.resize(maxPropagationPoints);
+    propagationAlive.resize(maxPropagationPoints);
+    propagationFrom.reserve(maxPropagationPoints);
+    propagationTo.reserve(maxPropagationPoints);
+    numberOfPropagationPoints = 0;
 
     averageRecognitionTime = 0.0;
     recognitionCount = 0;
     averageMatchesCount = 0.0;
 
-    templateFound = false;
-
 }
 
 RecognitionEngine::~RecognitionEngine()
 {	
+    cancelRecognition();
+    finishIndexMerge(true, true);
+    releaseRecentIndex();
     if(flann_index)
         delete flann_index;
+    if(lsh_index)
+        delete lsh_index;
+    if(vocabularyTree)
+        delete vocabularyTree;
     if(m_object)
         delete m_object;
+    templateFeatures.clear();
+    delete templateDb;
+    delete featureExtractor;
+
+    cvReleaseMemStorage(&imageFeatures.featuresStorage);
 
     cvReleaseImage(&iplGray);
     cvReleaseImage(&prev_grey);
     cvReleaseImage(&pyramid);
     cvReleaseImage(&prev_pyramid);
     cvReleaseImage(&surfMask);
+    cvReleaseImage(&recognitionMask);
+    cvReleaseImage(&recognitionGray);
+    cvFree(&propagationPoints[0]);
+    cvFree(&propagationPoints[1]);
+    if(roiImage)
+        cvReleaseImage(&roiImage);
+    if(roiMask)
+        cvReleaseImage(&roiMask);
 
     cvReleaseImage(&large_iplGray);
 
     cvReleaseImage(&tempImageForTracking);
     cvReleaseImage(&secondTempImageForTracking);
 
-    cvFree(&status);
-    cvFree(&(points[0]));
-    cvFree(&(points[1]));
+    for(int k = 0; k < maxTargets; k++)
+    {
+        cvFree(&targets[k].status);
+        cvFree(&(targets[k].points[0]));
+        cvFree(&(targets[k].points[1]));
+    }
 
 }
 
@@ -89,6 +212,7 @@ void RecognitionEngine::saveSurfFeatures(const SurfFeatures& templateFeatures, c
     cvWriteString(fileStorage, "name", templateFeatures.imageName.c_str());
     cvWriteInt(fileStorage, "width", templateFeatures.width);
     cvWriteInt(fileStorage, "height", templateFeatures.height);
+    cvWriteInt(fileStorage, "descriptorType", templateFeatures.descriptorType);
     cvWrite(fileStorage, "keypoints", templateFeatures.keypoints);
     cvWrite(fileStorage, "descriptors", templateFeatures.descriptors);
 
@@ -98,6 +222,7 @@ void RecognitionEngine::saveSurfFeatures(const SurfFeatures& templateFeatures, c
 
 void RecognitionEngine::loadSurfFeatures(const char* fileName)
 {
+    cancelRecognition();
     SurfFeatures _templFeatures;
 
     CvFileStorage *fileStorage = cvOpenFileStorage(fileName, _templFeatures.featuresStorage, CV_STORAGE_READ);
@@ -109,23 +234,49 @@ void RecognitionEngine::loadSurfFeatures(const char* fileName)
     _templFeatures.imageName = cvReadStringByName(fileStorage, 0, "name", 0);
     _templFeatures.width = cvReadIntByName(fileStorage, 0, "width", 0);
     _templFeatures.height	= cvReadIntByName(fileStorage, 0, "height", 0);
+    //files written before the descriptor type was stored hold SURF descriptors
+    _templFeatures.descriptorType = cvReadIntByName(fileStorage, 0, "descriptorType", DESCRIPTOR_SURF);
     _templFeatures.keypoints = (CvSeq*) cvReadByName(fileStorage, 0, "keypoints");
     _templFeatures.descriptors = (CvSeq*) cvReadByName(fileStorage, 0, "descriptors");
-    this->templateFeatures.push_back(_templFeatures);
 
     cvReleaseFileStorage(&fileStorage);
 
+    //all templates of a database are matched against each other, so they must share one descriptor type
+    if(!this->templateFeatures.empty() &&
+       (this->templateFeatures[0].descriptorType != _templFeatures.descriptorType ||
+        (_templFeatures.descriptors && this->templateFeatures[0].descriptors &&
+         this->templateFeatures[0].descriptors->elem_size != _templFeatures.descriptors->elem_size)))
+    {
+        printf("Skipping %s: its descriptors (%s) differ from the other templates (%s) \n", fileName,
+               FeatureExtractor::typeName(_templFeatures.descriptorType),
+               FeatureExtractor::typeName(this->templateFeatures[0].descriptorType));
+        return;
+    }
+    this->templateFeatures.push_back(_templFeatures);
+
 }
 
 
 void RecognitionEngine::createFlannIndex()
 {
+    cancelRecognition();
+    //a full build supersedes the secondary index and any merge in progress
+    finishIndexMerge(true, true);
+    releaseRecentIndex();
+    indexedTemplates = 0;
+
     //check if we have training data
     if(this->templateFeatures.size() < 1)
         return;
 
-    //all descriptors assumed to have same length (64 or 128)
-    int length = (int)(this->templateFeatures[0].descriptors->elem_size/sizeof(float));
+    //frames must be described like the templates
+    int descriptorType = this->templateFeatures[0].descriptorType;
+    if(descriptorType != featureExtractor->descriptorType())
+        setFeatureExtractor(descriptorType);
+
+    //all descriptors assumed to have same type and length (64 or 128 floats, or 32 bytes)
+    int type = FeatureExtractor::matrixType(descriptorType);
+    int length = this->templateFeatures[0].descriptors->elem_size / CV_ELEM_SIZE(type);
 
     //total number of descriptors in the database
     int total = 0;
@@ -140,502 +291,1764 @@ void RecognitionEngine::createFlannIndex()
         delete m_object;
         m_object = 0;
     }
-    m_object = new cv::Mat(total, length, CV_32F);
-    float* obj_ptr = m_object->ptr<float>(0);
 
-    // copy descriptors
-    unsigned int _total = 0;
-    for(unsigned int i = 0; i < this->templateFeatures.size(); i++)
+    //templates mapped from a database file already form one descriptor matrix, index it in place
+    if(templateDb->isOpen() &&
+       templateDb->templateCount() == (int)this->templateFeatures.size() &&
+       templateDb->descriptorType() == descriptorType &&
+       templateDb->descriptorLength() == length)
     {
-        CvSeqReader obj_reader;
-        cvStartReadSeq( this->templateFeatures[i].descriptors, &obj_reader );
-        printf("number of features:%d \n", this->templateFeatures[i].descriptors->total);
-        for(int j = 0; j < this->templateFeatures[i].descriptors->total; j++ )
-        {
-            const float* descriptor = (const float*)obj_reader.ptr;
-            CV_NEXT_SEQ_ELEM( obj_reader.seq->elem_size, obj_reader )
-                    memcpy(obj_ptr, descriptor, length*sizeof(float));
-            obj_ptr += length;
-        }
-        _total += this->templateFeatures[i].descriptors->total;
+        printf("total features: %d (mapped) \n", total);
+        m_object = new cv::Mat(total, length, type, (void*)templateDb->descriptors());
+    }
+    else
+    {
+        m_object = new cv::Mat(total, length, type);
+        copyTemplateDescriptors(0, this->templateFeatures.size(), m_object->ptr(0));
+        printf("total features: %d \n", total);
     }
-    printf("total features: %d \n", _total);
+    indexedTemplates = this->templateFeatures.size();
+    updateTemplateRowOffsets();
 
     if(flann_index)
+    {
         delete flann_index;
-    flann_index = new cv::flann::Index(*m_object, /* cv::flann::KMeansIndexParams(16, 15, cv::flann::CENTERS_RANDOM,  0.2 ));*/
-                                       cv::flann::KDTreeIndexParams(2)); //was 4
-    
-}
-
-
+        flann_index = NULL;
+    }
+    if(lsh_index)
+    {
+        delete lsh_index;
+        lsh_index = NULL;
+    }
 
-void RecognitionEngine::flannFindPairs( const CvSeq* imageDescriptors, std::vector<int>& ptpairs )
-{
-    if(flann_index == NULL) createFlannIndex();
+    //large catalogues are only searched through the vocabulary tree, a flat index would go unused
+    indexFingerprint = computeIndexFingerprint(indexedTemplates);
+    updateVocabularyTree();
+    if(vocabularyTree != NULL)
+        return;
 
-    int length = (int)(imageDescriptors->elem_size/sizeof(float));
+    //reuse the index saved for exactly this template set, if any
+    if(loadFlannIndexCache())
+        return;
 
-    cv::Mat m_image(imageDescriptors->total, length, CV_32F);
-    // copy descriptors
-    CvSeqReader img_reader;
-    float* img_ptr = m_image.ptr<float>(0);
-    cvStartReadSeq( imageDescriptors, &img_reader );
-    for(int i = 0; i < imageDescriptors->total; i++ )
+    //binary descriptors are hashed, the KD-tree needs floats
+    if(FeatureExtractor::isBinary(descriptorType))
     {
-        const float* descriptor = (const float*)img_reader.ptr;
-        CV_NEXT_SEQ_ELEM( img_reader.seq->elem_size, img_reader )
-                memcpy(img_ptr, descriptor, length*sizeof(float));
-        img_ptr += length;
+        lsh_index = new LshIndex(lshTables, lshKeyBits > 0 ? lshKeyBits : LshIndex::keyBitsFor(total));
+        lsh_index->build(*m_object);
     }
-
-    // find nearest neighbors using FLANN
-    cv::Mat m_indices(imageDescriptors->total, 2, CV_32S);
-    cv::Mat m_dists(imageDescriptors->total, 2, CV_32F);
-    flann_index->knnSearch(m_image, m_indices, m_dists, 2, cv::flann::SearchParams(16) ); //was 64 // maximum number of leafs checked
-
-    int* indices_ptr = m_indices.ptr<int>(0);
-    float* dists_ptr = m_dists.ptr<float>(0);
-    for (int i=0;i<m_indices.rows;++i) {
-    	if (dists_ptr[2*i]<0.6*dists_ptr[2*i+1]) {
-            ptpairs.push_back(i);
-            ptpairs.push_back(indices_ptr[2*i]);
-    	}
+    else
+    {
+        flann_index = new cv::flann::Index(*m_object, /* cv::flann::KMeansIndexParams(16, 15, cv::flann::CENTERS_RANDOM,  0.2 ));*/
+                                           cv::flann::KDTreeIndexParams(flannKdTrees)); //was 4
     }
+    saveFlannIndexCache();
 }
 
-//homography should have size 9
-bool RecognitionEngine::locatePlanarObject( float homography[])
+//64 bit FNV-1a over the template set and index parameters, taken 32 bits at a time
+static uint64_t fingerprintUpdate(uint64_t hash, const void* data, size_t size)
 {
-    std::vector<int> ptpairs;
-    int i, n;
-
-    //int t_on = clock(); // timer before calling func
-    flannFindPairs(this->imageFeatures.descriptors, ptpairs );
-    //int t_off = clock(); // timer when func returns
-
-    //cout << "flannFindPairs: " << (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC << " seconds" << endl;
-
-    n = ptpairs.size()/2;
-    if( n < this->minNumberOfMatchesThr )
-        return false;
-
-
-    //find the template with maxmimum number of matches
-    std::vector< std::vector<int> > matchesIndices(this->templateFeatures.size());
-    //correspinding indices from images
-    std::vector< std::vector<int> > imageIndices(this->templateFeatures.size());
-    //loop over n matches
-    for(int i = 0; i < n; i++)
+    const uint64_t prime = 1099511628211ULL;
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t words = size / 4;
+    for(size_t i = 0; i < words; i++)
     {
-        int matchIndex = ptpairs[i*2+1];
-        int lowerBound = 0;
-        int upperBound = 0;
-        //find which template this match belong to
-        for(unsigned int j = 0; j < this->templateFeatures.size(); j++)
-        {
-            //number of descriptors in this template
-            int _count = this->templateFeatures[j].descriptors->total;
-            upperBound += _count;
-            if((matchIndex > lowerBound - 1) &&
-               (matchIndex < upperBound))
-            {
-                matchesIndices[j].push_back(matchIndex - lowerBound);
-                imageIndices[j].push_back(ptpairs[i*2]);
-                break;
-            }
-            lowerBound += _count;
-        }
+        uint32_t word;
+        memcpy(&word, bytes + 4 * i, 4);
+        hash = (hash ^ word) * prime;
     }
-    //find the template with maximum number of matches
-    std::vector<int> matchesCount(this->templateFeatures.size());
-    for(unsigned int j = 0; j < this->templateFeatures.size(); j++)
+    for(size_t i = 4 * words; i < size; i++)
+        hash = (hash ^ bytes[i]) * prime;
+    return hash;
+}
+
+uint64_t RecognitionEngine::computeIndexFingerprint(unsigned int templateCount) const
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int params[4] = {flannIndexCacheVersion, flannKdTrees, m_object->rows, m_object->cols};
+    hash = fingerprintUpdate(hash, params, sizeof(params));
+    if(m_object->type() == CV_8U)
     {
-        matchesCount[j] = matchesIndices[j].size();
+        int lshParams[2] = {lshTables, lshKeyBits};
+        hash = fingerprintUpdate(hash, lshParams, sizeof(lshParams));
     }
 
-    std::vector<int>::iterator iterMax = std::max_element(matchesCount.begin(), matchesCount.end());
+    for(unsigned int i = 0; i < templateCount; i++)
+    {
+        const SurfFeatures& _templ = this->templateFeatures[i];
+        int dims[3] = {_templ.width, _templ.height, _templ.descriptors->total};
+        hash = fingerprintUpdate(hash, dims, sizeof(dims));
+        hash = fingerprintUpdate(hash, _templ.imageName.data(), _templ.imageName.size());
+    }
 
-    //Matched template
-    this->matchedTemplate = iterMax - matchesCount.begin();
-    int numberOfMatches = *iterMax;
-    if(numberOfMatches < this->minNumberOfMatchesThr)
-        return false;
+    //the descriptors themselves, so re-trained templates with the same names invalidate the cache
+    for(int i = 0; i < m_object->rows; i++)
+        hash = fingerprintUpdate(hash, m_object->ptr(i), m_object->cols * m_object->elemSize());
 
-    printf("Matched template: %d", this->matchedTemplate);
-    printf(" file: %s \n", this->templateFeatures[this->matchedTemplate].imageName.c_str());
+    return hash;
+}
 
-    this->templateFeatures[this->matchedTemplate].matchedPts.resize(numberOfMatches);
-    this->imageFeatures.matchedPts.resize(numberOfMatches);
+//The cache is the FLANN index file plus a small key file next to it holding
+//the fingerprint of the template set the index was built for.
+bool RecognitionEngine::loadFlannIndexCache()
+{
+    if(indexCacheFile.empty())
+        return false;
 
-    float _average_scale = 0;
-    for( i = 0; i < numberOfMatches; i++ )
+    std::string keyFile = indexCacheFile + ".key";
+    FILE* file = fopen(keyFile.c_str(), "rb");
+    if(!file)
+        return false;
+    uint64_t key[2] = {0, 0};
+    bool ok = fread(key, sizeof(key), 1, file) == 1;
+    fclose(file);
+    if(!ok || key[0] != (uint64_t)flannIndexCacheVersion || key[1] != indexFingerprint)
     {
-        CvSURFPoint* _surfPoint =  (CvSURFPoint*)cvGetSeqElem(this->templateFeatures[this->matchedTemplate].keypoints, matchesIndices[this->matchedTemplate][i]);
-        this->templateFeatures[this->matchedTemplate].matchedPts[i] = _surfPoint->pt;
-        this->imageFeatures.matchedPts[i] = ((CvSURFPoint*)cvGetSeqElem(this->imageFeatures.keypoints,imageIndices[this->matchedTemplate][i]))->pt;
-        _average_scale += _surfPoint->size;
+        printf("flann index cache %s is out of date \n", indexCacheFile.c_str());
+        return false;
     }
-    _average_scale /= numberOfMatches;
-    //  printf("average_scale: %f \n", _average_scale);
-
-    CvMat _pt1 = cvMat(1, n, CV_32FC2, &this->templateFeatures[this->matchedTemplate].matchedPts[0] );
-    CvMat _pt2 = cvMat(1, n, CV_32FC2, &this->imageFeatures.matchedPts[0] );
 
-    //t_on = clock(); // timer before calling func
-    bool found = false;
+    if(m_object->type() == CV_8U)
+    {
+        lsh_index = LshIndex::load(indexCacheFile, *m_object);
+        if(lsh_index == NULL)
+            return false;
+        printf("loaded lsh index from %s \n", indexCacheFile.c_str());
+        return true;
+    }
 
-    CvMat* _h = cvCreateMatHeader(3, 3, CV_32F);
-    cvSetData(_h, homography, CV_AUTOSTEP);
     try{
-        found = cvFindHomography( &_pt1, &_pt2, _h, CV_RANSAC, 1 );
+        flann_index = new cv::flann::Index(*m_object, cv::flann::SavedIndexParams(indexCacheFile));
     }
     catch( cv::Exception& e )
     {
         const char* err_msg = e.what();
-        printf("Exception in cvExtractSURF: %s \n", err_msg );
-        cvReleaseMatHeader(&_h);
+        printf("Exception loading flann index: %s \n", err_msg );
+        flann_index = NULL;
         return false;
     }
-    cvReleaseMatHeader(&_h);
-    //t_off = clock(); // timer when func return
-    //cout << "cvFindHomography: " << (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC << " seconds" << endl;
-    if(!found)
-        return false;
-
+    printf("loaded flann index from %s \n", indexCacheFile.c_str());
     return true;
 }
 
-void RecognitionEngine::transform(const float h[], const CvPoint2D32f& src, CvPoint2D32f& dst ) const
+void RecognitionEngine::saveFlannIndexCache()
 {
+    if(indexCacheFile.empty() || (flann_index == NULL && lsh_index == NULL))
+        return;
 
-    float x = src.x, y = src.y;
-    float Z = 1./(h[6]*x + h[7]*y + h[8]);
-    float X = (h[0]*x + h[1]*y + h[2])*Z;
-    float Y = (h[3]*x + h[4]*y + h[5])*Z;
-    dst.x = cvRound(X);
-    dst.y = cvRound(Y);
+    //drop the key first so a partly written index is never trusted
+    std::string keyFile = indexCacheFile + ".key";
+    unlink(keyFile.c_str());
+
+    if(lsh_index)
+    {
+        if(!lsh_index->save(indexCacheFile))
+            return;
+    }
+    else
+    {
+        try{
+            flann_index->save(indexCacheFile);
+        }
+        catch( cv::Exception& e )
+        {
+            const char* err_msg = e.what();
+            printf("Exception saving flann index: %s \n", err_msg );
+            return;
+        }
+    }
 
+    uint64_t key[2] = {(uint64_t)flannIndexCacheVersion, indexFingerprint};
+    FILE* file = fopen(keyFile.c_str(), "wb");
+    if(!file)
+    {
+        printf("Can't write %s \n", keyFile.c_str());
+        return;
+    }
+    bool ok = fwrite(key, sizeof(key), 1, file) == 1;
+    if(fclose(file) != 0 || !ok)
+        unlink(keyFile.c_str());
 }
 
-//make sure templatePointsInImagePlane has the size templateFeatures.templateKeypoints->total
-void RecognitionEngine::computeObjectPointsInImagePlane(const SurfFeatures& templateFeatures,  float* h)
+//a primary index being rebuilt on a background thread
+struct IndexMerge
+{
+    pthread_t thread;
+    cv::Mat* data;              //descriptors of the first templates, owned until swapped in
+    cv::flann::Index* index;
+    bool buildIndex;            //false when a vocabulary tree replaces the flat index
+    unsigned int templates;
+    volatile int done;
+};
+
+//a recognition running on the worker thread over recognitionGray
+struct RecognitionJob
 {
+    pthread_t thread;
+    RecognitionEngine* engine;
+    IplImage* mask;
+    CvRect roi;
+    bool useRoi;
+    bool reacquiring;   //searched near lost targets
+    bool recognized;
+    int frames;         //frames tracked since the snapshot
+    volatile int done;
+};
+
+static void* runIndexMerge(void* arg)
+{
+    IndexMerge* merge = (IndexMerge*)arg;
+    try{
+        if(merge->buildIndex)
+            merge->index = new cv::flann::Index(*merge->data, cv::flann::KDTreeIndexParams(RecognitionEngine::flannKdTrees));
+    }
+    catch( cv::Exception& e )
+    {
+        const char* err_msg = e.what();
+        printf("Exception merging flann index: %s \n", err_msg );
+        merge->index = NULL;
+    }
+    __sync_synchronize();
+    merge->done = 1;
+    return NULL;
+}
 
-    for( int i = 0; i < templateFeatures.keypoints->total; i++ )
+void RecognitionEngine::copyTemplateDescriptors(unsigned int first, unsigned int last, uchar* dst) const
+{
+    for(unsigned int i = first; i < last; i++)
     {
-        CvPoint2D32f pt = ((CvSURFPoint*)cvGetSeqElem(templateFeatures.keypoints,i))->pt;
+        const CvSeq* descriptors = this->templateFeatures[i].descriptors;
+        int size = descriptors->elem_size;
+        CvSeqReader obj_reader;
+        cvStartReadSeq( descriptors, &obj_reader );
+        printf("number of features:%d \n", descriptors->total);
+        for(int j = 0; j < descriptors->total; j++ )
+        {
+            const schar* descriptor = obj_reader.ptr;
+            CV_NEXT_SEQ_ELEM( obj_reader.seq->elem_size, obj_reader )
+                    memcpy(dst, descriptor, size);
+            dst += size;
+        }
+    }
+}
 
-        CvPoint2D32f dst = cvPoint2D32f(0, 0);
-        transform(h, pt, dst);
+void RecognitionEngine::updateTemplateRowOffsets()
+{
+    templateRowOffsets.resize(this->templateFeatures.size() + 1);
+    templateRowOffsets[0] = 0;
+    for(unsigned int i = 0; i < this->templateFeatures.size(); i++)
+        templateRowOffsets[i + 1] = templateRowOffsets[i] + this->templateFeatures[i].descriptors->total;
 
-        templatePointsInImagePlane[i] = dst;
+    templateVotes.assign(this->templateFeatures.size(), 0);
+}
 
-    }
+const uchar* RecognitionEngine::templateRows(int i) const
+{
+    if(i < indexedTemplates)
+        return m_object->ptr(templateRowOffsets[i]);
+    //without m_recent all recent templates are empty
+    return m_recent ? m_recent->ptr(templateRowOffsets[i] - m_object->rows) : NULL;
+}
 
+bool RecognitionEngine::useVocabularyTree() const
+{
+    return matcherMode == MATCHER_AUTO && (int)this->templateFeatures.size() >= vocabularyMinTemplates;
+}
 
+//the index fingerprint of all templates plus the tree parameters
+uint64_t RecognitionEngine::vocabularyTreeKey() const
+{
+    int params[3] = {vocabularyBranching, vocabularyDepth, vocabularyTrainingRows};
+    return fingerprintUpdate(indexFingerprint, params, sizeof(params));
 }
 
-void RecognitionEngine::createAndLoadSurfFeaturesFromImage(const std::string& imageFileName)
+//Called after the rows of all templates are in m_object or m_recent
+void RecognitionEngine::updateVocabularyTree()
 {
+    int templates = this->templateFeatures.size();
+    if(!useVocabularyTree() || m_object == NULL)
+    {
+        if(vocabularyTree)
+        {
+            delete vocabularyTree;
+            vocabularyTree = NULL;
+        }
+        return;
+    }
 
-    SurfFeatures _templFeatures;
-    createSurfFeaturesFromImage(_templFeatures, imageFileName);
+    //templates are only ever appended, so an existing tree just indexes the new ones
+    if(vocabularyTree != NULL &&
+       vocabularyTree->matrixType() == m_object->type() && vocabularyTree->descriptorLength() == m_object->cols &&
+       vocabularyTree->templateCount() <= templates)
+    {
+        for(int i = vocabularyTree->templateCount(); i < templates; i++)
+            vocabularyTree->addTemplate(templateRows(i), templateRowOffsets[i + 1] - templateRowOffsets[i]);
+        saveVocabularyTreeCache();
+        return;
+    }
 
-    std::string xmlFileName = imageFileName + std::string(".xml");
-    saveSurfFeatures(_templFeatures, xmlFileName);
+    if(vocabularyTree)
+        delete vocabularyTree;
 
-    this->templateFeatures.push_back(_templFeatures);
+    //reuse the tree saved for exactly this template set, if any
+    std::string cacheFile = indexCacheFile.empty() ? std::string() : indexCacheFile + ".vocab";
+    if(!cacheFile.empty())
+    {
+        vocabularyTree = VocabularyTree::load(cacheFile, vocabularyTreeKey(), vocabularyBranching, vocabularyDepth,
+                                              m_object->type(), m_object->cols);
+        if(vocabularyTree != NULL && vocabularyTree->templateCount() == templates)
+        {
+            printf("loaded vocabulary tree from %s \n", cacheFile.c_str());
+            return;
+        }
+        if(vocabularyTree)
+            delete vocabularyTree;
+    }
 
-    createFlannIndex();
+    std::vector<const uchar*> rows(templates);
+    std::vector<int> counts(templates);
+    for(int i = 0; i < templates; i++)
+    {
+        rows[i] = templateRows(i);
+        counts[i] = templateRowOffsets[i + 1] - templateRowOffsets[i];
+    }
+
+    int t_on = clock();
+    vocabularyTree = new VocabularyTree(vocabularyBranching, vocabularyDepth);
+    vocabularyTree->build(rows, counts, m_object->type(), m_object->cols, vocabularyTrainingRows);
+    int t_off = clock();
+    printf("time to build vocabulary tree of %d words: %f \n", vocabularyTree->wordCount(),
+           (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC);
 
+    saveVocabularyTreeCache();
 }
 
-void RecognitionEngine::createAndLoadSurfFeaturesFromImage(IplImage* image, const std::string& imageFileName, const std::string& xmlFileName)
+//The key only covers the indexedTemplates of indexFingerprint, so a tree that already
+//indexes later enrolments waits for the next merge. A partly written file fails its
+//checks on load.
+void RecognitionEngine::saveVocabularyTreeCache()
 {
+    if(indexCacheFile.empty() || vocabularyTree == NULL || vocabularyTree->templateCount() != indexedTemplates)
+        return;
+    vocabularyTree->save(indexCacheFile + ".vocab", vocabularyTreeKey());
+}
 
-    SurfFeatures _templFeatures;
-    createSurfFeaturesFromImage(_templFeatures, image, imageFileName);
+int RecognitionEngine::templateOfRow(int row) const
+{
+    //the last template whose first row is not after row; empty templates are skipped
+    return (int)(std::upper_bound(templateRowOffsets.begin(), templateRowOffsets.end(), row) -
+                 templateRowOffsets.begin()) - 1;
+}
 
-    saveSurfFeatures(_templFeatures, xmlFileName);
+void RecognitionEngine::releaseRecentIndex()
+{
+    if(recent_index)
+    {
+        delete recent_index;
+        recent_index = NULL;
+    }
+    if(m_recent)
+    {
+        delete m_recent;
+        m_recent = NULL;
+    }
+}
 
-    this->templateFeatures.push_back(_templFeatures);
+void RecognitionEngine::buildRecentIndex()
+{
+    releaseRecentIndex();
+    if(indexedTemplates >= (int)this->templateFeatures.size())
+        return;
 
-    createFlannIndex();
+    int length = m_object->cols;
+    int total = 0;
+    for(unsigned int i = indexedTemplates; i < this->templateFeatures.size(); i++)
+        total += this->templateFeatures[i].descriptors->total;
+    if(total == 0)
+        return;
 
+    m_recent = new cv::Mat(total, length, m_object->type());
+    copyTemplateDescriptors(indexedTemplates, this->templateFeatures.size(), m_recent->ptr(0));
+    //the vocabulary tree reads the rows directly
+    if(vocabularyTree == NULL)
+        recent_index = new cv::flann::Index(*m_recent, cv::flann::KDTreeIndexParams(flannKdTrees));
 }
 
-void RecognitionEngine::createSurfFeaturesFromImage(SurfFeatures& surfFeatures, const std::string& imageFileName)
+void RecognitionEngine::appendToFlannIndex()
 {
-    IplImage* img = cvLoadImage(imageFileName.c_str(),0);
-    if(!img)
+    cancelRecognition();
+    finishIndexMerge(false, false);
+
+    //binary databases without a vocabulary tree have no KD-tree to keep: they are copied
+    //and rehashed, linear in the rows; switching between the flat index and the tree also
+    //takes a full build
+    bool _tree = useVocabularyTree();
+    if(m_object == NULL || _tree != (vocabularyTree != NULL) || (!_tree && flann_index == NULL))
     {
-        printf("Could not load image.") ;
+        createFlannIndex();
         return;
     }
 
-    surfFeatures.width = img->width;
-    surfFeatures.height = img->height;
-    surfFeatures.imageName = imageFileName;
-
-    cvExtractSURF( img, 0, &surfFeatures.keypoints, &surfFeatures.descriptors,
-                   surfFeatures.featuresStorage, trainingParams, 0 );
-
-    cvReleaseImage(&img);
+    updateTemplateRowOffsets();
 
+    //the secondary index only holds the templates added since the last full build
+    int t_on = clock();
+    buildRecentIndex();
+    int t_off = clock();
+    printf("time to index %d recent features: %f \n", m_recent ? m_recent->rows : 0,
+           (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC);
+    //only the new templates are quantized, from their rows in m_recent
+    updateVocabularyTree();
+
+    if(pendingMerge == NULL && m_recent != NULL && m_recent->rows >= mergeRatio * m_object->rows)
+        startIndexMerge();
 }
 
-void RecognitionEngine::createSurfFeaturesFromImage(SurfFeatures& surfFeatures, IplImage* image, const std::string& imageFileName)
+void RecognitionEngine::startIndexMerge()
 {
-    surfFeatures.width = image->width;
-    surfFeatures.height = image->height;
-    surfFeatures.imageName = imageFileName;
-
-    cvExtractSURF( image, 0, &surfFeatures.keypoints, &surfFeatures.descriptors,
-                   surfFeatures.featuresStorage, trainingParams, 0 );
+    int rows = m_object->rows + (m_recent ? m_recent->rows : 0);
+    IndexMerge* merge = new IndexMerge;
+    merge->data = new cv::Mat(rows, m_object->cols, m_object->type());
+    merge->index = NULL;
+    merge->buildIndex = vocabularyTree == NULL;
+    merge->templates = this->templateFeatures.size();
+    merge->done = 0;
+
+    //copy the rows here, the thread must not touch matrices replaced by later enrolments
+    memcpy(merge->data->ptr(0), m_object->ptr(0), m_object->rows * m_object->cols * m_object->elemSize());
+    if(m_recent)
+        memcpy(merge->data->ptr(m_object->rows), m_recent->ptr(0), m_recent->rows * m_recent->cols * m_recent->elemSize());
+
+    if(pthread_create(&merge->thread, NULL, runIndexMerge, merge) != 0)
+    {
+        printf("Can't start flann index merge \n");
+        delete merge->data;
+        delete merge;
+        return;
+    }
+    printf("merging flann index over %d features in the background \n", rows);
+    pendingMerge = merge;
 }
 
-bool RecognitionEngine::surfRecognize() {
-
-    //check if we have a template
-    if( this->templateFeatures.size() < 1)
-        return false;
-
-    /* automatic initialization */
-    bool found = false;
-    cvClearMemStorage(this->imageFeatures.featuresStorage);
+void RecognitionEngine::finishIndexMerge(bool wait, bool discard)
+{
+    if(pendingMerge == NULL)
+        return;
+    if(!wait && !pendingMerge->done)
+        return;
 
-    int t_on = clock(); // timer before calling func
-    //if we already have a matched template, try to extract surf only in approximate known locations
-    IplImage *mask = 0;
+    pthread_join(pendingMerge->thread, NULL);
+    IndexMerge* merge = pendingMerge;
+    pendingMerge = NULL;
 
-    try{
-        cvExtractSURF(  this->iplGray, mask, & this->imageFeatures.keypoints, & this->imageFeatures.descriptors,
-                        this->imageFeatures.featuresStorage,  this->recognitionParams, 0 );
-    }
-    catch( cv::Exception& e )
+    if(discard || (merge->buildIndex && merge->index == NULL))
     {
-        const char* err_msg = e.what();
-        printf("Exception in cvExtractSURF: %s \n", err_msg );
-        return false;
+        if(merge->index)
+            delete merge->index;
+        delete merge->data;
+        delete merge;
+        return;
     }
 
-    //if extract surf fails
-    if(this->imageFeatures.keypoints == NULL || this->imageFeatures.descriptors == NULL)
+    if(merge->buildIndex)
     {
-        return false;
+        if(flann_index)
+            delete flann_index;
+        flann_index = merge->index;
     }
+    if(m_object)
+        delete m_object;
+    m_object = merge->data;
+    indexedTemplates = merge->templates;
+    delete merge;
 
+    //templates enrolled while merging stay in the secondary index
+    buildRecentIndex();
 
-    found =  this->locatePlanarObject(homography);
-    if(!found) {
-        return false;
-    }
-    this->numberMatches = this->templateFeatures[this->matchedTemplate].matchedPts.size();
-    //printf("N matches: %d \n", this->numberMatches);
+    //the caches are rewritten here rather than on every enrolment
+    indexFingerprint = computeIndexFingerprint(indexedTemplates);
+    saveFlannIndexCache();
+    saveVocabularyTreeCache();
+}
 
-    int t_off = clock(); // timer when func returns
-    float currentRecognTime = (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC;
-    //cout << "Recgn time: " << currentRecognTime << " seconds" << endl;
-    averageRecognitionTime = recognitionCount * averageRecognitionTime + currentRecognTime;
-    averageMatchesCount = recognitionCount * averageMatchesCount + this->numberMatches;
+void RecognitionEngine::prepareIndex()
+{
+    finishIndexMerge(false, false);
+    if(m_object == NULL && !this->templateFeatures.empty())
+        createFlannIndex();
+}
 
-    recognitionCount++;
-    averageRecognitionTime /= recognitionCount;
-    averageMatchesCount /= recognitionCount;
 
-    printf("averageRecognitionTime: %f \n", averageRecognitionTime);
-    // printf("averageRecognitionTimeUsingPrediction: %f \n", averageRecognitionTimeUsingPrediction);
-    // printf("predictionRate: %f \n", predictionRate);
-    printf("averageMatchesCount: %f \n", averageMatchesCount);
 
-    //end recognition
-    return true;
+//grow a buffer matrix to at least the given number of rows; it never shrinks
+static void reserveRows(cv::Mat& buffer, int rows, int cols, int type)
+{
+    if(buffer.rows >= rows && buffer.cols == cols && buffer.type() == type)
+        return;
+    buffer.create(std::max(rows, 2 * buffer.rows), cols, type);
 }
 
+//Contiguous view of a frame's descriptors. SURF writes all descriptors of a frame with
+//one cvSeqPushMulti, so with the large block size of the frame storage they sit in a
+//single block and are used in place. Otherwise the blocks are copied into m_queryBuffer.
+//The descriptors have the element type of the database, m_object.
+cv::Mat RecognitionEngine::queryDescriptorMatrix(const CvSeq* imageDescriptors)
+{
+    int type = m_object->type();
+    int length = imageDescriptors->elem_size / CV_ELEM_SIZE(type);
+    int rows = imageDescriptors->total;
+    CvSeqBlock* block = imageDescriptors->first;
 
-bool RecognitionEngine::surfTrack() {
-
-    //check if we have a template
-    if( this->templateFeatures.size() < 1)
-        return false;
+    if(block != NULL && block->next == block)
+        return cv::Mat(rows, length, type, block->data);
 
-    if( !templateFound )
+    reserveRows(m_queryBuffer, rows, length, type);
+    uchar* dst = m_queryBuffer.ptr(0);
+    for(int copied = 0; copied < rows; block = block->next)
     {
-        if(!surfRecognize())
-            return false;
-
-        //end recognition
+        memcpy(dst, block->data, block->count * imageDescriptors->elem_size);
+        dst += block->count * imageDescriptors->elem_size;
+        copied += block->count;
+    }
+    return m_queryBuffer.rowRange(0, rows);
+}
 
-        //Compute points for tracking
+void RecognitionEngine::flannFindPairs( const CvSeq* imageDescriptors, std::vector<int>& ptpairs )
+{
+    //this may run on the recognition worker: the index was prepared before, without one
+    //there are no pairs; a frame described before the extractor was switched to the
+    //database's type can't be matched
+    if(m_object == NULL || imageDescriptors->elem_size != (int)(m_object->cols * m_object->elemSize()))
+        return;
 
-        int t_on = clock(); // timer before calling func
+    int rows = imageDescriptors->total;
+    cv::Mat m_image = queryDescriptorMatrix(imageDescriptors);
+
+    //results go into buffers kept between frames
+    reserveRows(m_indicesBuffer, rows, 2, CV_32S);
+    reserveRows(m_distsBuffer, rows, 2, CV_32F);
+    cv::Mat m_indices = m_indicesBuffer.rowRange(0, rows);
+    cv::Mat m_dists = m_distsBuffer.rowRange(0, rows);
+
+    //small databases are scanned exhaustively, the approximate KD-tree search only pays off for large ones
+    //binary descriptors are compared by Hamming distance, exhaustively or through the LSH index
+    int databaseRows = m_object->rows + (m_recent ? m_recent->rows : 0);
+    bool binary = m_object->type() == CV_8U;
+    bool bruteForce = matcherMode == MATCHER_BRUTE_FORCE ||
+                      (matcherMode == MATCHER_AUTO && databaseRows <= bruteForceMaxDescriptors) ||
+                      (binary ? lsh_index == NULL : flann_index == NULL);
+    recognitionStats.bruteForceMatching = bruteForce;
+
+    if(binary && bruteForce)
+    {
+        int* idx = m_indices.ptr<int>(0);
+        float* dst = m_dists.ptr<float>(0);
+        BruteForceMatcher::reset(idx, dst, rows);
+        BruteForceMatcher::updateHamming(m_image.ptr(0), rows, m_object->ptr(0), m_object->rows,
+                                         m_image.cols, 0, idx, dst);
+    }
+    else if(binary)
+    {
+        lsh_index->knnSearch(m_image, m_indices.ptr<int>(0), m_dists.ptr<float>(0), lshProbeLevel);
+        recognitionStats.indexCandidates = lsh_index->candidates();
+    }
+    else if(bruteForce)
+    {
+        int* idx = m_indices.ptr<int>(0);
+        float* dst = m_dists.ptr<float>(0);
+        BruteForceMatcher::reset(idx, dst, rows);
+        BruteForceMatcher::update(m_image.ptr<float>(0), rows, m_object->ptr<float>(0), m_object->rows,
+                                  m_image.cols, 0, idx, dst);
+        if(m_recent != NULL)
+            BruteForceMatcher::update(m_image.ptr<float>(0), rows, m_recent->ptr<float>(0), m_recent->rows,
+                                      m_image.cols, m_object->rows, idx, dst);
+    }
+    else
+    {
+        // find nearest neighbors using FLANN
+        flann_index->knnSearch(m_image, m_indices, m_dists, 2, cv::flann::SearchParams(16) ); //was 64 // maximum number of leafs checked
+    }
 
-        //create mask
-        cvSet(surfMask, cvScalar(0));
-        //find bounding box
-        int _h = this->templateFeatures[this->matchedTemplate].height;
-        int _w = this->templateFeatures[this->matchedTemplate].width;
-        std::vector<CvPoint2D32f> _srcPoints;
-        _srcPoints.push_back(cvPoint2D32f(0,0));
-        _srcPoints.push_back(cvPoint2D32f(0,_h));
-        _srcPoints.push_back(cvPoint2D32f(_w,_h));
-        _srcPoints.push_back(cvPoint2D32f(_w,0));
+    //merge in the two best candidates from the templates enrolled since the last build
+    if(!bruteForce && recent_index != NULL)
+    {
+        int k = std::min(2, m_recent->rows);
+        reserveRows(m_recentIndicesBuffer, rows, k, CV_32S);
+        reserveRows(m_recentDistsBuffer, rows, k, CV_32F);
+        cv::Mat r_indices = m_recentIndicesBuffer.rowRange(0, rows);
+        cv::Mat r_dists = m_recentDistsBuffer.rowRange(0, rows);
+        recent_index->knnSearch(m_image, r_indices, r_dists, k, cv::flann::SearchParams(16) );
+
+        int* idx = m_indices.ptr<int>(0);
+        float* dst = m_dists.ptr<float>(0);
+        const int* r_idx = r_indices.ptr<int>(0);
+        const float* r_dst = r_dists.ptr<float>(0);
+        for (int i = 0; i < imageDescriptors->total; ++i) {
+            for (int j = 0; j < k; ++j) {
+                float d = r_dst[k*i+j];
+                int row = r_idx[k*i+j] + m_object->rows;
+                if (d < dst[2*i]) {
+                    dst[2*i+1] = dst[2*i];
+                    idx[2*i+1] = idx[2*i];
+                    dst[2*i] = d;
+                    idx[2*i] = row;
+                } else if (d < dst[2*i+1]) {
+                    dst[2*i+1] = d;
+                    idx[2*i+1] = row;
+                }
+            }
+        }
+    }
 
-        float minX = 100000;
-        float minY = 100000;
-        float maxX = -100000;
-        float maxY = -100000;
-        for(int i = 0; i < 4; i++)
+    int* indices_ptr = m_indices.ptr<int>(0);
+    float* dists_ptr = m_dists.ptr<float>(0);
+    for (int i=0;i<m_indices.rows;++i) {
+    	if (dists_ptr[2*i]<0.6*dists_ptr[2*i+1]) {
+            ptpairs.push_back(i);
+            ptpairs.push_back(indices_ptr[2*i]);
+            matchRatios.push_back(dists_ptr[2*i]/dists_ptr[2*i+1]);
+    	}
+    }
+}
+
+void RecognitionEngine::matchShortlist(std::vector<int>& ptpairs)
+{
+    //may run on the recognition worker, like flannFindPairs()
+    const CvSeq* imageDescriptors = this->imageFeatures.descriptors;
+    if(m_object == NULL || vocabularyTree == NULL ||
+       imageDescriptors->elem_size != (int)(m_object->cols * m_object->elemSize()))
+        return;
+
+    int rows = imageDescriptors->total;
+    if(rows == 0)
+        return;
+    cv::Mat m_image = queryDescriptorMatrix(imageDescriptors);
+    vocabularyTree->shortlist(m_image, shortlistSize, shortlist);
+
+    reserveRows(m_indicesBuffer, rows, 2, CV_32S);
+    reserveRows(m_distsBuffer, rows, 2, CV_32F);
+    int* idx = m_indicesBuffer.ptr<int>(0);
+    float* dst = m_distsBuffer.ptr<float>(0);
+    bool binary = m_object->type() == CV_8U;
+    recognitionStats.bruteForceMatching = true;
+
+    //every template is small enough for an exhaustive search, and its ratio test is not
+    //spoiled by similar descriptors of other templates; rows stay global, so the pairs
+    //are voted on like those of the whole database
+    for(unsigned int s = 0; s < shortlist.size(); s++)
+    {
+        int t = shortlist[s];
+        int firstRow = templateRowOffsets[t];
+        int count = templateRowOffsets[t + 1] - firstRow;
+        if(count == 0)
+            continue;
+
+        BruteForceMatcher::reset(idx, dst, rows);
+        if(binary)
+            BruteForceMatcher::updateHamming(m_image.ptr(0), rows, templateRows(t), count,
+                                             m_image.cols, firstRow, idx, dst);
+        else
+            BruteForceMatcher::update(m_image.ptr<float>(0), rows, (const float*)templateRows(t), count,
+                                      m_image.cols, firstRow, idx, dst);
+
+        for(int i = 0; i < rows; i++)
         {
-            CvPoint2D32f dst;
-            this->transform(this->homography, _srcPoints[i], dst);
-            if(dst.x < minX)
-                minX = dst.x;
-            else  if(dst.x > maxX)
-                maxX = dst.x;
-
-            if(dst.y < minY)
-                minY = dst.y;
-            else if(dst.y > maxY)
-                maxY = dst.y;
-        }
-        if(minX < 0)
-            minX = 0;
-        else if(minX > this->surfMask->width - 1)
-            minX = this->surfMask->width;
-
-        if(minY < 0)
-            minY = 0;
-        else if(minY > this->surfMask->height - 1)
-            minY = this->surfMask->height - 1;
-
-        if(maxX < 0)
-            maxX = 0;
-        else if(maxX > this->surfMask->width - 1)
-            maxX = this->surfMask->width;
-
-        if(maxY < 0)
-            maxY = 0;
-        else if(maxY > this->surfMask->height - 1)
-            maxY = this->surfMask->height - 1;
-
-        //      printf("%f %f %f %f \n", minX, maxX, minY, maxY);
-
-        for (int y = minY; y < maxY; ++y) {
-            for (int x = minX; x < maxX; ++x) {
-                ((uchar*)(this->surfMask->imageData + this->surfMask->widthStep*y))[x] = 1;
+            if(dst[2*i] < 0.6*dst[2*i+1])
+            {
+                ptpairs.push_back(i);
+                ptpairs.push_back(idx[2*i]);
+                matchRatios.push_back(dst[2*i]/dst[2*i+1]);
             }
         }
+    }
+}
 
-        this->numberOfTrackedPoints = this->maxNumberOfTrackedPoints;
-        CvPoint2D32f* corners = new CvPoint2D32f[this->numberOfTrackedPoints];
-        cvGoodFeaturesToTrack(this->iplGray, this->tempImageForTracking, this->secondTempImageForTracking, corners, &(this->numberOfTrackedPoints),
-                              0.01, 1.5 * this->win_size, this->surfMask);
-        cvFindCornerSubPix(this->iplGray,  corners, this->numberOfTrackedPoints,
-                           cvSize(this->win_size, this->win_size), cvSize(-1,-1), cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,20,0.03));
-        int t_off = clock(); // timer when func returns
-        float currentRecognTime = (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC;
-        printf("Recgn time for Harris: %f \n",currentRecognTime);
+//homography should have size 9
+bool RecognitionEngine::locatePlanarObject( float homography[])
+{
+    std::vector<int>& ptpairs = matchPairs;
+    int i, n;
+
+    long _allocations = allocationCounter ? allocationCounter() : 0;
+    double _t0 = currentTimeMs();
+    ptpairs.clear();
+    matchRatios.clear();
+    if(vocabularyTree != NULL)
+        //two stages: only the templates sharing most visual words with the frame are matched
+        matchShortlist(ptpairs);
+    else
+        flannFindPairs(this->imageFeatures.descriptors, ptpairs );
+    recognitionStats.flannMs += currentTimeMs() - _t0;
+
+    n = ptpairs.size()/2;
+    recognitionStats.matchedPairs = n;
+    if( n < this->minNumberOfMatchesThr )
+        return false;
+
+
+    //vote: find which template every match belongs to and count the matches per template
+    matchOwners.resize(n);
+    votedTemplates.clear();
+    for(i = 0; i < n; i++)
+    {
+        int owner = templateOfRow(ptpairs[i*2+1]);
+        matchOwners[i] = owner;
+        if(templateVotes[owner]++ == 0)
+            votedTemplates.push_back(owner);
+    }
+
+    //move the verificationCandidates templates with most matches to the front, the lowest
+    //index first on ties; the list is short, so a selection is cheaper than sorting it
+    int _candidates = std::min((int)votedTemplates.size(), std::max(1, verificationCandidates));
+    for(int k = 0; k < _candidates; k++)
+    {
+        int best = k;
+        for(unsigned int j = k + 1; j < votedTemplates.size(); j++)
+        {
+            int t = votedTemplates[j], b = votedTemplates[best];
+            if(templateVotes[t] > templateVotes[b] || (templateVotes[t] == templateVotes[b] && t < b))
+                best = j;
+        }
+        std::swap(votedTemplates[k], votedTemplates[best]);
+    }
+    candidateVotes.resize(_candidates);
+    for(int k = 0; k < _candidates; k++)
+        candidateVotes[k] = templateVotes[votedTemplates[k]];
 
-        CvMat _hom = cvMat(3, 3, CV_32F, homography);
-        CvMat* _h_inv = cvCreateMat(3, 3, CV_32F);
-        cvInvert(&_hom, _h_inv);
+    //leave the vote buffer cleared for the next frame
+    for(unsigned int j = 0; j < votedTemplates.size(); j++)
+        templateVotes[votedTemplates[j]] = 0;
 
-        int _trackedPointsInTemplateCount = 0;
-        for(int i = 0; i <  this->numberOfTrackedPoints; i++)
+    if(allocationCounter)
+        recognitionStats.matchAllocations += allocationCounter() - _allocations;
+
+    //verify the candidates in order of votes until one homography is supported well enough
+    for(int k = 0; k < _candidates; k++)
+    {
+        int numberOfMatches = candidateVotes[k];
+        if(numberOfMatches < this->minNumberOfMatchesThr)
+            break;
+
+        this->matchedTemplate = votedTemplates[k];
+        recognitionStats.verifiedCandidates++;
+        if(verifyCandidate(ptpairs, numberOfMatches, homography))
         {
-            CvPoint2D32f _pt;
-            this->transform( _h_inv->data.fl,  corners[i], _pt);
-            if((_pt.x < 0) ||
-               (_pt.x > this->templateFeatures[this->matchedTemplate].width - 1) ||
-               (_pt.y < 0) ||
-               (_pt.y > this->templateFeatures[this->matchedTemplate].height - 1))
+            printf("Matched template: %d", this->matchedTemplate);
+            printf(" file: %s \n", this->templateFeatures[this->matchedTemplate].imageName.c_str());
+            return true;
+        }
+    }
+    return false;
+}
+
+//fit a homography to the matches of matchedTemplate, true if enough of them are inliers
+//orders pairs by their ratio test distance ratio, the most distinctive first
+struct ByMatchRatio
+{
+    const float* ratios;
+    bool operator()(int a, int b) const {return ratios[a] < ratios[b];}
+};
+
+bool RecognitionEngine::verifyCandidate(const std::vector<int>& ptpairs, int numberOfMatches, float homography[])
+{
+    int i, n = ptpairs.size()/2;
+
+    //the estimator samples the most distinctive matches first
+    verificationOrder.clear();
+    for( i = 0; i < n; i++ )
+        if(matchOwners[i] == this->matchedTemplate)
+            verificationOrder.push_back(i);
+    ByMatchRatio _byRatio = {&matchRatios[0]};
+    std::stable_sort(verificationOrder.begin(), verificationOrder.end(), _byRatio);
+
+
+    this->templateFeatures[this->matchedTemplate].matchedPts.resize(numberOfMatches);
+    this->imageFeatures.matchedPts.resize(numberOfMatches);
+
+    float _average_scale = 0;
+    int _firstRow = templateRowOffsets[this->matchedTemplate];
+    int _count = 0;
+    for(unsigned int j = 0; j < verificationOrder.size(); j++ )
+    {
+        i = verificationOrder[j];
+        CvSURFPoint* _surfPoint =  (CvSURFPoint*)cvGetSeqElem(this->templateFeatures[this->matchedTemplate].keypoints, ptpairs[i*2+1] - _firstRow);
+        this->templateFeatures[this->matchedTemplate].matchedPts[_count] = _surfPoint->pt;
+        this->imageFeatures.matchedPts[_count] = ((CvSURFPoint*)cvGetSeqElem(this->imageFeatures.keypoints, ptpairs[i*2]))->pt;
+        _average_scale += _surfPoint->size;
+        _count++;
+    }
+    _average_scale /= numberOfMatches;
+    //  printf("average_scale: %f \n", _average_scale);
+
+    inlierMask.resize(numberOfMatches);
+
+    double _t0 = currentTimeMs();
+    bool found = homographyEstimator.estimate(&this->templateFeatures[this->matchedTemplate].matchedPts[0],
+                                              &this->imageFeatures.matchedPts[0], numberOfMatches,
+                                              ransacThreshold, homography, &inlierMask[0]);
+    recognitionStats.ransacMs += currentTimeMs() - _t0;
+    recognitionStats.ransacIterations += homographyEstimator.iterations();
+    if(!found)
+        return false;
+
+    int _inliers = homographyEstimator.inliers();
+    return _inliers >= minInliers && _inliers >= minInlierRatio * numberOfMatches;
+}
+
+void RecognitionEngine::transform(const float h[], const CvPoint2D32f& src, CvPoint2D32f& dst ) const
+{
+    PointTransform::transformRounded(h, &src, &dst, 1);
+}
+
+void RecognitionEngine::computeObjectPointsInImagePlane(const SurfFeatures& templateFeatures,  float* h)
+{
+    //gather the keypoint positions into a flat array in one pass over the sequence
+    int _count = templateFeatures.keypoints->total;
+    templateKeypointPositions.resize(_count);
+    templatePointsInImagePlane.resize(_count);
+    if(_count == 0)
+        return;
+
+    CvSeqReader _reader;
+    cvStartReadSeq(templateFeatures.keypoints, &_reader);
+    for(int i = 0; i < _count; i++)
+    {
+        templateKeypointPositions[i] = ((const CvSURFPoint*)_reader.ptr)->pt;
+        CV_NEXT_SEQ_ELEM(_reader.seq->elem_size, _reader)
+    }
+
+    PointTransform::transformRounded(h, &templateKeypointPositions[0], &templatePointsInImagePlane[0], _count);
+}
+
+void RecognitionEngine::createAndLoadSurfFeaturesFromImage(const std::string& imageFileName)
+{
+
+    SurfFeatures _templFeatures;
+    createSurfFeaturesFromImage(_templFeatures, imageFileName);
+
+    std::string xmlFileName = imageFileName + std::string(".xml");
+    saveSurfFeatures(_templFeatures, xmlFileName);
+
+    this->templateFeatures.push_back(_templFeatures);
+
+    appendToFlannIndex();
+
+}
+
+void RecognitionEngine::createAndLoadSurfFeaturesFromImage(IplImage* image, const std::string& imageFileName, const std::string& xmlFileName)
+{
+
+    SurfFeatures _templFeatures;
+    createSurfFeaturesFromImage(_templFeatures, image, imageFileName);
+
+    saveSurfFeatures(_templFeatures, xmlFileName);
+
+    this->templateFeatures.push_back(_templFeatures);
+
+    appendToFlannIndex();
+
+}
+
+void RecognitionEngine::createSurfFeaturesFromImage(SurfFeatures& surfFeatures, const std::string& imageFileName)
+{
+    cancelRecognition();
+    IplImage* img = cvLoadImage(imageFileName.c_str(),0);
+    if(!img)
+    {
+        printf("Could not load image.") ;
+        return;
+    }
+
+    surfFeatures.width = img->width;
+    surfFeatures.height = img->height;
+    surfFeatures.imageName = imageFileName;
+    surfFeatures.descriptorType = featureExtractor->descriptorType();
+
+    featureExtractor->extract( img, 0, &surfFeatures.keypoints, &surfFeatures.descriptors,
+                               surfFeatures.featuresStorage, true );
+
+    cvReleaseImage(&img);
+
+}
+
+void RecognitionEngine::createSurfFeaturesFromImage(SurfFeatures& surfFeatures, IplImage* image, const std::string& imageFileName)
+{
+    cancelRecognition();
+    surfFeatures.width = image->width;
+    surfFeatures.height = image->height;
+    surfFeatures.imageName = imageFileName;
+    surfFeatures.descriptorType = featureExtractor->descriptorType();
+
+    featureExtractor->extract( image, 0, &surfFeatures.keypoints, &surfFeatures.descriptors,
+                               surfFeatures.featuresStorage, true );
+}
+
+IplImage* RecognitionEngine::copyRegion(IplImage* src, const CvRect& region, IplImage*& buffer)
+{
+    if(buffer == NULL || buffer->width != region.width || buffer->height != region.height)
+    {
+        if(buffer)
+            cvReleaseImage(&buffer);
+        buffer = cvCreateImage(cvSize(region.width, region.height), src->depth, src->nChannels);
+    }
+    cvSetImageROI(src, region);
+    cvCopy(src, buffer);
+    cvResetImageROI(src);
+    return buffer;
+}
+
+bool RecognitionEngine::surfRecognize(IplImage* mask, const CvRect* roi) {
+
+    cancelRecognition();
+    prepareIndex();
+    recognitionStats.clear();
+    bool found = recognize(this->iplGray, mask, roi);
+    frameStats.addRecognition(recognitionStats);
+    frameStats.recognitionRun = true;
+    frameStats.recognized = found;
+    return found;
+}
+
+bool RecognitionEngine::recognize(IplImage* image, IplImage* mask, const CvRect* roi) {
+
+    //check if we have a template
+    if( this->templateFeatures.size() < 1)
+        return false;
+
+    /* automatic initialization */
+    bool found = false;
+    cvClearMemStorage(this->imageFeatures.featuresStorage);
+
+    int t_on = clock(); // timer before calling func
+
+    double _t0 = currentTimeMs();
+
+    //extract from a copy of the region of interest only, the detector costs by area
+    IplImage* _image = image;
+    if(roi != NULL && (roi->width < _image->width || roi->height < _image->height))
+    {
+        _image = copyRegion(image, *roi, roiImage);
+        if(mask)
+            mask = copyRegion(mask, *roi, roiMask);
+    }
+    try{
+        featureExtractor->extract(  _image, mask, & this->imageFeatures.keypoints, & this->imageFeatures.descriptors,
+                                    this->imageFeatures.featuresStorage, false );
+        this->imageFeatures.descriptorType = featureExtractor->descriptorType();
+    }
+    catch( cv::Exception& e )
+    {
+        const char* err_msg = e.what();
+        printf("Exception in %s feature extraction: %s \n", featureExtractor->name(), err_msg );
+        recognitionStats.surfMs += currentTimeMs() - _t0;
+        return false;
+    }
+    recognitionStats.surfMs += currentTimeMs() - _t0;
+
+    //if extract surf fails
+    if(this->imageFeatures.keypoints == NULL || this->imageFeatures.descriptors == NULL)
+    {
+        return false;
+    }
+    recognitionStats.imageKeypoints = this->imageFeatures.keypoints->total;
+    if(mask == NULL && _image == image)
+        updateDetectorThreshold(recognitionStats.imageKeypoints);
+
+    //back to frame coordinates
+    if(_image != image)
+    {
+        for(int i = 0; i < this->imageFeatures.keypoints->total; i++)
+        {
+            CvSURFPoint* _point = (CvSURFPoint*)cvGetSeqElem(this->imageFeatures.keypoints, i);
+            _point->pt.x += roi->x;
+            _point->pt.y += roi->y;
+        }
+    }
+
+    found =  this->locatePlanarObject(homography);
+    if(!found) {
+        return false;
+    }
+    this->numberMatches = this->templateFeatures[this->matchedTemplate].matchedPts.size();
+    //printf("N matches: %d \n", this->numberMatches);
+
+    int t_off = clock(); // timer when func returns
+    float currentRecognTime = (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC;
+    //cout << "Recgn time: " << currentRecognTime << " seconds" << endl;
+    averageRecognitionTime = recognitionCount * averageRecognitionTime + currentRecognTime;
+    averageMatchesCount = recognitionCount * averageMatchesCount + this->numberMatches;
+
+    recognitionCount++;
+    averageRecognitionTime /= recognitionCount;
+    averageMatchesCount /= recognitionCount;
+
+    printf("averageRecognitionTime: %f \n", averageRecognitionTime);
+    // printf("averageRecognitionTimeUsingPrediction: %f \n", averageRecognitionTimeUsingPrediction);
+    // printf("predictionRate: %f \n", predictionRate);
+    printf("averageMatchesCount: %f \n", averageMatchesCount);
+
+    //end recognition
+    return true;
+}
+
+
+void RecognitionEngine::updateDetectorThreshold(int keypoints)
+{
+    budgetFrames++;
+    lastFrameKeypoints = keypoints;
+    totalFrameKeypoints += keypoints;
+    if(keypoints < minFrameKeypoints)
+        budgetFramesUnder++;
+    else if(keypoints > maxFrameKeypoints)
+        budgetFramesOver++;
+    else
+        return;
+    if(!adaptiveThreshold)
+        return;
+
+    //The count falls about in inverse proportion to the threshold. Step half way to
+    //the middle of the band in log scale, at most a factor 2 per frame, so a single
+    //odd frame does not throw the threshold far off.
+    double target = sqrt((double)minFrameKeypoints * maxFrameKeypoints);
+    double factor = sqrt(std::max(keypoints, 1) / target);
+    factor = std::max(0.5, std::min(2.0, factor));
+    featureExtractor->setDetectorThreshold(featureExtractor->detectorThreshold() * factor);
+}
+
+KeypointBudget RecognitionEngine::keypointBudget() const
+{
+    KeypointBudget budget;
+    budget.minKeypoints = minFrameKeypoints;
+    budget.maxKeypoints = maxFrameKeypoints;
+    budget.threshold = featureExtractor->detectorThreshold();
+    budget.lastKeypoints = lastFrameKeypoints;
+    budget.averageKeypoints = budgetFrames ? (float)totalFrameKeypoints / budgetFrames : 0;
+    budget.frames = budgetFrames;
+    budget.framesUnder = budgetFramesUnder;
+    budget.framesOver = budgetFramesOver;
+    return budget;
+}
+
+bool RecognitionEngine::surfTrack() {
+
+    frameStats.clear();
+    double _frameStart = currentTimeMs();
+    bool tracked = trackFrame();
+    frameStats.liveTargets = liveTargets();
+    frameStats.tracking = frameStats.liveTargets > 0;
+    frameStats.totalMs = currentTimeMs() - _frameStart;
+    return tracked;
+}
+
+int RecognitionEngine::liveTargets() const
+{
+    int live = 0;
+    for(int k = 0; k < maxTargets; k++)
+        if(targets[k].active)
+            live++;
+    return live;
+}
+
+CvRect RecognitionEngine::targetBounds(int templateIndex, const float h[]) const
+{
+    int _h = this->templateFeatures[templateIndex].height;
+    int _w = this->templateFeatures[templateIndex].width;
+    CvPoint2D32f _srcPoints[4] = {cvPoint2D32f(0,0), cvPoint2D32f(0,_h), cvPoint2D32f(_w,_h), cvPoint2D32f(_w,0)};
+
+    CvPoint2D32f _dstPoints[4];
+    PointTransform::transformRounded(h, _srcPoints, _dstPoints, 4);
+
+    float minX = 100000;
+    float minY = 100000;
+    float maxX = -100000;
+    float maxY = -100000;
+    for(int i = 0; i < 4; i++)
+    {
+        const CvPoint2D32f& dst = _dstPoints[i];
+        minX = std::min(minX, dst.x);
+        maxX = std::max(maxX, dst.x);
+        minY = std::min(minY, dst.y);
+        maxY = std::max(maxY, dst.y);
+    }
+    int x0 = std::max(0, std::min(imgWidth, (int)minX));
+    int y0 = std::max(0, std::min(imgHeight, (int)minY));
+    int x1 = std::max(0, std::min(imgWidth, (int)maxX));
+    int y1 = std::max(0, std::min(imgHeight, (int)maxY));
+    return cvRect(x0, y0, x1 - x0, y1 - y0);
+}
+
+void RecognitionEngine::startTarget(TrackedTarget& target)
+{
+    //Compute points for tracking
+
+    double _t0 = currentTimeMs();
+
+    //create mask
+    cvSet(surfMask, cvScalar(0));
+    //find bounding box
+    CvRect _bounds = targetBounds(this->matchedTemplate, this->homography);
+    if(_bounds.width > 0 && _bounds.height > 0)
+    {
+        cvSetImageROI(surfMask, _bounds);
+        cvSet(surfMask, cvScalar(1));
+        cvResetImageROI(surfMask);
+    }
+
+    int _corners = this->maxNumberOfTrackedPoints;
+    CvPoint2D32f* corners = new CvPoint2D32f[_corners];
+    cvGoodFeaturesToTrack(this->iplGray, this->tempImageForTracking, this->secondTempImageForTracking, corners, &_corners,
+                          0.01, 1.5 * this->win_size, this->surfMask);
+    cvFindCornerSubPix(this->iplGray,  corners, _corners,
+                       cvSize(this->win_size, this->win_size), cvSize(-1,-1), cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,20,0.03));
+    frameStats.cornersMs += currentTimeMs() - _t0;
+
+    CvMat _hom = cvMat(3, 3, CV_32F, homography);
+    CvMat* _h_inv = cvCreateMat(3, 3, CV_32F);
+    cvInvert(&_hom, _h_inv);
+
+    //corners back to the template plane, sub-pixel so the tracking homography keeps their precision
+    CvPoint2D32f* cornersInTemplate = new CvPoint2D32f[_corners];
+    PointTransform::transform(_h_inv->data.fl, corners, cornersInTemplate, _corners);
+
+    int _trackedPointsInTemplateCount = 0;
+    for(int i = 0; i < _corners; i++)
+    {
+        const CvPoint2D32f& _pt = cornersInTemplate[i];
+        if((_pt.x < 0) ||
+           (_pt.x > this->templateFeatures[this->matchedTemplate].width - 1) ||
+           (_pt.y < 0) ||
+           (_pt.y > this->templateFeatures[this->matchedTemplate].height - 1))
+            continue;
+        target.templatePoints[_trackedPointsInTemplateCount] =  _pt;
+        target.points[1][_trackedPointsInTemplateCount] =  corners[i];
+        _trackedPointsInTemplateCount++;
+    }
+    target.numberOfTrackedPoints = _trackedPointsInTemplateCount;
+    frameStats.trackedPoints += target.numberOfTrackedPoints;
+
+    cvReleaseMat(&_h_inv);
+    delete [] cornersInTemplate;
+    delete [] corners;
+
+    target.templateIndex = this->matchedTemplate;
+    memcpy(target.homography, this->homography, sizeof(target.homography));
+    target.hasMotion = false;
+    target.clearLost();
+    target.active = true;
+}
+
+bool RecognitionEngine::trackTarget(TrackedTarget& target, int lkFlags)
+{
+    //start from where the motion of the last frame puts the points
+    bool _predicted = motionPrediction && target.hasMotion;
+    if(_predicted)
+    {
+        //image motion of the last frame, homography * previousHomography^-1
+        CvMat _h = cvMat(3, 3, CV_32F, target.homography);
+        CvMat _prev = cvMat(3, 3, CV_32F, target.previousHomography);
+        float _inv[9], _motion[9];
+        CvMat _prevInv = cvMat(3, 3, CV_32F, _inv);
+        CvMat _m = cvMat(3, 3, CV_32F, _motion);
+        if(cvInvert(&_prev, &_prevInv) == 0)
+            _predicted = false;
+        else
+        {
+            cvMatMul(&_h, &_prevInv, &_m);
+            PointTransform::transform(_motion, target.points[0], &predictedPoints[0], target.numberOfTrackedPoints);
+            memcpy(target.points[1], &predictedPoints[0], target.numberOfTrackedPoints * sizeof(target.points[1][0]));
+            lkFlags |= CV_LKFLOW_INITIAL_GUESSES;
+        }
+    }
+
+    //track features
+    double _t0 = currentTimeMs();
+    cvCalcOpticalFlowPyrLK(  prev_grey,  iplGray,  prev_pyramid,  pyramid,
+                             target.points[0],  target.points[1],  target.numberOfTrackedPoints, cvSize( win_size,
+                                                                                                       win_size), lkLevels,  target.status, &trackErrors[0],
+                             cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,lkIterations,0.03),  lkFlags ); //was 20, 0.03
+    frameStats.lkMs += currentTimeMs() - _t0;
+
+    if(_predicted)
+    {
+        for(int i = 0; i < target.numberOfTrackedPoints; i++)
+        {
+            if(target.lost[i] || target.status[i] == 0)
                 continue;
-            templatePointsForTracking[_trackedPointsInTemplateCount] =  _pt;
-            points[1][_trackedPointsInTemplateCount] =  corners[i];
-            _trackedPointsInTemplateCount++;
+            float dx = target.points[1][i].x - predictedPoints[i].x;
+            float dy = target.points[1][i].y - predictedPoints[i].y;
+            frameStats.predictionResidual += sqrt(dx*dx + dy*dy);
+            frameStats.predictedPoints++;
+        }
+    }
+
+    checkTrackedPoints(target);
+
+    //use only well tracked points for homography
+    std::vector<CvPoint2D32f> _objectPointsForHomography;
+    std::vector<CvPoint2D32f> _imagePointsForHomography;
+    std::vector<int> _indices;
+    int _newlyLost = 0;
+
+    for(int i = 0; i < target.numberOfTrackedPoints; i++ )
+    {
+        if(target.lost[i])
+            continue;
+        if( target.status[i] == 0) {
+            target.lost[i] = true;
+            target.lostCount++;
+            _newlyLost++;
+            continue;
         }
-        this->numberOfTrackedPoints = _trackedPointsInTemplateCount;
+        _objectPointsForHomography.push_back( target.templatePoints[i]);
+        _imagePointsForHomography.push_back( target.points[1][i]);
+        _indices.push_back(i);
+    }
+
+    frameStats.trackedPoints += _objectPointsForHomography.size();
+    frameStats.lostPoints += target.lostCount;
+
+    //check tracking
+    if(_newlyLost > target.numberOfTrackedPoints * maxFrameLostPointsRatio)
+        return false;
+    if(!replenishPoints && target.lostCount > target.numberOfTrackedPoints * maxLostPointsRatio)
+        return false;
 
-        cvReleaseMat(&_h_inv);
-        delete [] corners;
+    if(_objectPointsForHomography.size() < 4)
+        return false;
 
-        templateFound = true;
-    } //end init
-    else {
-        //track features
-        cvCalcOpticalFlowPyrLK(  prev_grey,  iplGray,  prev_pyramid,  pyramid,
-                                 points[0],  points[1],   this->numberOfTrackedPoints, cvSize( win_size,
-                                                                                               win_size), 3,  status, 0,
-                                 cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,20,0.03),  flags ); //was 20, 0.03
+    //compute new homography, robust to the odd point LK got wrong
+    memcpy(target.previousHomography, target.homography, sizeof(target.homography));
+    _t0 = currentTimeMs();
+    bool OK = trackingEstimator.estimate(&_objectPointsForHomography[0], &_imagePointsForHomography[0],
+                                           _objectPointsForHomography.size(), trackingRansacThreshold,
+                                           target.homography, &trackingInliers[0]);
+    frameStats.trackHomographyMs += currentTimeMs() - _t0;
 
-        //use only well tracked points for homography
-        std::vector<CvPoint2D32f> _objectPointsForHomography;
-        std::vector<CvPoint2D32f> _imagePointsForHomography;
+    //lost homogrophy, reset for recognition
+    if(!OK)
+        return false;
 
-        for(int i = 0; i <   this->numberOfTrackedPoints; i++ )
+    //RANSAC accepts any four points that fit; a homography most points disagree with
+    //follows an occluder or the background, and replenishing from it would only add
+    //points that agree with it. The target is dropped where it was last tracked.
+    int _inliers = 0;
+    for(unsigned int j = 0; j < _indices.size(); j++)
+        if(trackingInliers[j])
+            _inliers++;
+    if(_inliers < minInliers || _inliers < minInlierRatio * _indices.size())
+    {
+        memcpy(target.homography, target.previousHomography, sizeof(target.homography));
+        return false;
+    }
+    target.hasMotion = true;
+
+    if(replenishPoints)
+    {
+        //points off the homography have drifted, they are replaced like lost ones
+        for(unsigned int j = 0; j < _indices.size(); j++)
         {
-            if( status[i] == 0) {
-                lostIndices.push_back(i);
+            if(trackingInliers[j])
                 continue;
-            }
-            std::list<int>::iterator result = std::find( lostIndices.begin(),  lostIndices.end(), i);
-            if(result !=  lostIndices.end())
+            target.lost[_indices[j]] = true;
+            target.lostCount++;
+        }
+        if(target.lostCount > target.numberOfTrackedPoints * maxLostPointsRatio)
+            replenishTarget(target);
+    }
+    return true;
+}
+
+void RecognitionEngine::checkTrackedPoints(TrackedTarget& target)
+{
+    double _t0 = currentTimeMs();
+    int _rejected = 0;
+
+    //the points LK followed this frame
+    int _count = 0;
+    for(int i = 0; i < target.numberOfTrackedPoints; i++)
+    {
+        if(target.lost[i] || target.status[i] == 0)
+            continue;
+        checkedIndices[_count] = i;
+        checkedPoints[_count] = target.points[1][i];
+        _count++;
+    }
+
+    //a residual well above the other points' means the window matched something else
+    if(maxTrackingErrorRatio > 0 && _count > 0)
+    {
+        sortedTrackErrors.clear();
+        for(int j = 0; j < _count; j++)
+            sortedTrackErrors.push_back(trackErrors[checkedIndices[j]]);
+        std::nth_element(sortedTrackErrors.begin(), sortedTrackErrors.begin() + _count/2, sortedTrackErrors.end());
+        float _limit = maxTrackingErrorRatio * std::max(sortedTrackErrors[_count/2], 1e-3f);
+
+        int _kept = 0;
+        for(int j = 0; j < _count; j++)
+        {
+            int i = checkedIndices[j];
+            if(trackErrors[i] > _limit)
+            {
+                target.status[i] = 0;
+                _rejected++;
                 continue;
-            _objectPointsForHomography.push_back( templatePointsForTracking[i]);
-            _imagePointsForHomography.push_back( points[1][i]);
+            }
+            checkedIndices[_kept] = i;
+            checkedPoints[_kept] = checkedPoints[j];
+            _kept++;
         }
+        _count = _kept;
+    }
 
-        //check tracking
-        if(lostIndices.size() >   this->numberOfTrackedPoints *  maxLostPointsRatio)
+    //track back to the previous frame, a point that drifted does not return to its start;
+    //the forward pass built both pyramids, so this one only iterates
+    if(maxForwardBackwardError > 0 && _count > 0)
+    {
+        cvCalcOpticalFlowPyrLK(  iplGray,  prev_grey,  pyramid,  prev_pyramid,
+                                 &checkedPoints[0],  &backTrackedPoints[0],  _count, cvSize( win_size, win_size), lkLevels,
+                                 &backStatus[0], 0, cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,lkIterations,0.03),
+                                 CV_LKFLOW_PYR_A_READY | CV_LKFLOW_PYR_B_READY );
+        float _max2 = maxForwardBackwardError * maxForwardBackwardError;
+        for(int j = 0; j < _count; j++)
         {
-            //lost tracking, reset for recognition
-            templateFound = false;
-            flags = 0;
-            lostIndices.clear();
-            return false;
+            int i = checkedIndices[j];
+            float dx = backTrackedPoints[j].x - target.points[0][i].x;
+            float dy = backTrackedPoints[j].y - target.points[0][i].y;
+            if(backStatus[j] == 0 || dx*dx + dy*dy > _max2)
+            {
+                target.status[i] = 0;
+                _rejected++;
+            }
         }
+    }
 
-        flags |= CV_LKFLOW_PYR_A_READY;
-        //compute new homography
-        //CvMat _h = cvMat(3, 3, CV_32F, homography);
-        CvMat* _h = cvCreateMatHeader(3, 3, CV_32F);
-        cvSetData(_h, homography, CV_AUTOSTEP);
+    frameStats.rejectedPoints += _rejected;
+    frameStats.lkCheckMs += currentTimeMs() - _t0;
+}
 
-        CvMat _pt1 = cvMat(1, _objectPointsForHomography.size(), CV_32FC2, &_objectPointsForHomography[0] );
-        CvMat _pt2 = cvMat(1, _imagePointsForHomography.size(), CV_32FC2, &_imagePointsForHomography[0] );
+void RecognitionEngine::replenishTarget(TrackedTarget& target)
+{
+    double _t0 = currentTimeMs();
 
-        bool OK = false;
-        try{
-            OK = cvFindHomography( &_pt1, &_pt2, _h );//, CV_RANSAC, 2 );
+    //search inside the target's outline, away from the points still tracked
+    CvRect _bounds = targetBounds(target.templateIndex, target.homography);
+    if(_bounds.width <= 0 || _bounds.height <= 0)
+        return;
+    cvSet(surfMask, cvScalar(0));
+    cvSetImageROI(surfMask, _bounds);
+    cvSet(surfMask, cvScalar(1));
+    cvResetImageROI(surfMask);
+    int _r = this->win_size;
+    for(int i = 0; i < target.numberOfTrackedPoints; i++)
+    {
+        if(target.lost[i])
+            continue;
+        CvPoint _p = cvPointFrom32f(target.points[1][i]);
+        cvRectangle(surfMask, cvPoint(_p.x - _r, _p.y - _r), cvPoint(_p.x + _r, _p.y + _r), cvScalar(0), CV_FILLED);
+    }
+
+    //at most every point slot, so the member buffers always suffice
+    int _corners = target.lostCount + (this->maxNumberOfTrackedPoints - target.numberOfTrackedPoints);
+    CvPoint2D32f* corners = &replenishCorners[0];
+    cvGoodFeaturesToTrack(this->iplGray, this->tempImageForTracking, this->secondTempImageForTracking, corners, &_corners,
+                          0.01, 1.5 * this->win_size, this->surfMask);
+    if(_corners > 0)
+        cvFindCornerSubPix(this->iplGray,  corners, _corners,
+                           cvSize(this->win_size, this->win_size), cvSize(-1,-1), cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,20,0.03));
+
+    //onto the template with the homography of this frame
+    CvMat _hom = cvMat(3, 3, CV_32F, target.homography);
+    float _inv[9];
+    CvMat _h_inv = cvMat(3, 3, CV_32F, _inv);
+    cvInvert(&_hom, &_h_inv);
+    CvPoint2D32f* cornersInTemplate = &replenishTemplatePoints[0];
+    PointTransform::transform(_inv, corners, cornersInTemplate, _corners);
+
+    const SurfFeatures& _template = this->templateFeatures[target.templateIndex];
+    int _slot = 0;
+    int _added = 0;
+    for(int i = 0; i < _corners; i++)
+    {
+        const CvPoint2D32f& _pt = cornersInTemplate[i];
+        if(_pt.x < 0 || _pt.x > _template.width - 1 || _pt.y < 0 || _pt.y > _template.height - 1)
+            continue;
+        //next lost slot, or a new one after the last point
+        while(_slot < target.numberOfTrackedPoints && !target.lost[_slot])
+            _slot++;
+        if(_slot >= (int)this->maxNumberOfTrackedPoints)
+            break;
+        if(_slot == target.numberOfTrackedPoints)
+            target.numberOfTrackedPoints++;
+        else
+        {
+            target.lost[_slot] = false;
+            target.lostCount--;
         }
-        catch( cv::Exception& e )
+        target.templatePoints[_slot] = _pt;
+        target.points[1][_slot] = corners[i];
+        _slot++;
+        _added++;
+    }
+
+    frameStats.replenishedPoints += _added;
+    frameStats.cornersMs += currentTimeMs() - _t0;
+}
+
+bool RecognitionEngine::trackFrame() {
+
+    //check if we have a template
+    if( this->templateFeatures.size() < 1)
+        return false;
+
+    //fewer levels and iterations only when every target starts from a prediction,
+    //all LK calls of the frame share the pyramids
+    bool _allPredicted = motionPrediction && pendingRecognition == NULL;
+    for(int k = 0; k < maxTargets; k++)
+        if(targets[k].active && !targets[k].hasMotion)
+            _allPredicted = false;
+    lkLevels = _allPredicted ? predictedPyramidLevels : pyramidLevels;
+    lkIterations = _allPredicted ? predictedMaxIterations : maxIterations;
+
+    //the first LK call of the frame builds the pyramid of iplGray, the others reuse it;
+    //the previous frame's pyramid is only usable if it has enough levels
+    int _lkFlags = flags;
+    if(lkLevels > prevPyramidLevels)
+        _lkFlags &= ~CV_LKFLOW_PYR_A_READY;
+    bool _pyramidBuilt = false;
+    for(int k = 0; k < maxTargets; k++)
+    {
+        TrackedTarget& target = targets[k];
+        if(!target.active)
+            continue;
+        bool _tracked = trackTarget(target, _lkFlags);
+        _lkFlags |= CV_LKFLOW_PYR_B_READY;
+        _pyramidBuilt = true;
+        if(!_tracked)
         {
-            const char* err_msg = e.what();
-            printf("Exception in cvFindHomography: %s \n", err_msg );
-            templateFound = false;
-            flags = 0;
-            lostIndices.clear();
-            cvReleaseMatHeader(&_h);
-            return false;
+            //lost tracking, free the target for recognition
+            frameStats.trackingLost = true;
+            target.active = false;
+            target.clearLost();
+
+            //and look for it where it was last seen first
+            CvRect _bounds = targetBounds(target.templateIndex, target.homography);
+            int _mx = cvRound(_bounds.width * reacquisitionMargin);
+            int _my = cvRound(_bounds.height * reacquisitionMargin);
+            int x0 = std::max(0, _bounds.x - _mx), y0 = std::max(0, _bounds.y - _my);
+            int x1 = std::min(imgWidth, _bounds.x + _bounds.width + _mx);
+            int y1 = std::min(imgHeight, _bounds.y + _bounds.height + _my);
+            if(maxReacquisitionAttempts > 0 && x1 > x0 && y1 > y0)
+            {
+                reacquisitionRegions.push_back(cvRect(x0, y0, x1 - x0, y1 - y0));
+                reacquisitionFailures = 0;
+            }
         }
-        cvReleaseMatHeader(&_h);
+    }
 
-        if(!OK) {
-            //lost homogrophy, reset for recognition
-            templateFound = false;
-            flags = 0;
-            lostIndices.clear();
-            return false;
+    //carry a recognition running on the worker along, and use its result once it is done
+    if(pendingRecognition != NULL)
+    {
+        trackPropagationPoints(_lkFlags);
+        _lkFlags |= CV_LKFLOW_PYR_B_READY;
+        _pyramidBuilt = true;
+        if(pendingRecognition->done)
+        {
+            RecognitionJob* job = pendingRecognition;
+            pendingRecognition = NULL;
+            pthread_join(job->thread, NULL);
+            frameStats.addRecognition(recognitionStats);
+            frameStats.recognitionLatency = job->frames;
+            endRecognition(job->recognized && propagateRecognition(), job->reacquiring);
+            delete job;
+        }
+    }
+
+    //recognize in every frame while nothing is tracked or lost targets are searched for,
+    //otherwise now and then, and only where no live target is
+    int _live = liveTargets();
+    bool _reacquiring = !reacquisitionRegions.empty();
+    if(pendingRecognition == NULL &&
+       (_live == 0 || (_live < maxTargets && (_reacquiring || ++framesSinceRecognition >= recognitionInterval))))
+    {
+        framesSinceRecognition = 0;
+        CvRect _roi;
+        bool _useRoi = false;
+        IplImage* _mask = recognitionRegion(_roi, _useRoi);
+        frameStats.recognitionRun = true;
+        frameStats.roiRecognition = _reacquiring;
+
+        if(asyncRecognition)
+            startRecognition(_mask, _useRoi ? &_roi : NULL, _reacquiring);
+        else
+        {
+            prepareIndex();
+            recognitionStats.clear();
+            bool _recognized = recognize(this->iplGray, _mask, _useRoi ? &_roi : NULL);
+            frameStats.addRecognition(recognitionStats);
+            endRecognition(_recognized, _reacquiring);
         }
-    }//end tracking
+    }
+
+    //the propagation points need the previous frame as well
+    bool _pending = pendingRecognition != NULL;
+    if(liveTargets() == 0 && !_pending)
+    {
+        flags = 0;
+        return false;
+    }
+
     CV_SWAP(  prev_grey,  iplGray,  swap_temp );
     CV_SWAP(  prev_pyramid,  pyramid,  swap_temp );
-    CV_SWAP(  points[0],  points[1],  swap_points );
+    for(int k = 0; k < maxTargets; k++)
+    {
+        if(targets[k].active)
+            CV_SWAP(  targets[k].points[0],  targets[k].points[1],  swap_points );
+    }
+    if(_pending)
+        CV_SWAP(  propagationPoints[0],  propagationPoints[1],  swap_points );
+    //pyramid was only built if LK ran in this frame
+    flags = _pyramidBuilt ? CV_LKFLOW_PYR_A_READY : 0;
+    prevPyramidLevels = _pyramidBuilt ? lkLevels : 0;
+    return liveTargets() > 0;
+}
+
+IplImage* RecognitionEngine::recognitionRegion(CvRect& roi, bool& useRoi)
+{
+    int _live = liveTargets();
+    IplImage* _mask = NULL;
+    roi = cvRect(0, 0, imgWidth, imgHeight);
+    useRoi = false;
+    if(!reacquisitionRegions.empty())
+    {
+        //only the regions where targets were lost, within their bounding box
+        cvSet(recognitionMask, cvScalar(0));
+        int x0 = imgWidth, y0 = imgHeight, x1 = 0, y1 = 0;
+        for(unsigned int r = 0; r < reacquisitionRegions.size(); r++)
+        {
+            const CvRect& _region = reacquisitionRegions[r];
+            cvSetImageROI(recognitionMask, _region);
+            cvSet(recognitionMask, cvScalar(1));
+            cvResetImageROI(recognitionMask);
+            x0 = std::min(x0, _region.x);
+            y0 = std::min(y0, _region.y);
+            x1 = std::max(x1, _region.x + _region.width);
+            y1 = std::max(y1, _region.y + _region.height);
+        }
+        roi = cvRect(x0, y0, x1 - x0, y1 - y0);
+        useRoi = true;
+        //a single region is the whole roi
+        if(reacquisitionRegions.size() > 1 || _live > 0)
+            _mask = recognitionMask;
+    }
+    else if(_live > 0)
+    {
+        cvSet(recognitionMask, cvScalar(1));
+        _mask = recognitionMask;
+    }
+
+    if(_live > 0)
+    {
+        for(int k = 0; k < maxTargets; k++)
+        {
+            if(!targets[k].active)
+                continue;
+            CvRect _bounds = targetBounds(targets[k].templateIndex, targets[k].homography);
+            if(_bounds.width > 0 && _bounds.height > 0)
+            {
+                cvSetImageROI(recognitionMask, _bounds);
+                cvSet(recognitionMask, cvScalar(0));
+                cvResetImageROI(recognitionMask);
+            }
+        }
+    }
+    return _mask;
+}
+
+void RecognitionEngine::endRecognition(bool recognized, bool reacquiring)
+{
+    if(recognized)
+    {
+        frameStats.recognized = true;
+
+        //features on the border of a live target can recognize it again, keep the old track
+        CvRect _found = targetBounds(this->matchedTemplate, this->homography);
+        CvPoint _center = cvPoint(_found.x + _found.width/2, _found.y + _found.height/2);
+        bool _covered = false;
+        int _free = -1;
+        for(int k = 0; k < maxTargets; k++)
+        {
+            if(!targets[k].active)
+            {
+                if(_free < 0)
+                    _free = k;
+                continue;
+            }
+            CvRect _bounds = targetBounds(targets[k].templateIndex, targets[k].homography);
+            if(_center.x >= _bounds.x && _center.x < _bounds.x + _bounds.width &&
+               _center.y >= _bounds.y && _center.y < _bounds.y + _bounds.height)
+                _covered = true;
+        }
+        if(!_covered && _free >= 0)
+            startTarget(targets[_free]);
+
+        //the region the target was found in is done with
+        for(int r = reacquisitionRegions.size() - 1; r >= 0; r--)
+        {
+            const CvRect& _region = reacquisitionRegions[r];
+            if(_center.x >= _region.x && _center.x < _region.x + _region.width &&
+               _center.y >= _region.y && _center.y < _region.y + _region.height)
+                reacquisitionRegions.erase(reacquisitionRegions.begin() + r);
+        }
+    }
+    if(reacquiring && !recognized && ++reacquisitionFailures >= maxReacquisitionAttempts)
+    {
+        //not near where it was lost any more, search the whole frame again
+        reacquisitionRegions.clear();
+    }
+    if(reacquisitionRegions.empty())
+        reacquisitionFailures = 0;
+}
+
+void* RecognitionEngine::runRecognition(void* arg)
+{
+    RecognitionJob* job = (RecognitionJob*)arg;
+    RecognitionEngine* engine = job->engine;
+    try{
+        job->recognized = engine->recognize(engine->recognitionGray, job->mask, job->useRoi ? &job->roi : NULL);
+    }
+    catch( cv::Exception& e )
+    {
+        const char* err_msg = e.what();
+        printf("Exception in recognition: %s \n", err_msg );
+        job->recognized = false;
+    }
+    __sync_synchronize();
+    job->done = 1;
+    return NULL;
+}
+
+void RecognitionEngine::startRecognition(IplImage* mask, const CvRect* roi, bool reacquiring)
+{
+    //the worker only reads the index, merges and builds happen here
+    prepareIndex();
+
+    //the worker gets its own copy of the frame, the camera overwrites iplGray
+    cvCopy(this->iplGray, recognitionGray);
+
+    //corners to carry the result into later frames, where the template may be found;
+    //the mask stays as it is until the worker is done
+    IplImage* _searched = mask;
+    if(_searched == NULL && roi != NULL)
+    {
+        cvSet(recognitionMask, cvScalar(0));
+        cvSetImageROI(recognitionMask, *roi);
+        cvSet(recognitionMask, cvScalar(1));
+        cvResetImageROI(recognitionMask);
+        _searched = recognitionMask;
+    }
+    numberOfPropagationPoints = maxPropagationPoints;
+    cvGoodFeaturesToTrack(this->iplGray, this->tempImageForTracking, this->secondTempImageForTracking,
+                          propagationPoints[1], &numberOfPropagationPoints, 0.01, 1.5 * this->win_size, _searched);
+    for(int i = 0; i < numberOfPropagationPoints; i++)
+    {
+        propagationStart[i] = propagationPoints[1][i];
+        propagationAlive[i] = 1;
+    }
+
+    RecognitionJob* job = new RecognitionJob;
+    job->engine = this;
+    job->mask = mask;
+    job->roi = roi ? *roi : cvRect(0, 0, imgWidth, imgHeight);
+    job->useRoi = roi != NULL;
+    job->reacquiring = reacquiring;
+    job->recognized = false;
+    job->frames = 0;
+    job->done = 0;
+    recognitionStats.clear();
+
+    if(pthread_create(&job->thread, NULL, runRecognition, job) != 0)
+    {
+        //recognize here instead
+        printf("Can't start recognition thread \n");
+        delete job;
+        bool _recognized = recognize(this->iplGray, mask, roi);
+        frameStats.addRecognition(recognitionStats);
+        endRecognition(_recognized, reacquiring);
+        return;
+    }
+    pendingRecognition = job;
+}
+
+void RecognitionEngine::trackPropagationPoints(int lkFlags)
+{
+    pendingRecognition->frames++;
+    if(numberOfPropagationPoints == 0)
+        return;
+
+    double _t0 = currentTimeMs();
+    cvCalcOpticalFlowPyrLK(  prev_grey,  iplGray,  prev_pyramid,  pyramid,
+                             propagationPoints[0],  propagationPoints[1],  numberOfPropagationPoints,
+                             cvSize( win_size, win_size), lkLevels,  &propagationStatus[0], 0,
+                             cvTermCriteria(CV_TERMCRIT_ITER|CV_TERMCRIT_EPS,lkIterations,0.03),  lkFlags );
+    frameStats.lkMs += currentTimeMs() - _t0;
+    for(int i = 0; i < numberOfPropagationPoints; i++)
+        if(propagationStatus[i] == 0)
+            propagationAlive[i] = 0;
+}
+
+bool RecognitionEngine::propagateRecognition()
+{
+    //the points that started inside the recognized template, or all of them when too few
+    //did, e.g. for a template with little texture under a moving camera
+    CvRect _found = targetBounds(this->matchedTemplate, this->homography);
+    for(int pass = 0; pass < 2; pass++)
+    {
+        propagationFrom.clear();
+        propagationTo.clear();
+        for(int i = 0; i < numberOfPropagationPoints; i++)
+        {
+            if(!propagationAlive[i])
+                continue;
+            const CvPoint2D32f& _p = propagationStart[i];
+            if(pass == 0 && (_p.x < _found.x || _p.x >= _found.x + _found.width ||
+                             _p.y < _found.y || _p.y >= _found.y + _found.height))
+                continue;
+            propagationFrom.push_back(_p);
+            propagationTo.push_back(propagationPoints[1][i]);
+        }
+        if((int)propagationFrom.size() >= minPropagationPoints)
+            break;
+    }
+    if((int)propagationFrom.size() < minPropagationPoints)
+    {
+        printf("Recognition not propagated: %d points left \n", (int)propagationFrom.size());
+        return false;
+    }
+
+    //snapshot to current frame, applied after the template to snapshot homography
+    float _motion[9];
+    if(!trackingEstimator.estimate(&propagationFrom[0], &propagationTo[0], propagationFrom.size(),
+                                   trackingRansacThreshold, _motion))
+        return false;
+    CvMat _m = cvMat(3, 3, CV_32F, _motion);
+    float _h[9];
+    CvMat _found_h = cvMat(3, 3, CV_32F, homography);
+    CvMat _current = cvMat(3, 3, CV_32F, _h);
+    cvMatMul(&_m, &_found_h, &_current);
+    for(int i = 0; i < 9; i++)
+        homography[i] = _h[i] / _h[8];
     return true;
 }
 
+void RecognitionEngine::cancelRecognition()
+{
+    if(pendingRecognition == NULL)
+        return;
+    pthread_join(pendingRecognition->thread, NULL);
+    delete pendingRecognition;
+    pendingRecognition = NULL;
+}
+
 void RecognitionEngine::saveCurrentImage(const char* fileName)
 {
     cvSaveImage(fileName, iplGray);
@@ -643,11 +2056,25 @@ void RecognitionEngine::saveCurrentImage(const char* fileName)
 
 void RecognitionEngine::reset()
 {
+    cancelRecognition();
+    finishIndexMerge(true, true);
+    releaseRecentIndex();
+    indexedTemplates = 0;
     if(flann_index != NULL)
     {
         delete flann_index;
         flann_index = NULL;
     }
+    if(lsh_index != NULL)
+    {
+        delete lsh_index;
+        lsh_index = NULL;
+    }
+    if(vocabularyTree != NULL)
+    {
+        delete vocabularyTree;
+        vocabularyTree = NULL;
+    }
     if(m_object != NULL)
     {
         delete m_object;
@@ -655,6 +2082,19 @@ void RecognitionEngine::reset()
     }
 
     this->templateFeatures.clear();
+    templateDb->close();
+    templateRowOffsets.clear();
+    templateVotes.clear();
+
+    //the tracked templates are gone
+    for(int k = 0; k < maxTargets; k++)
+    {
+        targets[k].active = false;
+        targets[k].clearLost();
+    }
+    reacquisitionRegions.clear();
+    reacquisitionFailures = 0;
+    flags = 0;
 
 }
 
@@ -675,3 +2115,74 @@ void RecognitionEngine::buildDatabase(const std::vector<std::string>& dbFiles)
 
 }
 
+//file name without the directory
+static std::string baseName(const std::string& path)
+{
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+bool RecognitionEngine::loadTemplateDatabase(const std::string& fileName, const std::vector<std::string>& xmlFiles)
+{
+    //the mapped templates replace the current ones
+    reset();
+
+    int t_on = clock();
+    if(!templateDb->open(fileName, this->templateFeatures))
+        return false;
+    int t_off = clock();
+    printf("time to map %d templates: %f \n", templateDb->templateCount(),
+           (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC);
+
+    //enrolment writes <image>.xml, so a file whose image is packed is a copy of a database entry
+    std::set<std::string> _packed;
+    for(unsigned int i = 0; i < this->templateFeatures.size(); i++)
+        _packed.insert(baseName(this->templateFeatures[i].imageName));
+    int _skipped = 0;
+    for(unsigned int i = 0; i < xmlFiles.size(); i++)
+    {
+        std::string _image = baseName(xmlFiles[i]);
+        if(_image.size() > 4 && _image.compare(_image.size() - 4, 4, ".xml") == 0)
+            _image.erase(_image.size() - 4);
+        if(_packed.count(_image))
+            _skipped++;
+        else
+            loadSurfFeatures(xmlFiles[i].c_str());
+    }
+    if(_skipped > 0)
+        printf("skipped %d xml files already packed in %s \n", _skipped, fileName.c_str());
+    int _enrolled = this->templateFeatures.size() - templateDb->templateCount();
+    if(_enrolled > 0)
+        printf("loaded %d templates enrolled after %s was packed \n", _enrolled, fileName.c_str());
+
+    t_on = clock();
+    createFlannIndex();
+    t_off = clock();
+    printf("time to create flann index: %f \n", (static_cast<float>(t_off - t_on))/CLOCKS_PER_SEC);
+
+    return true;
+}
+
+void RecognitionEngine::setFeatureExtractor(int descriptorType)
+{
+    cancelRecognition();
+    FeatureExtractor* extractor = FeatureExtractor::create(descriptorType);
+    if(extractor == NULL)
+        return;
+    printf("using %s features \n", extractor->name());
+    extractor->setThreads(extractorThreads);
+    delete featureExtractor;
+    featureExtractor = extractor;
+}
+
+void RecognitionEngine::setExtractorThreads(int threads)
+{
+    cancelRecognition();
+    extractorThreads = threads;
+    featureExtractor->setThreads(threads);
+}
+
+bool RecognitionEngine::saveTemplateDatabase(const std::string& fileName)
+{
+    return TemplateDatabase::write(this->templateFeatures, fileName);
+}
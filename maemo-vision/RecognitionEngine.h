@@ -6,7 +6,16 @@
 #include <opencv/highgui.h>
 #include <vector>
 #include <list>
+#include <stdint.h>
 
+#include "FeatureExtractor.h"
+#include "HomographyEstimator.h"
+
+class TemplateDatabase;
+class LshIndex;
+class VocabularyTree;
+struct IndexMerge;
+struct RecognitionJob;
 
 class SurfFeatures
 {
@@ -17,6 +26,7 @@ public:
     {
         keypoints = 0;
         descriptors = 0;
+        descriptorType = DESCRIPTOR_SURF;
 
         featuresStorage = cvCreateMemStorage(0);
     }
@@ -30,6 +40,7 @@ public:
     std::string imageName;
     CvSeq *keypoints;
     CvSeq *descriptors;
+    int descriptorType; //DescriptorType of the extractor that made the descriptors
     int width;
     int height;
 
@@ -42,7 +53,140 @@ public:
     std::vector<CvPoint2D32f> pathPointsInTemplate;
 } ;
 
+//Per-frame timings (milliseconds) and events, refreshed by every call to surfTrack().
+//Stages that did not run in a frame are left at 0.
+struct RecognitionStats
+{
+    RecognitionStats()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        totalMs = 0;
+        surfMs = 0;
+        flannMs = 0;
+        ransacMs = 0;
+        cornersMs = 0;
+        lkMs = 0;
+        lkCheckMs = 0;
+        trackHomographyMs = 0;
+
+        imageKeypoints = 0;
+        indexCandidates = 0;
+        matchedPairs = 0;
+        verifiedCandidates = 0;
+        ransacIterations = 0;
+        matchAllocations = 0;
+        trackedPoints = 0;
+        lostPoints = 0;
+        replenishedPoints = 0;
+        rejectedPoints = 0;
+        predictedPoints = 0;
+        predictionResidual = 0;
+        recognitionLatency = 0;
+        liveTargets = 0;
+
+        bruteForceMatching = false;
+        recognitionRun = false;
+        roiRecognition = false;
+        recognized = false;
+        trackingLost = false;
+        tracking = false;
+    }
+
+    //take over the figures of a recognition pass, which may have run on the worker
+    //while other frames were tracked; whether it ran and found something is up to the caller
+    void addRecognition(const RecognitionStats& pass)
+    {
+        surfMs += pass.surfMs;
+        flannMs += pass.flannMs;
+        ransacMs += pass.ransacMs;
+        imageKeypoints = pass.imageKeypoints;
+        indexCandidates = pass.indexCandidates;
+        matchedPairs = pass.matchedPairs;
+        verifiedCandidates += pass.verifiedCandidates;
+        ransacIterations += pass.ransacIterations;
+        matchAllocations += pass.matchAllocations;
+        bruteForceMatching = bruteForceMatching || pass.bruteForceMatching;
+    }
+
+    double totalMs;
+    double surfMs;            //feature extraction on the frame
+    double flannMs;           //nearest neighbour search against the database
+    double ransacMs;          //homography estimation of the matched template
+    double cornersMs;         //good features to track after a recognition
+    double lkMs;              //pyramidal Lucas-Kanade
+    double lkCheckMs;         //error gating and the backward LK pass
+    double trackHomographyMs; //homography from the tracked points
+
+    int imageKeypoints;
+    long indexCandidates; //descriptor distances computed by the LSH index
+    int matchedPairs;   //pairs passing the ratio test
+    int verifiedCandidates; //templates whose homography was estimated
+    int ransacIterations;   //samples drawn while verifying them
+    long matchAllocations; //heap allocations while matching and voting, needs RecognitionEngine::allocationCounter
+    int trackedPoints;
+    int lostPoints;
+    int replenishedPoints; //new corners given to tracked targets in place of lost points
+    int rejectedPoints;    //points LK tracked that failed the error or forward-backward check
+    int predictedPoints;        //points LK started from a motion prediction
+    double predictionResidual;  //summed distance in pixels from their prediction to where LK found them
+    int recognitionLatency;     //frames from the snapshot to the result of a recognition on the worker
+
+    int liveTargets;    //targets being tracked after this frame
+
+    bool bruteForceMatching; //the frame was matched by exhaustive search instead of FLANN
+    bool recognitionRun; //recognition was attempted in this frame
+    bool roiRecognition; //recognition only looked where lost targets were last seen
+    bool recognized;     //a template was found in this frame
+    bool trackingLost;   //tracking was dropped in this frame
+    bool tracking;       //a template is being tracked after this frame
+};
+
+//Keypoint budget of camera frames and what the last recognitions found, see
+//RecognitionEngine::keypointBudget()
+struct KeypointBudget
+{
+    int minKeypoints;
+    int maxKeypoints;
+    double threshold;       //detector threshold for the next frame
+    int lastKeypoints;      //keypoints of the last full frame
+    float averageKeypoints; //over all full frames
+    int frames;             //full frames seen
+    int framesUnder;        //of which below the budget
+    int framesOver;         //and above it
+};
+
+//One tracked target: a recognized template followed by pyramidal Lucas-Kanade.
+//The point and status arrays are allocated by RecognitionEngine for
+//maxNumberOfTrackedPoints points.
+struct TrackedTarget
+{
+    bool active;
+    int templateIndex;
+    float homography[9]; //template to image plane
+    float previousHomography[9]; //of the frame before, valid with hasMotion
+    bool hasMotion;
+
+    //points in the previous [0] and current [1] frame, and where they are on the template
+    CvPoint2D32f* points[2];
+    std::vector<CvPoint2D32f> templatePoints;
+    int numberOfTrackedPoints;
 
+    //LK status of the last frame, and the points lost since the target was recognized
+    //or their slot was last replenished, one bit per point
+    char* status;
+    std::vector<bool> lost;
+    int lostCount;
+
+    void clearLost()
+    {
+        lost.assign(lost.size(), false);
+        lostCount = 0;
+    }
+};
 
 class RecognitionEngine {
 
@@ -54,12 +198,76 @@ public:
     int matchedTemplate;
 
     SurfFeatures imageFeatures;
-    CvSURFParams trainingParams;
-    CvSURFParams recognitionParams;
+
+    //detector and descriptor for templates and frames, SURF by default. createFlannIndex()
+    //switches it to the descriptor type of the loaded templates.
+    FeatureExtractor* featureExtractor;
+    //all templates must have the same type, reset() before switching a loaded database
+    void setFeatureExtractor(int descriptorType);
+    //cores used by extractors that can run in parallel, 1 by default
+    void setExtractorThreads(int threads);
+    int extractorThreads;
+
+    //With adaptiveThreshold, the detector threshold follows the scene so whole frame
+    //recognitions extract between minFrameKeypoints and maxFrameKeypoints keypoints:
+    //enough for minNumberOfMatchesThr in dull scenes, and a bounded matching cost in
+    //textured ones. Masked and region of interest recognitions are not counted.
+    bool adaptiveThreshold;
+    int minFrameKeypoints;
+    int maxFrameKeypoints;
+    KeypointBudget keypointBudget() const;
 
     //FLANN
     cv::flann::Index* flann_index;
     cv::Mat* m_object;
+    const static int flannKdTrees = 2;
+
+    //if set, the built index is saved to this file and reloaded by createFlannIndex()
+    //as long as the template set is unchanged; a vocabulary tree goes to the same name
+    //with ".vocab" appended
+    std::string indexCacheFile;
+
+    //Templates enrolled after the last full build are searched in a small secondary
+    //index over m_recent. Database rows are numbered m_object first, then m_recent,
+    //in template order. Once m_recent holds mergeRatio times the rows of m_object,
+    //a merged primary index is built on a background thread and swapped in when done.
+    //With a vocabulary tree the rows are merged the same way, without any KD-tree.
+    cv::flann::Index* recent_index;
+    cv::Mat* m_recent;
+    int indexedTemplates; //templates covered by flann_index
+    float mergeRatio;
+
+    //how the database is searched; in MATCHER_AUTO catalogues of vocabularyMinTemplates
+    //templates or more go through the vocabulary tree and get no flat index, smaller
+    //databases of up to bruteForceMaxDescriptors descriptors are scanned exhaustively
+    //(see BruteForceMatcher). MATCHER_FLANN selects the approximate index, the LSH index
+    //for binary descriptors. Both explicit modes search the flat database, never the tree.
+    enum {MATCHER_AUTO = 0, MATCHER_FLANN, MATCHER_BRUTE_FORCE};
+    int matcherMode;
+    int bruteForceMaxDescriptors;
+
+    //multi-probe LSH over binary descriptors, built by createFlannIndex() in place of the
+    //KD-tree and cached in indexCacheFile like it. lshKeyBits 0 sizes the keys by the
+    //database; lshProbeLevel is the number of key bits flipped when probing (0 to 2).
+    LshIndex* lsh_index;
+    int lshTables;
+    int lshKeyBits;
+    int lshProbeLevel;
+
+    //Two stage recognition for large catalogues: in MATCHER_AUTO, from vocabularyMinTemplates
+    //templates on, a vocabulary tree shortlists the shortlistSize templates whose visual words
+    //best fit the frame, and the frame is matched against each of them alone instead of against
+    //the whole database. The tree is built from at most vocabularyTrainingRows descriptors and
+    //cached next to indexCacheFile.
+    VocabularyTree* vocabularyTree;
+    int vocabularyBranching;
+    int vocabularyDepth;
+    int vocabularyTrainingRows;
+    int vocabularyMinTemplates;
+    int shortlistSize;
+
+    //packed template file, when the templates were loaded from one
+    TemplateDatabase* templateDb;
 
     //Tracking
     int win_size;
@@ -75,13 +283,32 @@ public:
     IplImage *tempImageForTracking;
     IplImage *secondTempImageForTracking;
 
-    //points for tracking
-    CvPoint2D32f* points[2];
+    //Targets tracked at the same time, in a fixed pool. All of them are followed by LK
+    //on the same image pyramids every frame. While some are tracked and the pool is not
+    //full, recognition runs every recognitionInterval frames on the image outside the
+    //live targets, so new posters are picked up without recognizing the tracked ones.
+    const static int maxTargets = 4;
+    TrackedTarget targets[maxTargets];
+    int recognitionInterval;
+    int liveTargets() const;
+    IplImage *recognitionMask;
+
+    //After a target is lost, recognition first extracts features only around its last
+    //bounding box, grown by reacquisitionMargin of its size on every side, and goes back
+    //to the full frame after maxReacquisitionAttempts frames without finding it.
+    float reacquisitionMargin;
+    int maxReacquisitionAttempts;
+
     CvPoint2D32f* swap_points;
 
-    //tracking status
-    char* status;
+    //LK flags for the next frame, CV_LKFLOW_PYR_A_READY when prev_pyramid holds prev_grey
+    //with prevPyramidLevels levels
     int flags;
+    int prevPyramidLevels;
+
+    //LK pyramid levels and iterations of the frame being tracked
+    int lkLevels;
+    int lkIterations;
 
     unsigned int numberMatches;
 
@@ -91,22 +318,70 @@ public:
     //from all matched features, pick maxNumberOfTrackedPoints random indices for tracking
     unsigned int maxNumberOfTrackedPoints;
     int minNumberOfMatchesThr;
-    int numberOfTrackedPoints;
-
+    //the verificationCandidates templates with most matches are verified in order of
+    //matches; the first homography with minInliers inliers and at least minInlierRatio
+    //of its template's matches as inliers is accepted
+    int verificationCandidates;
+    int minInliers;
+    float minInlierRatio;
+
+    //PROSAC homography estimation, reprojection errors in pixels below which a pair
+    //is an inlier when recognizing and when tracking; recognition and tracking each
+    //have their own estimator as they may run on different threads
+    HomographyEstimator homographyEstimator;
+    HomographyEstimator trackingEstimator;
+    float ransacThreshold;
+    float trackingRansacThreshold;
+
+    //once more than maxLostPointsRatio of a target's points are lost they are replaced by
+    //new corners inside it, or without replenishPoints the target is dropped; losing more
+    //than maxFrameLostPointsRatio in a single frame always drops it, and so does a tracking
+    //homography with fewer inliers than minInliers and minInlierRatio ask of a recognition
     float maxLostPointsRatio;
-    std::vector<CvPoint2D32f> templatePointsForTracking;
+    float maxFrameLostPointsRatio;
+    bool replenishPoints;
+    std::vector<uchar> trackingInliers;
+    std::vector<CvPoint2D32f> replenishCorners;
+    std::vector<CvPoint2D32f> replenishTemplatePoints;
+
+    //tracked points are predicted from the motion between the last two homographies of
+    //their target, a constant velocity model, and LK starts from the prediction; when
+    //every target has a prediction LK needs fewer levels and iterations
+    bool motionPrediction;
+    int pyramidLevels;
+    int maxIterations;
+    int predictedPyramidLevels;
+    int predictedMaxIterations;
+    std::vector<CvPoint2D32f> predictedPoints;
+
+    //points tracked with an LK error above maxTrackingErrorRatio times the median of
+    //the target's points, or that land further than maxForwardBackwardError pixels from
+    //where they started when tracked back to the previous frame, count as lost;
+    //0 turns either check off
+    float maxTrackingErrorRatio;
+    float maxForwardBackwardError;
+    std::vector<float> trackErrors;
+    std::vector<float> sortedTrackErrors;
+    std::vector<int> checkedIndices;
+    std::vector<CvPoint2D32f> checkedPoints;
+    std::vector<CvPoint2D32f> backTrackedPoints;
+    std::vector<char> backStatus;
     std::vector<CvPoint2D32f> imagePointsForTracking;
     std::list<int> randomIndices;
 
     //////////////////////
     std::vector<CvPoint2D32f> templatePointsInImagePlane;
+    std::vector<CvPoint2D32f> templateKeypointPositions;
     /////////////////////
     void createFlannIndex( );
+    //index the templates added since the last build without rebuilding the primary index
+    void appendToFlannIndex( );
 
     void flannFindPairs( const CvSeq* imageDescriptors, std::vector<int>& ptpairs );
 
     bool locatePlanarObject( float homography[]);
 
+    //maps every keypoint of the template into templatePointsInImagePlane, resizing it
     void computeObjectPointsInImagePlane(const SurfFeatures& templateFeatures, float* h);
 
     void reset();
@@ -117,9 +392,23 @@ public:
     void createSurfFeaturesFromImage(SurfFeatures& surfFeatures, const std::string& imageFileName);
     void createSurfFeaturesFromImage(SurfFeatures& surfFeatures, IplImage* image, const std::string& imageFileName);
 
-    bool surfRecognize();
+    //recognize a template in iplGray, in the nonzero pixels of mask and inside roi if given;
+    //the result is left in matchedTemplate and homography
+    bool surfRecognize(IplImage* mask = 0, const CvRect* roi = 0);
     bool surfTrack();
 
+    //With asyncRecognition, surfTrack() runs recognition on a worker thread over a copy
+    //of the frame and goes on tracking live targets in the meantime. Corners found in
+    //the copy are followed by LK until the worker is done, and the homography between
+    //where they were and where they are carries the recognized template into the
+    //current frame; at least minPropagationPoints must survive. Calls that change the
+    //templates or the extractor wait for a running recognition and discard it.
+    bool asyncRecognition;
+    int maxPropagationPoints;
+    int minPropagationPoints;
+    //wait for a running recognition and throw its result away
+    void cancelRecognition();
+
     void transform(const float h[], const CvPoint2D32f& src, CvPoint2D32f& dst ) const;
     float homography[9];
 
@@ -130,11 +419,131 @@ public:
 
     void buildDatabase(const std::vector<std::string>& dbFiles);
 
-private:
+    //load all templates from a packed database file (see TemplateDatabase) and build the index;
+    //those of xmlFiles whose image the database does not hold are loaded as well
+    bool loadTemplateDatabase(const std::string& fileName,
+                              const std::vector<std::string>& xmlFiles = std::vector<std::string>());
+    //write the current templates into a packed database file
+    bool saveTemplateDatabase(const std::string& fileName);
 
+    RecognitionStats frameStats;
+    //figures of the last recognition pass, added to frameStats in the frame its result is used
+    RecognitionStats recognitionStats;
+    //optional source of a running heap allocation count, installed by profiling tools
+    long (*allocationCounter)();
+
+private:
 
-    bool templateFound;
-    std::list<int> lostIndices;
+    //recognition or tracking step for the current frame, wrapped by surfTrack() for timing
+    bool trackFrame();
+
+    //surfRecognize() on any image, the worker passes its copy of the frame
+    bool recognize(IplImage* image, IplImage* mask, const CvRect* roi);
+    //build the mask and region of the next recognition around live and lost targets
+    IplImage* recognitionRegion(CvRect& roi, bool& useRoi);
+    //start tracking what the last recognition found unless a live target covers it,
+    //and keep count of searches near lost targets
+    void endRecognition(bool recognized, bool reacquiring);
+
+    //recognition on the worker thread
+    RecognitionJob* pendingRecognition;
+    IplImage* recognitionGray;
+    CvPoint2D32f* propagationPoints[2];
+    std::vector<CvPoint2D32f> propagationStart;
+    std::vector<char> propagationStatus;
+    std::vector<char> propagationAlive;
+    std::vector<CvPoint2D32f> propagationFrom;
+    std::vector<CvPoint2D32f> propagationTo;
+    int numberOfPropagationPoints;
+    void startRecognition(IplImage* mask, const CvRect* roi, bool reacquiring);
+    static void* runRecognition(void* arg);
+    //follow the propagation points into iplGray
+    void trackPropagationPoints(int lkFlags);
+    //move the homography found in the snapshot into the current frame
+    bool propagateRecognition();
+
+    //keypoint counts of whole frames, and the threshold step towards the budget
+    void updateDetectorThreshold(int keypoints);
+    int budgetFrames;
+    int budgetFramesUnder;
+    int budgetFramesOver;
+    int lastFrameKeypoints;
+    long totalFrameKeypoints;
+
+    //follow one target into iplGray; false when it is lost
+    bool trackTarget(TrackedTarget& target, int lkFlags);
+    //start tracking the last recognized template in a free target
+    void startTarget(TrackedTarget& target);
+    //fill the lost and unused point slots of target with corners inside its outline
+    void replenishTarget(TrackedTarget& target);
+    //clear the status of target's points that fail the tracking error and forward-backward checks
+    void checkTrackedPoints(TrackedTarget& target);
+    //bounding box of a template seen through homography h, clipped to the image
+    CvRect targetBounds(int templateIndex, const float h[]) const;
+    int framesSinceRecognition;
+
+    //where lost targets were last seen, searched first by recognition
+    std::vector<CvRect> reacquisitionRegions;
+    int reacquisitionFailures;
+    //copies of the searched part of the frame and mask, the extractors see a small image
+    IplImage *roiImage;
+    IplImage *roiMask;
+    IplImage* copyRegion(IplImage* src, const CvRect& region, IplImage*& buffer);
+
+    //FLANN index cache
+    const static int flannIndexCacheVersion = 1;
+    uint64_t indexFingerprint;
+    uint64_t computeIndexFingerprint(unsigned int templateCount) const;
+    bool loadFlannIndexCache();
+    void saveFlannIndexCache();
+
+    //incremental indexing
+    IndexMerge* pendingMerge;
+    void copyTemplateDescriptors(unsigned int first, unsigned int last, uchar* dst) const;
+    void buildRecentIndex();
+    void releaseRecentIndex();
+    void startIndexMerge();
+    //swap in a finished merge; with wait, block until it finishes; with discard, throw it away
+    void finishIndexMerge(bool wait, bool discard);
+    //before recognize(): swap in a finished merge and build a missing index, which the
+    //recognition worker must not do itself
+    void prepareIndex();
+
+    //database row -> template lookup: template i owns rows [templateRowOffsets[i], templateRowOffsets[i+1])
+    std::vector<int> templateRowOffsets;
+    void updateTemplateRowOffsets();
+    int templateOfRow(int row) const;
+    //descriptors of template i, in m_object or m_recent
+    const uchar* templateRows(int i) const;
+
+    //vocabulary tree over the templates, extended as templates are enrolled
+    bool useVocabularyTree() const;
+    void updateVocabularyTree();
+    uint64_t vocabularyTreeKey() const;
+    void saveVocabularyTreeCache();
+    std::vector<int> shortlist;
+    //ratio test pairs of the frame against every shortlisted template, with global rows
+    void matchShortlist(std::vector<int>& ptpairs);
+
+    //per-frame voting buffers, kept between frames to avoid reallocation
+    std::vector<int> templateVotes; //all zero between frames
+    std::vector<int> votedTemplates;
+    std::vector<int> candidateVotes;
+    std::vector<uchar> inlierMask;
+    std::vector<float> matchRatios; //ratio test distance ratio of every pair
+    std::vector<int> verificationOrder;
+    bool verifyCandidate(const std::vector<int>& ptpairs, int numberOfMatches, float homography[]);
+    std::vector<int> matchOwners;
+
+    //per-frame matching buffers, grown on demand and reused
+    const static int queryStorageBlockSize = 1 << 20;
+    std::vector<int> matchPairs;
+    cv::Mat m_queryBuffer;
+    cv::Mat m_indicesBuffer;
+    cv::Mat m_distsBuffer;
+    cv::Mat m_recentIndicesBuffer;
+    cv::Mat m_recentDistsBuffer;
+    cv::Mat queryDescriptorMatrix(const CvSeq* imageDescriptors);
 
     float averageRecognitionTime;
     long recognitionCount;
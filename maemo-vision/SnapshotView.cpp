@@ -3,6 +3,7 @@
 #include "CameraThread.h"
 #include "RecognitionEngine.h"
 #include "AppState.h"
+#include "FrameConvert.h"
 
 #include <QtGui>
 
@@ -64,7 +65,7 @@ void SnapshotView::processSnapshotFrame(FCam::Frame frame)
     if(runOK)
     {
         //update drawing
-        appState->updateDrawing();
+        appState->updateRecognitionDrawing();
     }
     imageWidget->repaint();
 
@@ -74,6 +75,8 @@ void SnapshotView::processSnapshotFrame(FCam::Frame frame)
 bool SnapshotView::demosaic(FCam::Frame frame) {
     if (!frame.valid() || !frame.image().valid())
         return false;
+    //the viewfinder only keeps half resolution intensity, take the full one from the frame
+    FrameConvert::uyvyToLuma(frame.image()(0, 0), frame.image().bytesPerRow(), appState->recEngine->large_iplGray);
     QImage demosaicQImage((const unsigned char*) appState->recEngine->large_iplGray->imageData, 640, 480, QImage::Format_Indexed8);
     QImage copy_image = demosaicQImage.convertToFormat(QImage::Format_RGB888);
     imageWidget->setImage(copy_image);
@@ -89,10 +92,9 @@ void ImageViewer::paintEvent(QPaintEvent * event) {
     {
         QPen penFrame(Qt::yellow, 10, Qt::SolidLine, Qt::RoundCap, Qt::RoundJoin);
         painter.setPen(penFrame);
-        for (int j = 0; j < 3; ++j) {
-              painter.drawLine(appState->imageBoundary[j], appState->imageBoundary[j+1]);
+        for (int k = 0; k < appState->imageBoundaries.size(); ++k) {
+              painter.drawPolygon(appState->imageBoundaries[k]);
           }
-        painter.drawLine(appState->imageBoundary[3], appState->imageBoundary[0]);
     }
     painter.end();
 
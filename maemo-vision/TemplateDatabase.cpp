@@ -0,0 +1,284 @@
+#include "TemplateDatabase.h"
+#include "RecognitionEngine.h"
+#include "FeatureExtractor.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+const char* TemplateDatabase::defaultFileName = "templates.db";
+
+static const char templateDatabaseMagic[8] = {'M', 'V', 'T', 'M', 'P', 'L', 'D', 'B'};
+
+static uint64_t alignTo16(uint64_t offset)
+{
+    return (offset + 15) & ~(uint64_t)15;
+}
+
+//pad the file with zeros up to offset
+static bool padTo(FILE* file, uint64_t offset)
+{
+    static const char zeros[16] = {0};
+    long position = ftell(file);
+    if(position < 0 || (uint64_t)position > offset)
+        return false;
+    size_t count = (size_t)(offset - position);
+    return fwrite(zeros, 1, count, file) == count;
+}
+
+TemplateDatabase::TemplateDatabase()
+{
+    mapping = NULL;
+    mappingSize = 0;
+    descriptorData = NULL;
+    length = 0;
+    type = DESCRIPTOR_SURF;
+    total = 0;
+}
+
+TemplateDatabase::~TemplateDatabase()
+{
+    close();
+}
+
+bool TemplateDatabase::write(const std::vector<SurfFeatures>& templates, const std::string& fileName)
+{
+    //all descriptors must have the same type and length
+    int _type = templates.empty() ? DESCRIPTOR_SURF : templates[0].descriptorType;
+    int _elemSize = CV_ELEM_SIZE(FeatureExtractor::matrixType(_type));
+    int _length = 0;
+    uint32_t _total = 0;
+    for(unsigned int i = 0; i < templates.size(); i++)
+    {
+        const CvSeq* descriptors = templates[i].descriptors;
+        const CvSeq* keypoints = templates[i].keypoints;
+        if(descriptors == NULL || keypoints == NULL)
+            continue;
+        if(keypoints->total != descriptors->total ||
+           keypoints->elem_size != (int)sizeof(CvSURFPoint))
+        {
+            printf("Template %s has inconsistent features \n", templates[i].imageName.c_str());
+            return false;
+        }
+        if(templates[i].descriptorType != _type)
+        {
+            printf("Template %s has %s descriptors, expected %s \n", templates[i].imageName.c_str(),
+                   FeatureExtractor::typeName(templates[i].descriptorType), FeatureExtractor::typeName(_type));
+            return false;
+        }
+        int _templLength = descriptors->elem_size / _elemSize;
+        if(_length != 0 && _templLength != _length)
+        {
+            printf("Template %s has descriptors of length %d, expected %d \n",
+                   templates[i].imageName.c_str(), _templLength, _length);
+            return false;
+        }
+        _length = _templLength;
+        _total += descriptors->total;
+    }
+
+    TemplateDatabaseHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, templateDatabaseMagic, sizeof(header.magic));
+    header.version = currentVersion;
+    header.byteOrder = byteOrderMark;
+    header.templateCount = templates.size();
+    header.descriptorLength = _length;
+    header.keypointSize = sizeof(CvSURFPoint);
+    header.totalKeypoints = _total;
+    header.descriptorType = _type;
+
+    std::vector<TemplateDatabaseEntry> table(templates.size());
+    uint32_t _nameOffset = 0;
+    uint32_t _firstKeypoint = 0;
+    for(unsigned int i = 0; i < templates.size(); i++)
+    {
+        table[i].nameOffset = _nameOffset;
+        table[i].nameLength = templates[i].imageName.size();
+        table[i].width = templates[i].width;
+        table[i].height = templates[i].height;
+        table[i].firstKeypoint = _firstKeypoint;
+        bool _hasFeatures = templates[i].descriptors != NULL && templates[i].keypoints != NULL;
+        table[i].keypointCount = _hasFeatures ? templates[i].descriptors->total : 0;
+        _nameOffset += table[i].nameLength;
+        _firstKeypoint += table[i].keypointCount;
+    }
+
+    header.tableOffset = alignTo16(sizeof(header));
+    header.namesOffset = alignTo16(header.tableOffset + table.size() * sizeof(TemplateDatabaseEntry));
+    header.keypointsOffset = alignTo16(header.namesOffset + _nameOffset);
+    header.descriptorsOffset = alignTo16(header.keypointsOffset + (uint64_t)_total * sizeof(CvSURFPoint));
+    header.fileSize = header.descriptorsOffset + (uint64_t)_total * _length * _elemSize;
+
+    FILE* file = fopen(fileName.c_str(), "wb");
+    if(!file)
+    {
+        printf("Can't write %s \n", fileName.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    ok = ok && padTo(file, header.tableOffset);
+    if(ok && !table.empty())
+        ok = fwrite(&table[0], sizeof(TemplateDatabaseEntry), table.size(), file) == table.size();
+
+    ok = ok && padTo(file, header.namesOffset);
+    for(unsigned int i = 0; ok && i < templates.size(); i++)
+    {
+        const std::string& name = templates[i].imageName;
+        ok = fwrite(name.data(), 1, name.size(), file) == name.size();
+    }
+
+    std::vector<char> buffer;
+    ok = ok && padTo(file, header.keypointsOffset);
+    for(unsigned int i = 0; ok && i < templates.size(); i++)
+    {
+        const CvSeq* keypoints = templates[i].keypoints;
+        if(keypoints == NULL || templates[i].descriptors == NULL || keypoints->total == 0)
+            continue;
+        buffer.resize(keypoints->total * keypoints->elem_size);
+        cvCvtSeqToArray(keypoints, &buffer[0]);
+        ok = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+    }
+
+    ok = ok && padTo(file, header.descriptorsOffset);
+    for(unsigned int i = 0; ok && i < templates.size(); i++)
+    {
+        const CvSeq* descriptors = templates[i].descriptors;
+        if(descriptors == NULL || templates[i].keypoints == NULL || descriptors->total == 0)
+            continue;
+        buffer.resize(descriptors->total * descriptors->elem_size);
+        cvCvtSeqToArray(descriptors, &buffer[0]);
+        ok = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+    }
+
+    if(fclose(file) != 0)
+        ok = false;
+    if(!ok)
+    {
+        printf("Error writing %s \n", fileName.c_str());
+        unlink(fileName.c_str());
+    }
+    return ok;
+}
+
+bool TemplateDatabase::open(const std::string& fileName, std::vector<SurfFeatures>& templates)
+{
+    close();
+
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if(fd < 0)
+    {
+        printf("Can't open %s \n", fileName.c_str());
+        return false;
+    }
+    struct stat _info;
+    if(fstat(fd, &_info) != 0 || (size_t)_info.st_size < sizeof(TemplateDatabaseHeader))
+    {
+        printf("Not a template database: %s \n", fileName.c_str());
+        ::close(fd);
+        return false;
+    }
+
+    mappingSize = _info.st_size;
+    mapping = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    //the mapping keeps the file referenced
+    ::close(fd);
+    if(mapping == MAP_FAILED)
+    {
+        printf("Can't map %s \n", fileName.c_str());
+        mapping = NULL;
+        mappingSize = 0;
+        return false;
+    }
+
+    const char* base = (const char*)mapping;
+    const TemplateDatabaseHeader* header = (const TemplateDatabaseHeader*)base;
+    int _elemSize = CV_ELEM_SIZE(FeatureExtractor::matrixType(header->descriptorType));
+    uint64_t keypointsEnd = header->keypointsOffset + (uint64_t)header->totalKeypoints * sizeof(CvSURFPoint);
+    uint64_t descriptorsEnd = header->descriptorsOffset +
+                              (uint64_t)header->totalKeypoints * header->descriptorLength * _elemSize;
+    if(memcmp(header->magic, templateDatabaseMagic, sizeof(header->magic)) != 0 ||
+       header->version != currentVersion ||
+       header->byteOrder != byteOrderMark ||
+       (header->descriptorType != DESCRIPTOR_SURF && header->descriptorType != DESCRIPTOR_BRIEF) ||
+       header->keypointSize != sizeof(CvSURFPoint) ||
+       header->fileSize != mappingSize ||
+       header->tableOffset + (uint64_t)header->templateCount * sizeof(TemplateDatabaseEntry) > mappingSize ||
+       keypointsEnd > mappingSize || descriptorsEnd > mappingSize ||
+       header->descriptorsOffset % 16 != 0)
+    {
+        printf("Incompatible template database: %s \n", fileName.c_str());
+        close();
+        return false;
+    }
+
+    const TemplateDatabaseEntry* table = (const TemplateDatabaseEntry*)(base + header->tableOffset);
+    CvSURFPoint* keypoints = (CvSURFPoint*)(base + header->keypointsOffset);
+    char* descriptors = (char*)(base + header->descriptorsOffset);
+    int _descriptorSize = header->descriptorLength * _elemSize;
+
+    length = header->descriptorLength;
+    type = header->descriptorType;
+    total = header->totalKeypoints;
+    descriptorData = descriptors;
+
+    //the headers are referenced by address, so size the vectors once
+    keypointHeaders.resize(header->templateCount);
+    keypointBlocks.resize(header->templateCount);
+    descriptorHeaders.resize(header->templateCount);
+    descriptorBlocks.resize(header->templateCount);
+
+    for(uint32_t i = 0; i < header->templateCount; i++)
+    {
+        if((uint64_t)table[i].firstKeypoint + table[i].keypointCount > header->totalKeypoints ||
+           header->namesOffset + table[i].nameOffset + table[i].nameLength > mappingSize)
+        {
+            printf("Corrupt template table in %s \n", fileName.c_str());
+            close();
+            return false;
+        }
+    }
+
+    templates.reserve(templates.size() + header->templateCount);
+    for(uint32_t i = 0; i < header->templateCount; i++)
+    {
+        const TemplateDatabaseEntry& entry = table[i];
+        SurfFeatures _templFeatures;
+        _templFeatures.imageName.assign(base + header->namesOffset + entry.nameOffset, entry.nameLength);
+        _templFeatures.width = entry.width;
+        _templFeatures.height = entry.height;
+        _templFeatures.descriptorType = type;
+        _templFeatures.keypoints = cvMakeSeqHeaderForArray(0, sizeof(CvSeq), sizeof(CvSURFPoint),
+                                                           keypoints + entry.firstKeypoint, entry.keypointCount,
+                                                           &keypointHeaders[i], &keypointBlocks[i]);
+        _templFeatures.descriptors = cvMakeSeqHeaderForArray(0, sizeof(CvSeq), _descriptorSize,
+                                                             descriptors + (size_t)entry.firstKeypoint * _descriptorSize,
+                                                             entry.keypointCount,
+                                                             &descriptorHeaders[i], &descriptorBlocks[i]);
+        templates.push_back(_templFeatures);
+    }
+
+    return true;
+}
+
+void TemplateDatabase::close()
+{
+    if(mapping != NULL)
+        munmap(mapping, mappingSize);
+    mapping = NULL;
+    mappingSize = 0;
+    descriptorData = NULL;
+    length = 0;
+    type = DESCRIPTOR_SURF;
+    total = 0;
+    keypointHeaders.clear();
+    keypointBlocks.clear();
+    descriptorHeaders.clear();
+    descriptorBlocks.clear();
+}
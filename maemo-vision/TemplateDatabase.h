@@ -0,0 +1,102 @@
+#ifndef TEMPLATE_DATABASE_H
+#define TEMPLATE_DATABASE_H
+
+#include <opencv/cv.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class SurfFeatures;
+
+/* A packed, memory mapped file holding the features of a whole set of
+ * templates. It replaces reading one XML file per template: opening
+ * it costs an mmap, and the keypoints and descriptors are used in
+ * place through CvSeq headers pointing into the mapping.
+ *
+ * Layout (native byte order, every section 16 byte aligned):
+ *   header
+ *   template table, one TemplateDatabaseEntry per template
+ *   template names, not null terminated
+ *   keypoint array, CvSURFPoint, all templates back to back
+ *   descriptor matrix, totalKeypoints x descriptorLength elements,
+ *   floats or bytes depending on descriptorType
+ */
+struct TemplateDatabaseHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;        //byteOrderMark as written, to reject foreign files
+    uint32_t templateCount;
+    uint32_t descriptorLength; //elements per descriptor: 64 or 128 floats, 32 bytes for binary descriptors
+    uint32_t keypointSize;     //sizeof(CvSURFPoint) of the writer
+    uint32_t totalKeypoints;
+    uint32_t descriptorType;   //DescriptorType, see FeatureExtractor.h
+    uint32_t reserved;
+    uint64_t tableOffset;
+    uint64_t namesOffset;
+    uint64_t keypointsOffset;
+    uint64_t descriptorsOffset;
+    uint64_t fileSize;
+};
+
+struct TemplateDatabaseEntry
+{
+    uint32_t nameOffset; //relative to namesOffset
+    uint32_t nameLength;
+    int32_t width;
+    int32_t height;
+    uint32_t firstKeypoint;
+    uint32_t keypointCount;
+};
+
+class TemplateDatabase {
+
+public:
+    TemplateDatabase();
+    ~TemplateDatabase();
+
+    // Pack the keypoints and descriptors of the templates into a database file
+    static bool write(const std::vector<SurfFeatures>& templates, const std::string& fileName);
+
+    // Map a database file and append its templates to the vector. The
+    // CvSeqs of the appended templates point into the mapping and stay
+    // valid until close() or destruction.
+    bool open(const std::string& fileName, std::vector<SurfFeatures>& templates);
+    void close();
+
+    bool isOpen() const {return mapping != NULL;}
+
+    // The descriptors of all templates as one row-major matrix
+    const void* descriptors() const {return descriptorData;}
+    int descriptorLength() const {return length;}
+    int descriptorType() const {return type;}
+    int totalKeypoints() const {return total;}
+    int templateCount() const {return (int)keypointHeaders.size();}
+
+    // File looked for in a template directory
+    static const char* defaultFileName;
+
+private:
+    const static uint32_t currentVersion = 2;
+    const static uint32_t byteOrderMark = 0x01020304;
+
+    void* mapping;
+    size_t mappingSize;
+
+    const void* descriptorData;
+    int length;
+    int type;
+    int total;
+
+    // Sequence headers handed out through SurfFeatures
+    std::vector<CvSeq> keypointHeaders;
+    std::vector<CvSeqBlock> keypointBlocks;
+    std::vector<CvSeq> descriptorHeaders;
+    std::vector<CvSeqBlock> descriptorBlocks;
+
+    TemplateDatabase(const TemplateDatabase&);
+    TemplateDatabase& operator=(const TemplateDatabase&);
+};
+
+#endif
@@ -163,15 +163,25 @@ Viewfinder::~Viewfinder()
 
 
 void Viewfinder::processFrame() {
-    if(!isProcessingFrames)
+    //the newest camera frame, the ones that came while the last was processed are dropped
+    MailboxFrame* frame = appState->frameMailbox.takeLatest();
+    if(frame == NULL)
         return;
 
+    appState->recEngineMutex.lock();
+    if(appState->recEngine->templateFeatures.size() > 0) //if have templates
+        cvCopy(frame->luma, appState->recEngine->iplGray);
+    if(!isProcessingFrames || appState->recEngine->templateFeatures.size() == 0)
+    {
+        appState->recEngineMutex.unlock();
+        return;
+    }
+
     ///////////////////
     // Do the real work
     ///////////////////
     time_t t0 = clock();
 
-    appState->recEngineMutex.lock();
     bool runOK = appState->recEngine->surfTrack();
     appState->recEngineMutex.unlock();
 
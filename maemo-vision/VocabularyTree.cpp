@@ -0,0 +1,477 @@
+#include "VocabularyTree.h"
+#include "BruteForceMatcher.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static const char vocabularyTreeMagic[8] = {'M', 'V', 'V', 'O', 'C', 'A', 'B', 'T'};
+
+struct VocabularyTreeHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t branching;
+    uint32_t depth;
+    uint32_t type;
+    uint32_t cols;
+    uint32_t words;
+    uint32_t templates;
+    uint32_t nodes;
+    uint64_t key;
+};
+
+//fixed generator, so the same templates always give the same vocabulary
+static uint32_t nextRandom(uint32_t& seed)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return seed >> 8;
+}
+
+VocabularyTree::VocabularyTree(int branching, int depth)
+{
+    this->branching = std::max(2, branching);
+    this->depth = std::max(1, depth);
+    type = CV_32F;
+    cols = 0;
+    elemBytes = 0;
+    words = 0;
+    templates = 0;
+}
+
+float VocabularyTree::distance(const uchar* a, const uchar* b) const
+{
+    if(type == CV_8U)
+        return (float)BruteForceMatcher::hammingDistance(a, b, cols);
+    return BruteForceMatcher::distance((const float*)a, (const float*)b, cols);
+}
+
+int VocabularyTree::quantize(const uchar* descriptor) const
+{
+    int node = 0;
+    while(nodes[node].childCount > 0)
+    {
+        int first = nodes[node].firstChild;
+        int best = first;
+        float bestDistance = FLT_MAX;
+        for(int c = first; c < first + nodes[node].childCount; c++)
+        {
+            float d = distance(descriptor, &centers[(size_t)c * elemBytes]);
+            if(d < bestDistance)
+            {
+                bestDistance = d;
+                best = c;
+            }
+        }
+        node = best;
+    }
+    return nodes[node].word;
+}
+
+void VocabularyTree::computeCenter(const std::vector<const uchar*>& members, uchar* center) const
+{
+    int n = members.size();
+    if(type == CV_8U)
+    {
+        //bitwise majority
+        std::vector<int> ones(cols * 8, 0);
+        for(int i = 0; i < n; i++)
+            for(int b = 0; b < cols * 8; b++)
+                ones[b] += (members[i][b >> 3] >> (b & 7)) & 1;
+        memset(center, 0, cols);
+        for(int b = 0; b < cols * 8; b++)
+            if(2 * ones[b] > n)
+                center[b >> 3] |= (uchar)(1 << (b & 7));
+    }
+    else
+    {
+        std::vector<double> sum(cols, 0.0);
+        for(int i = 0; i < n; i++)
+        {
+            const float* d = (const float*)members[i];
+            for(int j = 0; j < cols; j++)
+                sum[j] += d[j];
+        }
+        float* c = (float*)center;
+        for(int j = 0; j < cols; j++)
+            c[j] = (float)(sum[j] / n);
+    }
+}
+
+//split the members of a node into branching clusters and recurse, down to depth levels
+void VocabularyTree::cluster(int node, std::vector<const uchar*>& members, int level, uint32_t& seed)
+{
+    int n = members.size();
+    if(level == depth || n <= branching)
+    {
+        nodes[node].word = words++;
+        return;
+    }
+
+    int k = branching;
+    std::vector<uchar> c((size_t)k * elemBytes);
+
+    //k-means++ seeding: every further center is drawn with probability growing with its distance
+    std::vector<float> nearest(n, FLT_MAX);
+    memcpy(&c[0], members[nextRandom(seed) % n], elemBytes);
+    for(int j = 1; j < k; j++)
+    {
+        double total = 0;
+        for(int i = 0; i < n; i++)
+        {
+            nearest[i] = std::min(nearest[i], distance(members[i], &c[(size_t)(j - 1) * elemBytes]));
+            total += nearest[i];
+        }
+        double r = total * (nextRandom(seed) / 16777216.0);
+        int pick = n - 1;
+        for(int i = 0; i < n; i++)
+        {
+            r -= nearest[i];
+            if(r <= 0)
+            {
+                pick = i;
+                break;
+            }
+        }
+        memcpy(&c[(size_t)j * elemBytes], members[pick], elemBytes);
+    }
+
+    //Lloyd iterations
+    std::vector<int> assignment(n, -1);
+    std::vector<const uchar*> clusterMembers;
+    for(int iteration = 0; iteration < maxIterations; iteration++)
+    {
+        int changed = 0;
+        for(int i = 0; i < n; i++)
+        {
+            int best = 0;
+            float bestDistance = FLT_MAX;
+            for(int j = 0; j < k; j++)
+            {
+                float d = distance(members[i], &c[(size_t)j * elemBytes]);
+                if(d < bestDistance)
+                {
+                    bestDistance = d;
+                    best = j;
+                }
+            }
+            if(assignment[i] != best)
+            {
+                assignment[i] = best;
+                changed++;
+            }
+        }
+        if(changed == 0)
+            break;
+
+        //empty clusters keep their center
+        for(int j = 0; j < k; j++)
+        {
+            clusterMembers.clear();
+            for(int i = 0; i < n; i++)
+                if(assignment[i] == j)
+                    clusterMembers.push_back(members[i]);
+            if(!clusterMembers.empty())
+                computeCenter(clusterMembers, &c[(size_t)j * elemBytes]);
+        }
+    }
+
+    int first = nodes.size();
+    nodes[node].firstChild = first;
+    nodes[node].childCount = k;
+    Node child = {-1, 0, -1};
+    nodes.resize(first + k, child);
+    centers.insert(centers.end(), c.begin(), c.end());
+
+    for(int j = 0; j < k; j++)
+    {
+        clusterMembers.clear();
+        for(int i = 0; i < n; i++)
+            if(assignment[i] == j)
+                clusterMembers.push_back(members[i]);
+        cluster(first + j, clusterMembers, level + 1, seed);
+    }
+}
+
+void VocabularyTree::build(const std::vector<const uchar*>& rows, const std::vector<int>& counts,
+                           int type, int cols, int maxTrainingRows)
+{
+    this->type = type;
+    this->cols = cols;
+    elemBytes = cols * CV_ELEM_SIZE(type);
+    words = 0;
+    templates = 0;
+
+    //training sample spread evenly over all descriptors
+    long total = 0;
+    for(unsigned int i = 0; i < counts.size(); i++)
+        total += counts[i];
+    long stride = std::max(1L, (total + maxTrainingRows - 1) / std::max(1, maxTrainingRows));
+    std::vector<const uchar*> sample;
+    long position = 0;
+    for(unsigned int i = 0; i < counts.size(); i++)
+    {
+        for(int j = 0; j < counts[i]; j++, position++)
+            if(position % stride == 0)
+                sample.push_back(rows[i] + (size_t)j * elemBytes);
+    }
+
+    Node root = {-1, 0, -1};
+    nodes.assign(1, root);
+    centers.assign(elemBytes, 0);
+    uint32_t seed = 0x5BD1E995;
+    cluster(0, sample, 0, seed);
+
+    //document frequency of every word over the templates
+    std::vector<int> rowWords(total);
+    std::vector<int> documents(words, 0);
+    wordCounts.assign(words, 0);
+    position = 0;
+    for(unsigned int i = 0; i < counts.size(); i++)
+    {
+        countedWords.clear();
+        for(int j = 0; j < counts[i]; j++, position++)
+        {
+            int w = quantize(rows[i] + (size_t)j * elemBytes);
+            rowWords[position] = w;
+            if(wordCounts[w]++ == 0)
+                countedWords.push_back(w);
+        }
+        for(unsigned int j = 0; j < countedWords.size(); j++)
+        {
+            documents[countedWords[j]]++;
+            wordCounts[countedWords[j]] = 0;
+        }
+    }
+
+    //words in every template carry no information; words no template has weigh the most
+    int templateTotal = std::max(1, (int)counts.size());
+    idf.resize(words);
+    for(int w = 0; w < words; w++)
+        idf[w] = (float)log((double)templateTotal / std::max(1, documents[w]));
+
+    postings.assign(words, std::vector<Posting>());
+    position = 0;
+    for(unsigned int i = 0; i < counts.size(); i++)
+    {
+        indexWords(counts[i] ? &rowWords[position] : NULL, counts[i]);
+        position += counts[i];
+    }
+}
+
+void VocabularyTree::indexWords(const int* rowWords, int count)
+{
+    int t = templates++;
+    scores.resize(templates, 0);
+
+    countedWords.clear();
+    for(int i = 0; i < count; i++)
+        if(wordCounts[rowWords[i]]++ == 0)
+            countedWords.push_back(rowWords[i]);
+
+    float total = 0;
+    for(unsigned int j = 0; j < countedWords.size(); j++)
+        total += wordCounts[countedWords[j]] * idf[countedWords[j]];
+
+    for(unsigned int j = 0; j < countedWords.size(); j++)
+    {
+        int w = countedWords[j];
+        if(total > 0 && idf[w] > 0)
+        {
+            Posting p = {t, wordCounts[w] * idf[w] / total};
+            postings[w].push_back(p);
+        }
+        wordCounts[w] = 0;
+    }
+}
+
+void VocabularyTree::addTemplate(const uchar* rows, int count)
+{
+    templateWords.resize(count);
+    for(int i = 0; i < count; i++)
+        templateWords[i] = quantize(rows + (size_t)i * elemBytes);
+    indexWords(count ? &templateWords[0] : NULL, count);
+}
+
+//higher score first, lower template index on ties
+struct ScoreOrder
+{
+    const float* scores;
+    bool operator()(int a, int b) const
+    {
+        return scores[a] > scores[b] || (scores[a] == scores[b] && a < b);
+    }
+};
+
+void VocabularyTree::shortlist(const cv::Mat& queries, int count, std::vector<int>& ranked)
+{
+    ranked.clear();
+    if(templates == 0 || words == 0 || queries.rows == 0)
+        return;
+
+    countedWords.clear();
+    for(int q = 0; q < queries.rows; q++)
+    {
+        int w = quantize(queries.ptr(q));
+        if(wordCounts[w]++ == 0)
+            countedWords.push_back(w);
+    }
+
+    float total = 0;
+    for(unsigned int j = 0; j < countedWords.size(); j++)
+        total += wordCounts[countedWords[j]] * idf[countedWords[j]];
+
+    //accumulate the similarity through the inverted file, only templates sharing words are touched
+    scoredTemplates.clear();
+    for(unsigned int j = 0; j < countedWords.size(); j++)
+    {
+        int w = countedWords[j];
+        float qw = total > 0 ? wordCounts[w] * idf[w] / total : 0;
+        wordCounts[w] = 0;
+        if(qw <= 0)
+            continue;
+        const std::vector<Posting>& list = postings[w];
+        for(unsigned int p = 0; p < list.size(); p++)
+        {
+            int t = list[p].templ;
+            if(scores[t] == 0)
+                scoredTemplates.push_back(t);
+            scores[t] += std::min(qw, list[p].weight);
+        }
+    }
+
+    int n = std::min(count, (int)scoredTemplates.size());
+    ScoreOrder order = {&scores[0]};
+    std::partial_sort(scoredTemplates.begin(), scoredTemplates.begin() + n, scoredTemplates.end(), order);
+    ranked.assign(scoredTemplates.begin(), scoredTemplates.begin() + n);
+
+    for(unsigned int j = 0; j < scoredTemplates.size(); j++)
+        scores[scoredTemplates[j]] = 0;
+}
+
+bool VocabularyTree::save(const std::string& fileName, uint64_t key) const
+{
+    VocabularyTreeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, vocabularyTreeMagic, sizeof(header.magic));
+    header.version = fileVersion;
+    header.branching = branching;
+    header.depth = depth;
+    header.type = type;
+    header.cols = cols;
+    header.words = words;
+    header.templates = templates;
+    header.nodes = nodes.size();
+    header.key = key;
+
+    FILE* file = fopen(fileName.c_str(), "wb");
+    if(!file)
+    {
+        printf("Can't write %s \n", fileName.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(&nodes[0], sizeof(Node), nodes.size(), file) == nodes.size();
+    ok = ok && fwrite(&centers[0], 1, centers.size(), file) == centers.size();
+    if(ok && words > 0)
+        ok = fwrite(&idf[0], sizeof(float), words, file) == (size_t)words;
+
+    //the inverted file as the length of every list, then all lists back to back
+    for(int w = 0; ok && w < words; w++)
+    {
+        uint32_t length = postings[w].size();
+        ok = fwrite(&length, sizeof(length), 1, file) == 1;
+    }
+    for(int w = 0; ok && w < words; w++)
+        if(!postings[w].empty())
+            ok = fwrite(&postings[w][0], sizeof(Posting), postings[w].size(), file) == postings[w].size();
+
+    if(fclose(file) != 0)
+        ok = false;
+    if(!ok)
+        printf("Error writing %s \n", fileName.c_str());
+    return ok;
+}
+
+VocabularyTree* VocabularyTree::load(const std::string& fileName, uint64_t key,
+                                     int branching, int depth, int type, int cols)
+{
+    FILE* file = fopen(fileName.c_str(), "rb");
+    if(!file)
+        return NULL;
+
+    VocabularyTreeHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 ||
+       memcmp(header.magic, vocabularyTreeMagic, sizeof(header.magic)) != 0 ||
+       header.version != fileVersion || header.key != key)
+    {
+        printf("vocabulary tree cache %s is out of date \n", fileName.c_str());
+        fclose(file);
+        return NULL;
+    }
+
+    VocabularyTree* tree = new VocabularyTree(branching, depth);
+    if(header.branching != (uint32_t)tree->branching || header.depth != (uint32_t)tree->depth ||
+       header.type != (uint32_t)type || header.cols != (uint32_t)cols ||
+       header.nodes < 1 || header.nodes > 1u << 24 || header.words > header.nodes || header.templates > 1u << 24)
+    {
+        printf("Incompatible vocabulary tree: %s \n", fileName.c_str());
+        fclose(file);
+        delete tree;
+        return NULL;
+    }
+
+    tree->type = type;
+    tree->cols = cols;
+    tree->elemBytes = cols * CV_ELEM_SIZE(type);
+    tree->words = header.words;
+    tree->templates = header.templates;
+    tree->nodes.resize(header.nodes);
+    tree->centers.resize((size_t)header.nodes * tree->elemBytes);
+    tree->idf.resize(header.words);
+    tree->postings.assign(header.words, std::vector<Posting>());
+
+    bool ok = fread(&tree->nodes[0], sizeof(Node), header.nodes, file) == header.nodes;
+    ok = ok && fread(&tree->centers[0], 1, tree->centers.size(), file) == tree->centers.size();
+    if(ok && header.words > 0)
+        ok = fread(&tree->idf[0], sizeof(float), header.words, file) == header.words;
+    std::vector<uint32_t> lengths(header.words);
+    if(ok && header.words > 0)
+        ok = fread(&lengths[0], sizeof(uint32_t), header.words, file) == header.words;
+    for(uint32_t w = 0; ok && w < header.words; w++)
+    {
+        ok = lengths[w] <= header.templates;
+        if(ok && lengths[w] > 0)
+        {
+            tree->postings[w].resize(lengths[w]);
+            ok = fread(&tree->postings[w][0], sizeof(Posting), lengths[w], file) == lengths[w];
+        }
+    }
+    fclose(file);
+
+    //reject anything that would index out of range
+    for(uint32_t i = 0; ok && i < header.nodes; i++)
+    {
+        const Node& node = tree->nodes[i];
+        if(node.childCount > 0)
+            ok = node.firstChild > (int)i && node.childCount <= tree->branching &&
+                 (uint32_t)(node.firstChild + node.childCount) <= header.nodes;
+        else
+            ok = node.childCount == 0 && node.word >= 0 && (uint32_t)node.word < header.words;
+    }
+    for(uint32_t w = 0; ok && w < header.words; w++)
+        for(uint32_t p = 0; ok && p < lengths[w]; p++)
+            ok = tree->postings[w][p].templ >= 0 && (uint32_t)tree->postings[w][p].templ < header.templates;
+    if(!ok)
+    {
+        printf("Corrupt vocabulary tree: %s \n", fileName.c_str());
+        delete tree;
+        return NULL;
+    }
+
+    tree->wordCounts.assign(header.words, 0);
+    tree->scores.assign(header.templates, 0);
+    return tree;
+}
@@ -0,0 +1,96 @@
+#ifndef VOCABULARY_TREE_H
+#define VOCABULARY_TREE_H
+
+#include <opencv/cv.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Hierarchical k-means vocabulary tree with an inverted file, used to
+ * shortlist the templates a frame most likely shows before any
+ * descriptor is matched (Nister and Stewenius, "Scalable Recognition
+ * with a Vocabulary Tree").
+ *
+ * Descriptors are quantized to visual words by descending the tree to
+ * the nearest center at every level. Templates and frames become TF-IDF
+ * weighted word histograms, normalized to unit L1 norm; templates are
+ * ranked by the sum over shared words of the smaller weight, which
+ * orders them like the L1 distance between the histograms.
+ *
+ * Float descriptors are clustered with L2 distance and mean centers,
+ * binary ones with Hamming distance and bitwise majority centers.
+ */
+class VocabularyTree {
+
+public:
+    VocabularyTree(int branching, int depth);
+
+    // Cluster a sample of at most maxTrainingRows of the template descriptors
+    // and index all templates. Template i has counts[i] descriptors at rows[i],
+    // each of cols elements of the matrix type (CV_32F or CV_8U).
+    void build(const std::vector<const uchar*>& rows, const std::vector<int>& counts,
+               int type, int cols, int maxTrainingRows);
+
+    // Index one more template, weighted with the document frequencies of the build
+    void addTemplate(const uchar* rows, int count);
+
+    // Up to count templates ranked by similarity to the query descriptors, best first
+    void shortlist(const cv::Mat& queries, int count, std::vector<int>& ranked);
+
+    // Store the centers, word weights and inverted file under the caller's key;
+    // load() restores them if the key and the tree shape match, NULL otherwise
+    bool save(const std::string& fileName, uint64_t key) const;
+    static VocabularyTree* load(const std::string& fileName, uint64_t key,
+                                int branching, int depth, int type, int cols);
+
+    int templateCount() const {return templates;}
+    int wordCount() const {return words;}
+    int matrixType() const {return type;}
+    int descriptorLength() const {return cols;}
+
+private:
+    const static int maxIterations = 10;
+    const static uint32_t fileVersion = 1;
+
+    struct Node
+    {
+        int firstChild;
+        int childCount;
+        int word; //leaves only, -1 for inner nodes
+    };
+
+    struct Posting
+    {
+        int templ;
+        float weight;
+    };
+
+    int branching;
+    int depth;
+    int type;
+    int cols;
+    int elemBytes;
+    int words;
+    int templates;
+
+    std::vector<Node> nodes;
+    std::vector<uchar> centers; //one descriptor per node, the root's unused
+    std::vector<float> idf;
+    std::vector< std::vector<Posting> > postings;
+
+    //buffers reused between calls
+    std::vector<int> wordCounts;   //all zero between calls
+    std::vector<int> countedWords;
+    std::vector<float> scores;     //all zero between calls
+    std::vector<int> scoredTemplates;
+    std::vector<int> templateWords;
+
+    float distance(const uchar* a, const uchar* b) const;
+    int quantize(const uchar* descriptor) const;
+    void cluster(int node, std::vector<const uchar*>& members, int level, uint32_t& seed);
+    void computeCenter(const std::vector<const uchar*>& members, uchar* center) const;
+    void indexWords(const int* rowWords, int count);
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "WorkerPool.h"
+
+#include <cstdio>
+
+WorkerPool::WorkerPool(int threadCount)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&jobReady, NULL);
+    pthread_cond_init(&jobDone, NULL);
+    task = NULL;
+    context = NULL;
+    taskCount = 0;
+    nextTask = 0;
+    unfinishedTasks = 0;
+    job = 0;
+    stopping = false;
+
+    for(int i = 0; i < threadCount; i++)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, workerMain, this) != 0)
+        {
+            printf("Can't start worker thread %d \n", i);
+            break;
+        }
+        threads.push_back(thread);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&mutex);
+
+    for(unsigned int i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&jobDone);
+    pthread_cond_destroy(&jobReady);
+    pthread_mutex_destroy(&mutex);
+}
+
+void WorkerPool::runTasks()
+{
+    while(nextTask < taskCount)
+    {
+        int i = nextTask++;
+        pthread_mutex_unlock(&mutex);
+        task(context, i);
+        pthread_mutex_lock(&mutex);
+        if(--unfinishedTasks == 0)
+            pthread_cond_broadcast(&jobDone);
+    }
+}
+
+void* WorkerPool::workerMain(void* arg)
+{
+    WorkerPool* pool = (WorkerPool*)arg;
+    unsigned int seenJob = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for(;;)
+    {
+        while(!pool->stopping && pool->job == seenJob)
+            pthread_cond_wait(&pool->jobReady, &pool->mutex);
+        if(pool->stopping)
+            break;
+        seenJob = pool->job;
+        pool->runTasks();
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+void WorkerPool::run(Task newTask, void* newContext, int newTaskCount)
+{
+    if(newTaskCount <= 0)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    task = newTask;
+    context = newContext;
+    taskCount = newTaskCount;
+    nextTask = 0;
+    unfinishedTasks = newTaskCount;
+    job++;
+    pthread_cond_broadcast(&jobReady);
+
+    runTasks();
+    while(unfinishedTasks > 0)
+        pthread_cond_wait(&jobDone, &mutex);
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,49 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+#include <vector>
+
+/* A fixed set of threads that run the tasks of one job at a time. The
+ * calling thread takes tasks as well, so a pool of N threads keeps N + 1
+ * cores busy; with no threads run() simply calls every task in turn.
+ * Tasks must not throw.
+ */
+class WorkerPool {
+
+public:
+    typedef void (*Task)(void* context, int task);
+
+    explicit WorkerPool(int threadCount);
+    ~WorkerPool();
+
+    // Call task(context, i) for i in [0, taskCount) and return when all are done
+    void run(Task task, void* context, int taskCount);
+
+    int threadCount() const {return threads.size();}
+
+private:
+    std::vector<pthread_t> threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t jobReady;
+    pthread_cond_t jobDone;
+
+    //current job, guarded by mutex
+    Task task;
+    void* context;
+    int taskCount;
+    int nextTask;
+    int unfinishedTasks;
+    unsigned int job;
+    bool stopping;
+
+    static void* workerMain(void* arg);
+    //run tasks of the current job until none are left, called with mutex locked
+    void runTasks();
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+};
+
+#endif
@@ -16,7 +16,19 @@ SOURCES += main.cpp\
     PanicHandler.cpp \
     ThumbnailView.cpp \
     SnapshotView.cpp \
-    AppState.cpp
+    AppState.cpp \
+    TemplateDatabase.cpp \
+    BruteForceMatcher.cpp \
+    FeatureExtractor.cpp \
+    LshIndex.cpp \
+    VocabularyTree.cpp \
+    WorkerPool.cpp \
+    HomographyEstimator.cpp \
+    PointTransform.cpp \
+    FrameMailbox.cpp \
+    FrameConvert.cpp \
+    FrameSource.cpp \
+    FCamFrameSource.cpp
 
 HEADERS  += MainWindow.h \
     CameraThread.h \
@@ -33,6 +45,18 @@ HEADERS  += MainWindow.h \
     ThumbnailView.h \
     SnapshotView.h \
     AppState.h \
+    TemplateDatabase.h \
+    BruteForceMatcher.h \
+    FeatureExtractor.h \
+    LshIndex.h \
+    VocabularyTree.h \
+    WorkerPool.h \
+    HomographyEstimator.h \
+    PointTransform.h \
+    FrameMailbox.h \
+    FrameConvert.h \
+    FrameSource.h \
+    FCamFrameSource.h \
     gourd.h
 
 RESOURCES += \
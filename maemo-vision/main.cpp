@@ -10,10 +10,12 @@
 #include "SnapshotView.h"
 
 #include "RecognitionEngine.h"
+#include "FrameSource.h"
 
 #include "AppState.h"
 
 #include <signal.h>
+#include <cstring>
 
 CameraThread *cameraThread;
 
@@ -34,8 +36,23 @@ int main(int argc, char *argv[])
 
     // Make a thread that controls the camera and maintains its state
     cameraThread = new CameraThread();
+
+    // -source <description> takes the viewfinder frames from a recording or a
+    // generator instead of the sensor, see FrameSource::create()
+    FrameSource* frameSource = NULL;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-source") == 0) {
+            frameSource = FrameSource::create(argv[i + 1]);
+            if (!frameSource)
+                return 1;
+            cameraThread->setFrameSource(frameSource);
+        }
+    }
+
     // The computer vision code is here:
     RecognitionEngine recEngine;
+    // recognize on a worker thread, the viewfinder keeps tracking at frame rate meanwhile
+    recEngine.asyncRecognition = true;
 
     ////////////////////////////////////
     //Setup widgets ////////////////////
@@ -135,6 +152,7 @@ int main(int argc, char *argv[])
     printf("About to delete camera thread\n");
     delete cameraThread;    
     printf("Camera thread deleted\n");
+    delete frameSource;
 
     return rval;
 }
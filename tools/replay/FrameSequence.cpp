@@ -0,0 +1,240 @@
+#include "FrameSequence.h"
+#include "FrameSource.h"
+#include "FrameConvert.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+static bool hasSuffix(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    if(s.size() < n)
+        return false;
+    std::string tail = s.substr(s.size() - n);
+    for(size_t i = 0; i < n; i++)
+    {
+        if(tolower(tail[i]) != tolower(suffix[i]))
+            return false;
+    }
+    return true;
+}
+
+FrameSequence::FrameSequence()
+{
+    y4mSource = NULL;
+    y4mFrameIndex = 0;
+    pgmIndex = 0;
+    frameWidth = 0;
+    frameHeight = 0;
+}
+
+FrameSequence::~FrameSequence()
+{
+    close();
+}
+
+void FrameSequence::close()
+{
+    if(y4mSource)
+    {
+        delete y4mSource;
+        y4mSource = NULL;
+    }
+    pgmFiles.clear();
+    pgmIndex = 0;
+    frameWidth = 0;
+    frameHeight = 0;
+}
+
+bool FrameSequence::open(const std::string& path)
+{
+    close();
+
+    struct stat _info;
+    if(stat(path.c_str(), &_info) != 0)
+    {
+        printf("Can't open %s \n", path.c_str());
+        return false;
+    }
+
+    if(S_ISDIR(_info.st_mode))
+    {
+        DIR* dir = opendir(path.c_str());
+        if(!dir)
+        {
+            printf("Can't open directory %s \n", path.c_str());
+            return false;
+        }
+        struct dirent* entry;
+        while((entry = readdir(dir)) != NULL)
+        {
+            std::string name = entry->d_name;
+            if(hasSuffix(name, ".pgm"))
+                pgmFiles.push_back(path + "/" + name);
+        }
+        closedir(dir);
+        std::sort(pgmFiles.begin(), pgmFiles.end());
+    }
+    else if(hasSuffix(path, ".y4m"))
+    {
+        return openY4M(path);
+    }
+    else if(hasSuffix(path, ".pgm"))
+    {
+        pgmFiles.push_back(path);
+    }
+    else
+    {
+        //list of frames, one path per line
+        FILE* list = fopen(path.c_str(), "r");
+        if(!list)
+        {
+            printf("Can't open %s \n", path.c_str());
+            return false;
+        }
+        char line[4096];
+        while(fgets(line, sizeof(line), list))
+        {
+            std::string name = line;
+            while(!name.empty() && (name[name.size() - 1] == '\n' || name[name.size() - 1] == '\r'))
+                name.erase(name.size() - 1);
+            if(!name.empty() && name[0] != '#')
+                pgmFiles.push_back(name);
+        }
+        fclose(list);
+    }
+
+    if(pgmFiles.empty())
+    {
+        printf("No frames found in %s \n", path.c_str());
+        return false;
+    }
+
+    //take the frame size from the first file
+    FILE* first = fopen(pgmFiles[0].c_str(), "rb");
+    int maxValue = 0;
+    if(!first || !readPGMHeader(first, frameWidth, frameHeight, maxValue))
+    {
+        printf("Not a binary PGM file: %s \n", pgmFiles[0].c_str());
+        if(first)
+            fclose(first);
+        pgmFiles.clear();
+        return false;
+    }
+    fclose(first);
+    return true;
+}
+
+//y4m streams are parsed by the app's file source, which delivers UYVY
+bool FrameSequence::openY4M(const std::string& path)
+{
+    y4mSource = new FileFrameSource(path, false, false);
+    if(!y4mSource->start())
+    {
+        close();
+        return false;
+    }
+    frameWidth = y4mSource->frameWidth();
+    frameHeight = y4mSource->frameHeight();
+    y4mFrameIndex = 0;
+    return true;
+}
+
+bool FrameSequence::readFrame(IplImage* luma)
+{
+    if(!luma || luma->width != frameWidth || luma->height != frameHeight)
+    {
+        printf("Frame size %dx%d does not match the target image \n", frameWidth, frameHeight);
+        return false;
+    }
+
+    if(y4mSource)
+        return readY4MFrame(luma);
+
+    if(pgmIndex >= pgmFiles.size())
+        return false;
+
+    currentName = pgmFiles[pgmIndex++];
+    return readPGM(currentName, luma);
+}
+
+bool FrameSequence::readY4MFrame(IplImage* luma)
+{
+    SourceFrame frame;
+    if(!y4mSource->nextFrame(frame))
+        return false;
+    FrameConvert::uyvyToLuma(frame.uyvy, frame.step, luma);
+
+    char name[32];
+    snprintf(name, sizeof(name), "frame %d", y4mFrameIndex++);
+    currentName = name;
+    return true;
+}
+
+bool FrameSequence::readPGMHeader(FILE* file, int& width, int& height, int& maxValue)
+{
+    char magic[3] = {0, 0, 0};
+    if(fread(magic, 1, 2, file) != 2 || magic[0] != 'P' || magic[1] != '5')
+        return false;
+
+    //width, height and maximum value, with '#' comments allowed in between
+    int values[3];
+    for(int i = 0; i < 3; i++)
+    {
+        int c = fgetc(file);
+        while(c != EOF && (isspace(c) || c == '#'))
+        {
+            if(c == '#')
+            {
+                while(c != EOF && c != '\n')
+                    c = fgetc(file);
+            }
+            c = fgetc(file);
+        }
+        if(c == EOF || !isdigit(c))
+            return false;
+        values[i] = 0;
+        while(c != EOF && isdigit(c))
+        {
+            values[i] = 10 * values[i] + (c - '0');
+            c = fgetc(file);
+        }
+    }
+    //the whitespace ending the maximum value has been consumed, pixels follow
+
+    width = values[0];
+    height = values[1];
+    maxValue = values[2];
+    return maxValue > 0 && maxValue < 256;
+}
+
+bool FrameSequence::readPGM(const std::string& path, IplImage* luma)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file)
+    {
+        printf("Can't open %s \n", path.c_str());
+        return false;
+    }
+
+    int width = 0, height = 0, maxValue = 0;
+    bool ok = readPGMHeader(file, width, height, maxValue);
+    if(!ok || width != frameWidth || height != frameHeight)
+    {
+        printf("Skipping %s: expected a %dx%d 8 bit PGM \n", path.c_str(), frameWidth, frameHeight);
+        fclose(file);
+        return false;
+    }
+
+    for(int y = 0; y < height && ok; y++)
+    {
+        ok = fread(luma->imageData + luma->widthStep * y, 1, width, file) == (size_t)width;
+    }
+    fclose(file);
+    return ok;
+}
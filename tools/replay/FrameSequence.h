@@ -0,0 +1,57 @@
+#ifndef FRAME_SEQUENCE_H
+#define FRAME_SEQUENCE_H
+
+#include <opencv/cv.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class FileFrameSource;
+
+/* Reads a recorded sequence of 8 bit luma frames, either from a
+ * single YUV4MPEG2 (.y4m) stream, read through the app's FileFrameSource,
+ * or from binary PGM (P5) files. A sequence can be opened from a .y4m
+ * file, a single .pgm, a directory of .pgm files (read in name order)
+ * or a text file listing one .pgm path per line.
+ */
+class FrameSequence {
+
+public:
+    FrameSequence();
+    ~FrameSequence();
+
+    bool open(const std::string& path);
+    void close();
+
+    // Read the next frame into the 8 bit, single channel image. The
+    // image must have the size of the recorded frames. Returns false
+    // at the end of the sequence or on a read error.
+    bool readFrame(IplImage* luma);
+
+    int width() const {return frameWidth;}
+    int height() const {return frameHeight;}
+
+    // Name of the last frame read, for reports
+    const std::string& frameName() const {return currentName;}
+
+private:
+    bool openY4M(const std::string& path);
+    bool readY4MFrame(IplImage* luma);
+    bool readPGM(const std::string& path, IplImage* luma);
+
+    // Parse the header of a PGM file and leave the stream at the first pixel
+    static bool readPGMHeader(FILE* file, int& width, int& height, int& maxValue);
+
+    FileFrameSource* y4mSource;
+    int y4mFrameIndex;
+
+    std::vector<std::string> pgmFiles;
+    unsigned int pgmIndex;
+
+    int frameWidth;
+    int frameHeight;
+    std::string currentName;
+};
+
+#endif
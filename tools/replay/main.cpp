@@ -0,0 +1,734 @@
+// Offline replay of recorded viewfinder frames through RecognitionEngine::surfTrack(),
+// reporting per-frame and per-stage latency so recognition and tracking can be
+// profiled without an N900 attached.
+
+#include "RecognitionEngine.h"
+#include "FrameSequence.h"
+#include "BruteForceMatcher.h"
+#include "FeatureExtractor.h"
+#include "FrameConvert.h"
+#include "FrameSource.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//Count heap allocations by interposing glibc's malloc family. operator new and
+//cv::fastMalloc both end up here, so the count covers OpenCV and the engine.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static volatile long heapAllocations = 0;
+
+extern "C" void* malloc(size_t size)
+{
+    __sync_fetch_and_add(&heapAllocations, 1);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    __sync_fetch_and_add(&heapAllocations, 1);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    __sync_fetch_and_add(&heapAllocations, 1);
+    return __libc_realloc(ptr, size);
+}
+
+static long allocationCount()
+{
+    return heapAllocations;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s -t <templates> [-t <templates> ...] -f <frames> | -x <frame source> [-n <max frames>] [-o <csv file>]\n"
+           "          [-c <index cache>] [-m auto|flann|brute] [-d surf|brief]\n"
+           "          [-l <tables>,<key bits>,<probe level>] [-v <candidates>,<min inliers>,<min inlier ratio>]\n"
+           "          [-j <threads>] [-s <max threads>] [-k <min keypoints>,<max keypoints>] [-r] [-p] [-a]\n"
+           "          [-b <error ratio>,<forward-backward pixels>]\n"
+           "       %s -y <iterations> [-f <frames>]\n"
+           "  -t  a directory of template .xml files, a single .xml file, a template image\n"
+           "      or a packed template database (.db), which must be the only template source\n"
+           "  -f  a .y4m stream, a .pgm file, a directory of .pgm files or a text file listing .pgm files\n"
+           "      frames must be 640x480, they are reduced to 320x240 as in CameraThread\n"
+           "  -x  UYVY frames from a source as the camera application can take them, 640x480:\n"
+           "      file:<path>[,fast][,loop][,size=<w>x<h>][,fps=<n>] for a .y4m stream or raw UYVY frames,\n"
+           "      synthetic:<image>[,trajectory=<file>][,frames=<n>][,fast] for an image moving in front of\n"
+           "      a background; without fast, frames come at their frame rate\n"
+           "  -n  stop after this many frames\n"
+           "  -o  write the per-frame report to this file instead of stdout\n"
+           "  -c  save the FLANN index (or vocabulary tree) to this file and reuse it while the\n"
+           "      templates are unchanged\n"
+           "  -m  descriptor matcher, by default small databases are searched exhaustively and\n"
+           "      large catalogues through a vocabulary tree; flann and brute never use the tree\n"
+           "  -d  features extracted from template images, template files keep their own\n"
+           "  -l  LSH index parameters for binary descriptors, key bits 0 sizes keys by the database\n"
+           "  -v  templates verified per recognition and the inliers a homography needs to be accepted\n"
+           "  -j  cores used for feature extraction\n"
+           "  -k  keypoint budget of the adaptive detector threshold, 0,0 keeps the threshold fixed\n"
+           "  -r  drop targets that lose too many points instead of replenishing them\n"
+           "  -a  recognize on a worker thread while tracking goes on, as the camera application does\n"
+           "  -p  track without motion prediction, LK always starts from the last positions\n"
+           "  -b  LK error ratio and forward-backward distance above which tracked points are dropped,\n"
+           "      0,0 turns both checks off\n"
+           "  -s  only time feature extraction of the frames with 1 to this many cores, no templates needed\n"
+           "  -y  only time the UYVY to luma conversions of the camera ingest, on the frames if given\n", name, name);
+}
+
+static bool hasSuffix(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && strcasecmp(s.c_str() + s.size() - n, suffix) == 0;
+}
+
+//collect template xml files and add image templates directly to the engine
+static bool addTemplates(RecognitionEngine& engine, const std::string& path, std::vector<std::string>& xmlFiles)
+{
+    struct stat _info;
+    if(stat(path.c_str(), &_info) != 0)
+    {
+        printf("Can't open %s \n", path.c_str());
+        return false;
+    }
+
+    if(S_ISDIR(_info.st_mode))
+    {
+        DIR* dir = opendir(path.c_str());
+        if(!dir)
+            return false;
+        std::vector<std::string> _files;
+        struct dirent* entry;
+        while((entry = readdir(dir)) != NULL)
+        {
+            std::string name = entry->d_name;
+            if(hasSuffix(name, ".xml"))
+                _files.push_back(path + "/" + name);
+        }
+        closedir(dir);
+        std::sort(_files.begin(), _files.end());
+        xmlFiles.insert(xmlFiles.end(), _files.begin(), _files.end());
+    }
+    else if(hasSuffix(path, ".xml"))
+    {
+        xmlFiles.push_back(path);
+    }
+    else
+    {
+        SurfFeatures _templFeatures;
+        engine.createSurfFeaturesFromImage(_templFeatures, path);
+        if(_templFeatures.descriptors == NULL)
+            return false;
+        engine.templateFeatures.push_back(_templFeatures);
+    }
+    return true;
+}
+
+//running sum, count and maximum of one stage
+struct StageSummary
+{
+    StageSummary() : sum(0), max(0), count(0) {}
+
+    void add(double ms)
+    {
+        if(ms <= 0)
+            return;
+        sum += ms;
+        if(ms > max)
+            max = ms;
+        count++;
+    }
+
+    void print(FILE* out, const char* name) const
+    {
+        fprintf(out, "%-18s runs %6d  mean %8.3f ms  max %8.3f ms\n",
+                name, count, count ? sum / count : 0.0, max);
+    }
+
+    double sum;
+    double max;
+    int count;
+};
+
+static double tickMs()
+{
+    return (double)cvGetTickCount() / (cvGetTickFrequency() * 1000.0);
+}
+
+//Extract the features of every frame with 1 to maxThreads cores, reporting the mean
+//time, the speedup over one core and the frames whose keypoint count differs from it
+static int runScalingBenchmark(const std::string& framesPath, long maxFrames, int maxThreads, int descriptorType)
+{
+    FrameSequence frames;
+    if(!frames.open(framesPath))
+        return 1;
+    if(frames.width() != 640 || frames.height() != 480)
+    {
+        printf("Frames are %dx%d, expected 640x480 \n", frames.width(), frames.height());
+        return 1;
+    }
+
+    //decode and reduce all frames first so only extraction is timed
+    IplImage* large = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+    std::vector<IplImage*> images;
+    while(maxFrames < 0 || (long)images.size() < maxFrames)
+    {
+        if(!frames.readFrame(large))
+            break;
+        IplImage* image = cvCreateImage(cvSize(RecognitionEngine::imgWidth, RecognitionEngine::imgHeight), IPL_DEPTH_8U, 1);
+        cvResize(large, image, CV_INTER_AREA);
+        images.push_back(image);
+    }
+    cvReleaseImage(&large);
+
+    FeatureExtractor* extractor = FeatureExtractor::create(descriptorType);
+    CvMemStorage* storage = cvCreateMemStorage(0);
+    std::vector<int> singleThreadCounts;
+    double singleThreadMs = 0;
+
+    printf("%s extraction over %d frames\n", extractor->name(), (int)images.size());
+    printf("threads,mean_ms,speedup,keypoints_per_frame,differing_frames\n");
+    for(int threads = 1; threads <= maxThreads && !images.empty(); threads++)
+    {
+        extractor->setThreads(threads);
+        double totalMs = 0;
+        long keypoints = 0;
+        int differing = 0;
+        for(unsigned int i = 0; i < images.size(); i++)
+        {
+            cvClearMemStorage(storage);
+            CvSeq* frameKeypoints = NULL;
+            CvSeq* frameDescriptors = NULL;
+            double t0 = tickMs();
+            extractor->extract(images[i], NULL, &frameKeypoints, &frameDescriptors, storage, false);
+            totalMs += tickMs() - t0;
+
+            int count = frameKeypoints ? frameKeypoints->total : 0;
+            keypoints += count;
+            if(threads == 1)
+                singleThreadCounts.push_back(count);
+            else if(count != singleThreadCounts[i])
+                differing++;
+        }
+        double meanMs = totalMs / images.size();
+        if(threads == 1)
+            singleThreadMs = meanMs;
+        printf("%d,%.3f,%.2f,%.1f,%d\n", threads, meanMs, meanMs > 0 ? singleThreadMs / meanMs : 0.0,
+               (double)keypoints / images.size(), differing);
+    }
+
+    cvReleaseMemStorage(&storage);
+    delete extractor;
+    for(unsigned int i = 0; i < images.size(); i++)
+        cvReleaseImage(&images[i]);
+    return 0;
+}
+
+//The luma copy CameraThread did before FrameConvert, kept as the benchmark baseline
+static void copyLumaPerPixel(const unsigned char* uyvy, int uyvyStep, IplImage* luma)
+{
+    for (int y = 0; y < 480; ++y) {
+        const unsigned char *row = uyvy + uyvyStep*y;
+        for (int x = 0; x < 640; ++x) {
+            int idx = (x << 1) + 1;
+            ((uchar*)(luma->imageData + luma->widthStep*y))[x] = row[idx];
+        }
+    }
+}
+
+//Time the UYVY to luma copy of the viewfinder ingest, per pixel as before and with
+//the FrameConvert kernel, then the reduction to the engine size, a cubic resize of the
+//copy as before against the fused 2x2 mean. Frames come from the sequence or are made
+//up when none is given.
+static int runIngestBenchmark(const std::string& framesPath, int iterations)
+{
+    const int frameCount = 8;
+    const int uyvyStep = 640 * 2;
+    std::vector<unsigned char> uyvy(frameCount * uyvyStep * 480);
+    IplImage* large = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+
+    FrameSequence frames;
+    if(!framesPath.empty())
+    {
+        if(!frames.open(framesPath))
+            return 1;
+        if(frames.width() != 640 || frames.height() != 480)
+        {
+            printf("Frames are %dx%d, expected 640x480 \n", frames.width(), frames.height());
+            return 1;
+        }
+    }
+    for(int i = 0; i < frameCount; i++)
+    {
+        unsigned char* frame = &uyvy[i * uyvyStep * 480];
+        bool haveFrame = !framesPath.empty() && frames.readFrame(large);
+        for(int y = 0; y < 480; y++)
+        {
+            const unsigned char* row = (const unsigned char*)(large->imageData + large->widthStep*y);
+            for(int x = 0; x < 640; x++)
+            {
+                frame[uyvyStep*y + 2*x] = 128;
+                frame[uyvyStep*y + 2*x + 1] = haveFrame ? row[x] : (unsigned char)((x ^ y) + i * 31 + rand() % 16);
+            }
+        }
+    }
+
+    IplImage* reference = cvCreateImage(cvSize(640, 480), IPL_DEPTH_8U, 1);
+    IplImage* cubic = cvCreateImage(cvSize(RecognitionEngine::imgWidth, RecognitionEngine::imgHeight), IPL_DEPTH_8U, 1);
+    IplImage* half = cvCreateImage(cvGetSize(cubic), IPL_DEPTH_8U, 1);
+    double perPixelMs = 0, kernelMs = 0, cubicMs = 0, halfMs = 0;
+    int mismatches = 0;
+    long difference = 0;
+    for(int n = 0; n < iterations; n++)
+    {
+        const unsigned char* frame = &uyvy[(n % frameCount) * uyvyStep * 480];
+        double t0 = tickMs();
+        copyLumaPerPixel(frame, uyvyStep, reference);
+        double t1 = tickMs();
+        FrameConvert::uyvyToLuma(frame, uyvyStep, large);
+        double t2 = tickMs();
+        perPixelMs += t1 - t0;
+        kernelMs += t2 - t1;
+        for(int y = 0; y < 480; y++)
+            if(memcmp(reference->imageData + reference->widthStep*y, large->imageData + large->widthStep*y, 640) != 0)
+                mismatches++;
+
+        t0 = tickMs();
+        copyLumaPerPixel(frame, uyvyStep, reference);
+        cvResize(reference, cubic, CV_INTER_CUBIC);
+        t1 = tickMs();
+        FrameConvert::uyvyToHalfLuma(frame, uyvyStep, half);
+        t2 = tickMs();
+        cubicMs += t1 - t0;
+        halfMs += t2 - t1;
+        for(int y = 0; y < half->height; y++)
+            for(int x = 0; x < half->width; x++)
+                difference += abs((int)((uchar*)(half->imageData + half->widthStep*y))[x] -
+                                  (int)((uchar*)(cubic->imageData + cubic->widthStep*y))[x]);
+    }
+
+    printf("640x480 UYVY to luma over %d iterations\n", iterations);
+    printf("kernel,mean_ms,speedup,mismatched_rows\n");
+    printf("per-pixel,%.4f,1.00,0\n", perPixelMs / iterations);
+    printf("%s,%.4f,%.2f,%d\n", FrameConvert::kernelName(), kernelMs / iterations,
+           kernelMs > 0 ? perPixelMs / kernelMs : 0.0, mismatches);
+
+    printf("\n640x480 UYVY to %dx%d luma over %d iterations\n", half->width, half->height, iterations);
+    printf("kernel,mean_ms,speedup,mean_difference_to_cubic\n");
+    printf("per-pixel+cubic,%.4f,1.00,0\n", cubicMs / iterations);
+    printf("%s 2x2 mean,%.4f,%.2f,%.2f\n", FrameConvert::kernelName(), halfMs / iterations,
+           halfMs > 0 ? cubicMs / halfMs : 0.0, (double)difference / ((double)iterations * half->width * half->height));
+
+    cvReleaseImage(&half);
+    cvReleaseImage(&cubic);
+    cvReleaseImage(&reference);
+    cvReleaseImage(&large);
+    return mismatches == 0 ? 0 : 1;
+}
+
+static double percentile(std::vector<double> values, double p)
+{
+    if(values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t idx = (size_t)(p * (values.size() - 1) + 0.5);
+    return values[idx];
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> templatePaths;
+    std::string framesPath;
+    std::string sourceDescription;
+    std::string outputPath;
+    std::string indexCachePath;
+    long maxFrames = -1;
+    int matcherMode = RecognitionEngine::MATCHER_AUTO;
+    int descriptorType = DESCRIPTOR_SURF;
+    int lshTables = -1, lshKeyBits = -1, lshProbeLevel = -1;
+    int verificationCandidates = -1, minInliers = -1;
+    float minInlierRatio = -1;
+    int extractorThreads = 1;
+    int benchmarkThreads = 0;
+    int ingestIterations = 0;
+    int minKeypoints = -1, maxKeypoints = -1;
+    bool replenishPoints = true;
+    bool motionPrediction = true;
+    bool asyncRecognition = false;
+    float maxTrackingErrorRatio = -1, maxForwardBackwardError = -1;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(i + 1 < argc && arg == "-t")
+            templatePaths.push_back(argv[++i]);
+        else if(i + 1 < argc && arg == "-f")
+            framesPath = argv[++i];
+        else if(i + 1 < argc && arg == "-x")
+            sourceDescription = argv[++i];
+        else if(i + 1 < argc && arg == "-n")
+            maxFrames = atol(argv[++i]);
+        else if(i + 1 < argc && arg == "-o")
+            outputPath = argv[++i];
+        else if(i + 1 < argc && arg == "-c")
+            indexCachePath = argv[++i];
+        else if(i + 1 < argc && arg == "-m")
+        {
+            std::string mode = argv[++i];
+            if(mode == "flann")
+                matcherMode = RecognitionEngine::MATCHER_FLANN;
+            else if(mode == "brute")
+                matcherMode = RecognitionEngine::MATCHER_BRUTE_FORCE;
+            else if(mode != "auto")
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(i + 1 < argc && arg == "-l")
+        {
+            if(sscanf(argv[++i], "%d,%d,%d", &lshTables, &lshKeyBits, &lshProbeLevel) != 3)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(i + 1 < argc && arg == "-v")
+        {
+            if(sscanf(argv[++i], "%d,%d,%f", &verificationCandidates, &minInliers, &minInlierRatio) != 3)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(i + 1 < argc && arg == "-j")
+            extractorThreads = atoi(argv[++i]);
+        else if(i + 1 < argc && arg == "-k")
+        {
+            if(sscanf(argv[++i], "%d,%d", &minKeypoints, &maxKeypoints) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(i + 1 < argc && arg == "-b")
+        {
+            if(sscanf(argv[++i], "%f,%f", &maxTrackingErrorRatio, &maxForwardBackwardError) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if(arg == "-a")
+            asyncRecognition = true;
+        else if(arg == "-p")
+            motionPrediction = false;
+        else if(arg == "-r")
+            replenishPoints = false;
+        else if(i + 1 < argc && arg == "-s")
+            benchmarkThreads = atoi(argv[++i]);
+        else if(i + 1 < argc && arg == "-y")
+            ingestIterations = atoi(argv[++i]);
+        else if(i + 1 < argc && arg == "-d")
+        {
+            std::string type = argv[++i];
+            if(type == "brief")
+                descriptorType = DESCRIPTOR_BRIEF;
+            else if(type != "surf")
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(ingestIterations > 0)
+        return runIngestBenchmark(framesPath, ingestIterations);
+    if(benchmarkThreads > 0 && !framesPath.empty())
+        return runScalingBenchmark(framesPath, maxFrames, benchmarkThreads, descriptorType);
+    if(templatePaths.empty() || framesPath.empty() == sourceDescription.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    RecognitionEngine engine;
+    engine.indexCacheFile = indexCachePath;
+    engine.allocationCounter = allocationCount;
+    engine.matcherMode = matcherMode;
+    engine.setExtractorThreads(extractorThreads);
+    engine.replenishPoints = replenishPoints;
+    engine.motionPrediction = motionPrediction;
+    engine.asyncRecognition = asyncRecognition;
+    if(maxTrackingErrorRatio >= 0)
+    {
+        engine.maxTrackingErrorRatio = maxTrackingErrorRatio;
+        engine.maxForwardBackwardError = maxForwardBackwardError;
+    }
+    if(maxKeypoints == 0)
+        engine.adaptiveThreshold = false;
+    else if(maxKeypoints > 0)
+    {
+        engine.minFrameKeypoints = minKeypoints;
+        engine.maxFrameKeypoints = maxKeypoints;
+    }
+    engine.setFeatureExtractor(descriptorType);
+    if(lshTables > 0)
+    {
+        engine.lshTables = lshTables;
+        engine.lshKeyBits = lshKeyBits;
+        engine.lshProbeLevel = lshProbeLevel;
+    }
+    if(verificationCandidates > 0)
+    {
+        engine.verificationCandidates = verificationCandidates;
+        engine.minInliers = minInliers;
+        engine.minInlierRatio = minInlierRatio;
+    }
+
+    if(templatePaths.size() == 1 && hasSuffix(templatePaths[0], ".db"))
+    {
+        if(!engine.loadTemplateDatabase(templatePaths[0]))
+            return 1;
+    }
+    else
+    {
+        std::vector<std::string> xmlFiles;
+        for(unsigned int i = 0; i < templatePaths.size(); i++)
+        {
+            if(!addTemplates(engine, templatePaths[i], xmlFiles))
+                return 1;
+        }
+        engine.buildDatabase(xmlFiles);
+    }
+    if(engine.templateFeatures.empty())
+    {
+        printf("No templates loaded \n");
+        return 1;
+    }
+
+    FrameSequence frames;
+    FrameSource* source = NULL;
+    if(!sourceDescription.empty())
+    {
+        source = FrameSource::create(sourceDescription);
+        if(!source || !source->start())
+            return 1;
+    }
+    else if(!frames.open(framesPath))
+        return 1;
+    else if(frames.width() != engine.large_iplGray->width || frames.height() != engine.large_iplGray->height)
+    {
+        printf("Frames are %dx%d, expected %dx%d \n", frames.width(), frames.height(),
+               engine.large_iplGray->width, engine.large_iplGray->height);
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if(!outputPath.empty())
+    {
+        out = fopen(outputPath.c_str(), "w");
+        if(!out)
+        {
+            printf("Can't write %s \n", outputPath.c_str());
+            return 1;
+        }
+    }
+
+    fprintf(out, "frame,total_ms,surf_ms,flann_ms,ransac_ms,corners_ms,lk_ms,track_homography_ms,"
+                 "keypoints,matched_pairs,verified_candidates,tracked_points,lost_points,targets,frame_allocs,match_allocs,event,template\n");
+
+    StageSummary total, surf, flann, ransac, corners, lk, lkCheck, trackHomography;
+    std::vector<double> frameTimes;
+    int recognitionAttempts = 0;
+    int roiRecognitionAttempts = 0;
+    int recognitions = 0;
+    int trackingLosses = 0;
+    int trackedFrames = 0;
+    long totalAllocations = 0;
+    long totalMatchAllocations = 0;
+    int matchedFrames = 0;
+    int bruteForceFrames = 0;
+    long indexCandidates = 0;
+    long verifiedCandidates = 0;
+    long ransacIterations = 0;
+    long replenishedPoints = 0;
+    long rejectedPoints = 0;
+    long predictedPoints = 0;
+    double predictionResidual = 0;
+    long recognitionLatency = 0;
+    int asyncResults = 0;
+    int replenishments = 0;
+
+    long frameIndex = 0;
+    while(maxFrames < 0 || frameIndex < maxFrames)
+    {
+        if(source)
+        {
+            //the same conversion as the camera thread
+            SourceFrame frame;
+            if(!source->nextFrame(frame))
+                break;
+            if(frame.width != 2 * engine.iplGray->width || frame.height != 2 * engine.iplGray->height)
+            {
+                printf("Frames are %dx%d, expected %dx%d \n", frame.width, frame.height,
+                       2 * engine.iplGray->width, 2 * engine.iplGray->height);
+                return 1;
+            }
+            FrameConvert::uyvyToHalfLuma(frame.uyvy, frame.step, engine.iplGray);
+        }
+        else
+        {
+            if(!frames.readFrame(engine.large_iplGray))
+                break;
+
+            //the camera thread takes the 2x2 mean, which area interpolation computes at 2:1
+            cvResize(engine.large_iplGray, engine.iplGray, CV_INTER_AREA);
+        }
+
+        long allocationsBefore = allocationCount();
+        bool tracked = engine.surfTrack();
+        long frameAllocations = allocationCount() - allocationsBefore;
+        const RecognitionStats& stats = engine.frameStats;
+
+        const char* event = "";
+        if(stats.recognized)
+            event = "recognized";
+        else if(stats.trackingLost)
+            event = "tracking_lost";
+        else if(stats.roiRecognition)
+            event = "reacquiring";
+        else if(stats.recognitionRun)
+            event = "searching";
+        else if(tracked)
+            event = "tracking";
+
+        //names of all tracked templates
+        std::string templateName;
+        for(int k = 0; k < RecognitionEngine::maxTargets; k++)
+        {
+            if(!engine.targets[k].active)
+                continue;
+            if(!templateName.empty())
+                templateName += ";";
+            templateName += engine.templateFeatures[engine.targets[k].templateIndex].imageName;
+        }
+
+        fprintf(out, "%ld,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d,%d,%d,%d,%ld,%ld,%s,%s\n",
+                frameIndex, stats.totalMs, stats.surfMs, stats.flannMs, stats.ransacMs,
+                stats.cornersMs, stats.lkMs, stats.trackHomographyMs,
+                stats.imageKeypoints, stats.matchedPairs, stats.verifiedCandidates, stats.trackedPoints, stats.lostPoints, stats.liveTargets,
+                frameAllocations, stats.matchAllocations, event, templateName.c_str());
+
+        totalAllocations += frameAllocations;
+        if(stats.flannMs > 0)
+        {
+            //the first match sizes the reused buffers, later ones should not allocate
+            if(matchedFrames > 0)
+                totalMatchAllocations += stats.matchAllocations;
+            matchedFrames++;
+            if(stats.bruteForceMatching)
+                bruteForceFrames++;
+            indexCandidates += stats.indexCandidates;
+        }
+
+        total.add(stats.totalMs);
+        surf.add(stats.surfMs);
+        flann.add(stats.flannMs);
+        ransac.add(stats.ransacMs);
+        corners.add(stats.cornersMs);
+        lk.add(stats.lkMs);
+        lkCheck.add(stats.lkCheckMs);
+        trackHomography.add(stats.trackHomographyMs);
+        frameTimes.push_back(stats.totalMs);
+
+        if(stats.recognitionRun)
+            recognitionAttempts++;
+        if(stats.roiRecognition)
+            roiRecognitionAttempts++;
+        verifiedCandidates += stats.verifiedCandidates;
+        ransacIterations += stats.ransacIterations;
+        if(stats.replenishedPoints > 0)
+            replenishments++;
+        replenishedPoints += stats.replenishedPoints;
+        rejectedPoints += stats.rejectedPoints;
+        predictedPoints += stats.predictedPoints;
+        predictionResidual += stats.predictionResidual;
+        if(stats.recognitionLatency > 0)
+        {
+            recognitionLatency += stats.recognitionLatency;
+            asyncResults++;
+        }
+        if(stats.recognized)
+            recognitions++;
+        if(stats.trackingLost)
+            trackingLosses++;
+        if(tracked)
+            trackedFrames++;
+
+        frameIndex++;
+    }
+
+    engine.cancelRecognition();
+    delete source;
+    if(out != stdout)
+        fclose(out);
+
+    FILE* report = outputPath.empty() ? stderr : stdout;
+    fprintf(report, "\nframes %ld, tracked %d, recognition attempts %d, recognitions %d, tracking losses %d\n",
+            frameIndex, trackedFrames, recognitionAttempts, recognitions, trackingLosses);
+    fprintf(report, "frame time p50 %.3f ms  p95 %.3f ms\n", percentile(frameTimes, 0.5), percentile(frameTimes, 0.95));
+    fprintf(report, "heap allocations per frame %.1f, per matching pass after the first %.1f\n",
+            frameIndex ? (double)totalAllocations / frameIndex : 0.0,
+            matchedFrames > 1 ? (double)totalMatchAllocations / (matchedFrames - 1) : 0.0);
+    fprintf(report, "%s features, matching passes %d, brute force (%s) %d\n", engine.featureExtractor->name(),
+            matchedFrames, BruteForceMatcher::kernelName(), bruteForceFrames);
+    if(matchedFrames > bruteForceFrames && indexCandidates > 0)
+        fprintf(report, "lsh candidates per indexed pass %.0f\n", (double)indexCandidates / (matchedFrames - bruteForceFrames));
+    KeypointBudget budget = engine.keypointBudget();
+    fprintf(report, "keypoints per whole frame %.1f, budget %d-%d, under %d, over %d of %d frames, final threshold %.1f%s\n",
+            budget.averageKeypoints, budget.minKeypoints, budget.maxKeypoints, budget.framesUnder, budget.framesOver,
+            budget.frames, budget.threshold, engine.adaptiveThreshold ? "" : " (fixed)");
+    fprintf(report, "recognition attempts near lost targets %d\n", roiRecognitionAttempts);
+    fprintf(report, "verified candidates per recognition attempt %.2f\n",
+            recognitionAttempts ? (double)verifiedCandidates / recognitionAttempts : 0.0);
+    fprintf(report, "ransac samples per verified candidate %.1f\n",
+            verifiedCandidates ? (double)ransacIterations / verifiedCandidates : 0.0);
+    if(engine.replenishPoints)
+        fprintf(report, "tracked points replenished %ld in %d frames\n", replenishedPoints, replenishments);
+    else
+        fprintf(report, "tracked points not replenished\n");
+    fprintf(report, "tracked points rejected by the error and forward-backward checks %ld\n", rejectedPoints);
+    if(engine.motionPrediction)
+        fprintf(report, "motion prediction residual %.2f px over %ld points\n",
+                predictedPoints ? predictionResidual / predictedPoints : 0.0, predictedPoints);
+    if(engine.asyncRecognition)
+        fprintf(report, "worker recognitions %d, frames from snapshot to result %.1f\n",
+                asyncResults, asyncResults ? (double)recognitionLatency / asyncResults : 0.0);
+    fprintf(report, "tracking losses per 1000 tracked frames %.2f\n",
+            trackedFrames ? 1000.0 * trackingLosses / trackedFrames : 0.0);
+    total.print(report, "frame");
+    surf.print(report, "surf");
+    flann.print(report, "flann");
+    ransac.print(report, "ransac");
+    corners.print(report, "corners");
+    lk.print(report, "lk");
+    lkCheck.print(report, "lk check");
+    trackHomography.print(report, "track homography");
+
+    return 0;
+}
@@ -0,0 +1,37 @@
+TEMPLATE = app
+TARGET = surf-replay
+
+CONFIG += console warn_on
+CONFIG -= qt app_bundle
+
+SOURCES += main.cpp \
+    FrameSequence.cpp \
+    ../../maemo-vision/RecognitionEngine.cpp \
+    ../../maemo-vision/TemplateDatabase.cpp \
+    ../../maemo-vision/BruteForceMatcher.cpp \
+    ../../maemo-vision/FeatureExtractor.cpp \
+    ../../maemo-vision/LshIndex.cpp \
+    ../../maemo-vision/VocabularyTree.cpp \
+    ../../maemo-vision/WorkerPool.cpp \
+    ../../maemo-vision/HomographyEstimator.cpp \
+    ../../maemo-vision/PointTransform.cpp \
+    ../../maemo-vision/FrameConvert.cpp \
+    ../../maemo-vision/FrameSource.cpp
+
+HEADERS += FrameSequence.h \
+    ../../maemo-vision/RecognitionEngine.h \
+    ../../maemo-vision/TemplateDatabase.h \
+    ../../maemo-vision/BruteForceMatcher.h \
+    ../../maemo-vision/FeatureExtractor.h \
+    ../../maemo-vision/LshIndex.h \
+    ../../maemo-vision/VocabularyTree.h \
+    ../../maemo-vision/WorkerPool.h \
+    ../../maemo-vision/HomographyEstimator.h \
+    ../../maemo-vision/PointTransform.h \
+    ../../maemo-vision/FrameConvert.h \
+    ../../maemo-vision/FrameSource.h
+
+INCLUDEPATH += ../../maemo-vision
+INCLUDEPATH += /usr/local/include
+LIBS += -L/usr/local/lib
+LIBS += -lcv -lcxcore -lcvaux -lhighgui -lml -lflann -lpthread
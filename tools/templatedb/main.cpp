@@ -0,0 +1,131 @@
+// Packs the per-template XML files written by RecognitionEngine::saveSurfFeatures()
+// into a single memory mappable template database (see TemplateDatabase.h).
+
+#include "RecognitionEngine.h"
+#include "TemplateDatabase.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static bool hasSuffix(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && strcasecmp(s.c_str() + s.size() - n, suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    //optional descriptor type to re-extract the templates with
+    int descriptorType = -1;
+    int first = 1;
+    if(argc > 2 && strcmp(argv[1], "-d") == 0)
+    {
+        if(strcmp(argv[2], "surf") == 0)
+            descriptorType = DESCRIPTOR_SURF;
+        else if(strcmp(argv[2], "brief") == 0)
+            descriptorType = DESCRIPTOR_BRIEF;
+        else
+            argc = 0;
+        first = 3;
+    }
+
+    if(argc < first + 2)
+    {
+        printf("usage: %s [-d surf|brief] <output.db> <template dir | template.xml> ...\n"
+               "  A template directory is converted to <dir>/%s when it is the only input\n"
+               "  and the output is given as '-'.\n"
+               "  With -d, every template is extracted again from its image with that descriptor.\n",
+               argv[0], TemplateDatabase::defaultFileName);
+        return 1;
+    }
+
+    std::string output = argv[first];
+    std::vector<std::string> xmlFiles;
+    for(int i = first + 1; i < argc; i++)
+    {
+        std::string path = argv[i];
+        struct stat _info;
+        if(stat(path.c_str(), &_info) != 0)
+        {
+            printf("Can't open %s \n", path.c_str());
+            return 1;
+        }
+        if(!S_ISDIR(_info.st_mode))
+        {
+            xmlFiles.push_back(path);
+            continue;
+        }
+
+        //same file selection as AppState::loadTemplateImageFeatures()
+        DIR* dir = opendir(path.c_str());
+        if(!dir)
+            return 1;
+        std::vector<std::string> _files;
+        struct dirent* entry;
+        while((entry = readdir(dir)) != NULL)
+        {
+            std::string name = entry->d_name;
+            if(hasSuffix(name, ".xml"))
+                _files.push_back(path + "/" + name);
+        }
+        closedir(dir);
+        std::sort(_files.begin(), _files.end());
+        xmlFiles.insert(xmlFiles.end(), _files.begin(), _files.end());
+
+        if(output == "-" && argc == first + 2)
+            output = path + "/" + TemplateDatabase::defaultFileName;
+    }
+    if(output == "-")
+    {
+        printf("An output file is needed for more than one input \n");
+        return 1;
+    }
+
+    RecognitionEngine engine;
+    for(unsigned int i = 0; i < xmlFiles.size(); i++)
+    {
+        engine.loadSurfFeatures(xmlFiles[i].c_str());
+    }
+    if(engine.templateFeatures.size() != xmlFiles.size())
+    {
+        printf("Only %d of %d template files could be read \n",
+               (int)engine.templateFeatures.size(), (int)xmlFiles.size());
+        return 1;
+    }
+
+    if(descriptorType >= 0)
+    {
+        //the template images are found under the names the XML files recorded
+        engine.setFeatureExtractor(descriptorType);
+        for(unsigned int i = 0; i < engine.templateFeatures.size(); i++)
+        {
+            SurfFeatures _templFeatures;
+            engine.createSurfFeaturesFromImage(_templFeatures, engine.templateFeatures[i].imageName);
+            if(_templFeatures.descriptors == NULL)
+            {
+                printf("Can't extract %s \n", engine.templateFeatures[i].imageName.c_str());
+                return 1;
+            }
+            engine.templateFeatures[i] = _templFeatures;
+        }
+    }
+
+    if(!engine.saveTemplateDatabase(output))
+        return 1;
+
+    int keypoints = 0;
+    for(unsigned int i = 0; i < engine.templateFeatures.size(); i++)
+    {
+        if(engine.templateFeatures[i].descriptors)
+            keypoints += engine.templateFeatures[i].descriptors->total;
+    }
+    printf("Wrote %d templates, %d keypoints to %s \n",
+           (int)engine.templateFeatures.size(), keypoints, output.c_str());
+    return 0;
+}
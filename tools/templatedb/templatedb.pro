@@ -0,0 +1,31 @@
+TEMPLATE = app
+TARGET = templatedb
+
+CONFIG += console warn_on
+CONFIG -= qt app_bundle
+
+SOURCES += main.cpp \
+    ../../maemo-vision/RecognitionEngine.cpp \
+    ../../maemo-vision/TemplateDatabase.cpp \
+    ../../maemo-vision/BruteForceMatcher.cpp \
+    ../../maemo-vision/FeatureExtractor.cpp \
+    ../../maemo-vision/LshIndex.cpp \
+    ../../maemo-vision/VocabularyTree.cpp \
+    ../../maemo-vision/WorkerPool.cpp \
+    ../../maemo-vision/HomographyEstimator.cpp \
+    ../../maemo-vision/PointTransform.cpp
+
+HEADERS += ../../maemo-vision/RecognitionEngine.h \
+    ../../maemo-vision/TemplateDatabase.h \
+    ../../maemo-vision/BruteForceMatcher.h \
+    ../../maemo-vision/FeatureExtractor.h \
+    ../../maemo-vision/LshIndex.h \
+    ../../maemo-vision/VocabularyTree.h \
+    ../../maemo-vision/WorkerPool.h \
+    ../../maemo-vision/HomographyEstimator.h \
+    ../../maemo-vision/PointTransform.h
+
+INCLUDEPATH += ../../maemo-vision
+INCLUDEPATH += /usr/local/include
+LIBS += -L/usr/local/lib
+LIBS += -lcv -lcxcore -lcvaux -lhighgui -lml -lflann -lpthread